@@ -8,7 +8,7 @@
  * Software Foundation; either version 2 of the License, or (at your option)
  * any later version.  See COPYING for more details.
  */
-#define APIVERSION "1.3"
+#define APIVERSION "1.4"
 
 #ifdef WIN32
 # define  _WINSOCK_DEPRECATED_NO_WARNINGS
@@ -46,6 +46,7 @@
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <fcntl.h>
 # define SOCKETTYPE long
 # define SOCKETFAIL(a) ((a) < 0)
 # define INVSOCK -1 /* INVALID_SOCKET */
@@ -53,6 +54,12 @@
 # define CLOSESOCKET close
 # define SOCKETINIT {}
 # define SOCKERRMSG strerror(errno)
+# define SOCKWOULDBLOCK (errno == EAGAIN || errno == EWOULDBLOCK)
+# ifdef MSG_NOSIGNAL
+#  define SENDFLAGS MSG_NOSIGNAL
+# else
+#  define SENDFLAGS 0
+# endif
 #else
 # define SOCKETTYPE SOCKET
 # define SOCKETFAIL(a) ((a) == SOCKET_ERROR)
@@ -60,6 +67,13 @@
 # define INVINETADDR INADDR_NONE
 # define CLOSESOCKET closesocket
 # define in_addr_t uint32_t
+# define SOCKWOULDBLOCK (WSAGetLastError() == WSAEWOULDBLOCK)
+# define SENDFLAGS 0
+#endif
+
+#ifdef __linux__
+# include <sys/epoll.h>
+# define API_EPOLL
 #endif
 
 #define GROUP(g) (toupper(g))
@@ -86,12 +100,45 @@ static struct IP4ACCESS *ipaccess = NULL;
 
 #define MYBUFSIZ       16384
 #define SOCK_REC_BUFSZ 1024
-#define QUEUE          10
+#define QUEUE          128
+
+/* clients served at once, more are turned away */
+#ifdef API_EPOLL
+#define API_MAX_CLIENTS  256
+#else
+#define API_MAX_CLIENTS  (FD_SETSIZE - 1)
+#endif
+/* seconds a client may stay idle or stalled on a response */
+#define API_IDLE_TIMEOUT 30
+/* room for the HTTP or WebSocket header of a response */
+#define API_HDR_SIZE     512
+
+/* a client connection, served by the API thread only */
+struct api_conn {
+	SOCKETTYPE sock;
+	int slot;          /* in api_conns[] */
+	char group;
+	bool keepalive;    /* HTTP/1.1, more requests may follow */
+	bool closing;      /* closed once the response is sent */
+	bool writing;      /* waiting for room to send, see api_watch() */
+	time_t last_io;
+	uint in_len;
+	uint out_len;
+	uint out_pos;
+	uint out_size;
+	char in[SOCK_REC_BUFSZ + 1];
+	char body[MYBUFSIZ + 1];
+	char *out;         /* grown for the metrics */
+};
+
+static struct api_conn *api_conns[API_MAX_CLIENTS];
+#ifdef API_EPOLL
+static int api_epfd = -1;
+#endif
 
 #define ALLIP4         "0.0.0.0"
 static const char *localaddr = "127.0.0.1";
 static const char *UNAVAILABLE = " - API will not be available";
-static char *buffer = NULL;
 static time_t startup = 0;
 static int bye = 0;
 
@@ -100,7 +147,7 @@ extern int opt_api_listen; /* port */
 extern uint32_t accepted_count;
 extern uint32_t rejected_count;
 extern int num_cpus;
-extern struct stratum_ctx stratum;
+extern struct stratum_ctx *stratum;
 extern char* rpc_user;
 
 // sysinfos.cpp
@@ -114,13 +161,37 @@ char driver_version[32] = { 0 };
 
 /***************************************************************/
 
-static void gpustatus(int thr_id)
+/* Estimated speeds of a thread: 1, 5, 15 minutes and from the shares */
+static int estimates(int thr_id, char *buf, size_t len)
 {
-	if (thr_id >= 0 && thr_id < opt_n_threads) {
+	struct stats_estimate est;
+
+	stats_get_estimate(thr_id, &est);
+	return snprintf(buf, len, "KHS1M=%.2f;KHS5M=%.2f;KHS15M=%.2f;EKHS=%.2f;",
+		est.ewma[0] / 1000.0, est.ewma[1] / 1000.0, est.ewma[2] / 1000.0,
+		est.effective[2] / 1000.0);
+}
+
+static void gpustatus(int thr_id, char *buffer)
+{
+	if (thr_id >= 0 && thr_id < opt_n_threads && is_cpu_thread(thr_id)) {
+		char buf[256]; *buf = '\0';
+		int n;
+
+		n = snprintf(buf, sizeof(buf), "CPU=%d;KHS=%.2f;",
+			cpu_thread_index(thr_id),
+			stats_get_speed(thr_id, 0.0) / 1000.0);
+		n += estimates(thr_id, &buf[n], sizeof(buf) - n);
+		buf[n - 1] = '|';
+
+		strcat(buffer, buf);
+	} else if (thr_id >= 0 && thr_id < opt_n_threads) {
 		struct cgpu_info *cgpu = &thr_info[thr_id].gpu;
+		struct stats_estimate est;
 		int gpuid = cgpu->gpu_id;
 		char buf[512]; *buf = '\0';
 		char* card;
+		int n;
 
 #ifdef USE_WRAPNVML
 		cgpu->has_monitoring = true;
@@ -139,11 +210,17 @@ static void gpustatus(int thr_id)
 
 		card = device_name[gpuid];
 
-		snprintf(buf, sizeof(buf), "GPU=%d;BUS=%hd;CARD=%s;"
-			"TEMP=%.1f;FAN=%hu;RPM=%hu;FREQ=%d;KHS=%.2f;HWF=%d;I=%.1f;THR=%u|",
+		stats_get_estimate(thr_id, &est);
+
+		n = snprintf(buf, sizeof(buf), "GPU=%d;BUS=%hd;CARD=%s;"
+			"TEMP=%.1f;FAN=%hu;RPM=%hu;FREQ=%d;KHS=%.2f;HWF=%d;I=%.1f;THR=%u;",
 			gpuid, cgpu->gpu_bus, card, cgpu->gpu_temp, cgpu->gpu_fan,
 			cgpu->gpu_fan_rpm, cgpu->gpu_clock, cgpu->khashes,
 			cgpu->hw_errors, cgpu->intensity, cgpu->throughput);
+		n += estimates(thr_id, &buf[n], sizeof(buf) - n);
+		/* batch times in ms */
+		snprintf(&buf[n], sizeof(buf) - n, "P50=%.1f;P95=%.1f|",
+			est.batch_p50 * 1000.0, est.batch_p95 * 1000.0);
 
 		// append to buffer for multi gpus
 		strcat(buffer, buf);
@@ -153,11 +230,11 @@ static void gpustatus(int thr_id)
 /**
 * Returns gpu/thread specific stats
 */
-static char *getthreads(char *params)
+static char *getthreads(char *params, char *buffer)
 {
 	*buffer = '\0';
 	for (int i = 0; i < opt_n_threads; i++)
-		gpustatus(i);
+		gpustatus(i, buffer);
 	return buffer;
 }
 
@@ -166,7 +243,7 @@ static char *getthreads(char *params)
 /**
 * Returns miner global infos
 */
-static char *getsummary(char *params)
+static char *getsummary(char *params, char *buffer)
 {
 	char algo[64]; *algo = '\0';
 	time_t ts = time(NULL);
@@ -189,38 +266,38 @@ static char *getsummary(char *params)
 /**
  * Returns some infos about current pool
  */
-static char *getpoolnfo(char *params)
+static char *getpoolnfo(char *params, char *buffer)
 {
 	char *p = buffer;
 	char jobid[128] = { 0 };
 	char nonce[128] = { 0 };
 	*p = '\0';
 
-	if (!stratum.url) {
+	if (!have_stratum || !stratum->url) {
 		sprintf(p, "|");
 		return p;
 	}
 
-	if (stratum.job.job_id)
-		strncpy(jobid, stratum.job.job_id, sizeof(stratum.job.job_id));
+	if (stratum->job.job_id)
+		strncpy(jobid, stratum->job.job_id, sizeof(stratum->job.job_id));
 
-	if (stratum.job.xnonce2) {
+	if (stratum->job.xnonce2) {
 		/* used temporary to be sure all is ok */
-		cbin2hex(nonce, (const char*) stratum.job.xnonce2, stratum.xnonce2_size);
+		cbin2hex(nonce, (const char*) stratum->job.xnonce2, stratum->xnonce2_size);
 	}
 
 	snprintf(p, MYBUFSIZ, "URL=%s;USER=%s;H=%u;JOB=%s;DIFF=%.6f;N2SZ=%d;N2=0x%s;PING=%u;DISCO=%u;UPTIME=%u|",
-		stratum.url, rpc_user ? rpc_user : "",
-		stratum.job.height, jobid, stratum.job.diff,
-		(int) stratum.xnonce2_size, nonce, stratum.answer_msec,
-		stratum.disconnects, (uint32_t) (time(NULL) - stratum.tm_connected));
+		stratum->url, stratum->user ? stratum->user : "",
+		stratum->job.height, jobid, stratum->job.diff,
+		(int) stratum->xnonce2_size, nonce, stratum->answer_msec,
+		stratum->disconnects, (uint32_t) (time(NULL) - stratum->tm_connected));
 
 	return p;
 }
 
 /*****************************************************************************/
 
-static void gpuhwinfos(int gpu_id)
+static void gpuhwinfos(int gpu_id, char *buffer)
 {
 	char buf[256];
 	char pstate[8];
@@ -288,7 +365,7 @@ static const char* os_name()
 /**
  * System and CPU Infos
  */
-static void syshwinfos()
+static void syshwinfos(char *buffer)
 {
 	char buf[256];
 
@@ -304,12 +381,12 @@ static void syshwinfos()
 /**
  * Returns gpu and system (todo) informations
  */
-static char *gethwinfos(char *params)
+static char *gethwinfos(char *params, char *buffer)
 {
 	*buffer = '\0';
 	for (int i = 0; i < cuda_num_devices(); i++)
-		gpuhwinfos(i);
-	syshwinfos();
+		gpuhwinfos(i, buffer);
+	syshwinfos(buffer);
 	return buffer;
 }
 
@@ -319,7 +396,7 @@ static char *gethwinfos(char *params)
  * Returns the last 50 scans stats
  * optional param thread id (default all)
  */
-static char *gethistory(char *params)
+static char *gethistory(char *params, char *buffer)
 {
 	struct stats_data data[50];
 	int thrid = params ? atoi(params) : -1;
@@ -328,9 +405,9 @@ static char *gethistory(char *params)
 	*buffer = '\0';
 	for (int i = 0; i < records; i++) {
 		time_t ts = data[i].tm_stat;
-		p += sprintf(p, "GPU=%d;H=%u;KHS=%.2f;DIFF=%.6f;"
+		p += sprintf(p, "GPU=%d;H=%u;KHS=%.2f;KHS1M=%.2f;DIFF=%.6f;"
 				"COUNT=%u;FOUND=%u;ID=%u;TS=%u|",
-			data[i].gpu_id, data[i].height, data[i].hashrate, data[i].difficulty,
+			data[i].gpu_id, data[i].height, data[i].hashrate, data[i].ewma, data[i].difficulty,
 			data[i].hashcount, data[i].hashfound, data[i].uid, (uint32_t)ts);
 	}
 	return buffer;
@@ -339,7 +416,7 @@ static char *gethistory(char *params)
 /**
  * Returns the job scans ranges (debug purpose)
  */
-static char *getscanlog(char *params)
+static char *getscanlog(char *params, char *buffer)
 {
 	struct hashlog_data data[50];
 	char *p = buffer;
@@ -358,7 +435,7 @@ static char *getscanlog(char *params)
 /**
  * Some debug infos about memory usage
  */
-static char *getmeminfo(char *params)
+static char *getmeminfo(char *params, char *buffer)
 {
 	uint64_t smem, hmem, totmem;
 	uint32_t srec, hrec;
@@ -376,10 +453,257 @@ static char *getmeminfo(char *params)
 
 /*****************************************************************************/
 
-static char *gethelp(char *params);
+/* text of a size not known in advance */
+struct api_text {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void text_printf(struct api_text *t, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = t->buf ? vsnprintf(&t->buf[t->len], t->size - t->len, fmt, ap) : -1;
+		va_end(ap);
+		if (n >= 0 && t->len + n < t->size) {
+			t->len += n;
+			return;
+		}
+
+		size_t size = t->size ? t->size * 2 : MYBUFSIZ;
+		if (n >= 0 && size < t->len + n + 1)
+			size = t->len + n + 1;
+		char *buf = (char *) realloc(t->buf, size);
+		if (!buf)
+			return;
+		t->buf = buf;
+		t->size = size;
+	}
+}
+
+/* value of a label, escaped */
+static const char *metrics_label(char *dst, size_t len, const char *src)
+{
+	size_t i = 0;
+
+	for (; src && *src && i + 2 < len; src++) {
+		if (*src == '\\' || *src == '"' || *src == '\n') {
+			dst[i++] = '\\';
+			dst[i++] = (*src == '\n') ? 'n' : *src;
+		} else
+			dst[i++] = *src;
+	}
+	dst[i] = '\0';
+	return dst;
+}
+
+static void metrics_thread_labels(int thr_id, char *labels, size_t len)
+{
+	char name[128];
+
+	if (is_cpu_thread(thr_id))
+		snprintf(labels, len, "thread=\"%d\",device=\"cpu%d\",name=\"CPU\"",
+			thr_id, cpu_thread_index(thr_id));
+	else
+		snprintf(labels, len, "thread=\"%d\",device=\"gpu%d\",name=\"%s\"",
+			thr_id, device_map[thr_id],
+			metrics_label(name, sizeof(name), device_name[device_map[thr_id]]));
+}
+
+static void metrics_pool_labels(int pooln, char *labels, size_t len)
+{
+	char url[256];
+
+	snprintf(labels, len, "pool=\"%d\",url=\"%s\"", pooln,
+		metrics_label(url, sizeof(url), pools[pooln].url));
+}
+
+static void metrics_hist_print(struct api_text *t, const char *name,
+	const char *labels, const struct metrics_hist *hist)
+{
+	struct metrics_hist h;
+	uint64_t n = 0;
+	int i;
+
+	metrics_hist_get(hist, &h);
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		n += h.count[i];
+		text_printf(t, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+			metrics_bounds[i], (unsigned long long) n);
+	}
+	n += h.count[METRICS_BUCKETS];
+	text_printf(t, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long) n);
+	text_printf(t, "%s_sum{%s} %.6f\n", name, labels, h.sum);
+	text_printf(t, "%s_count{%s} %llu\n", name, labels, (unsigned long long) n);
+}
+
+#define METRIC(t, name, type, help) \
+	text_printf(t, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+/**
+ * Counters and gauges in the Prometheus text format, served at /metrics
+ */
+static void getmetrics(struct api_text *t)
+{
+	static const char *results[] = { "accepted", "rejected", "stale" };
+	char algo[64];
+	char labels[512];
+	uint64_t smem, hmem;
+	uint32_t srec, hrec;
+	int i, r;
+
+	get_currentalgo(algo, sizeof(algo));
+	METRIC(t, "cudaminer_info", "gauge", "Version and algorithm of the miner");
+	text_printf(t, "cudaminer_info{version=\"%s\",algo=\"%s\"} 1\n", PACKAGE_VERSION, algo);
+	METRIC(t, "cudaminer_uptime_seconds", "gauge", "Time since the start");
+	text_printf(t, "cudaminer_uptime_seconds %.0f\n", difftime(time(NULL), startup));
+
+	METRIC(t, "cudaminer_hashrate", "gauge", "Hashes per second of a device over the recent scans");
+	for (i = 0; i < opt_n_threads; i++) {
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_hashrate{%s} %.2f\n", labels, stats_get_speed(i, 0.0));
+	}
+
+	METRIC(t, "cudaminer_hashrate_average", "gauge", "Hashes per second of a device weighted by scan time");
+	for (i = 0; i < opt_n_threads; i++) {
+		struct stats_estimate est;
+		stats_get_estimate(i, &est);
+		metrics_thread_labels(i, labels, sizeof(labels));
+		for (r = 0; r < STATS_HORIZONS; r++)
+			text_printf(t, "cudaminer_hashrate_average{%s,horizon=\"%dm\"} %.2f\n",
+				labels, stats_horizons[r] / 60, est.ewma[r]);
+	}
+	METRIC(t, "cudaminer_hashrate_effective", "gauge", "Hashes per second the accepted shares stand for");
+	for (i = 0; i < opt_n_threads; i++) {
+		struct stats_estimate est;
+		stats_get_estimate(i, &est);
+		metrics_thread_labels(i, labels, sizeof(labels));
+		for (r = 0; r < STATS_HORIZONS; r++)
+			text_printf(t, "cudaminer_hashrate_effective{%s,horizon=\"%dm\"} %.2f\n",
+				labels, stats_horizons[r] / 60, est.effective[r]);
+	}
+
+	METRIC(t, "cudaminer_shares_total", "counter", "Shares answered by a pool");
+	for (i = 0; i < num_pools; i++) {
+		const uint32_t counts[] = { pools[i].accepted, pools[i].rejected, pools[i].stale };
+		metrics_pool_labels(i, labels, sizeof(labels));
+		for (r = 0; r < (int) ARRAY_SIZE(results); r++)
+			text_printf(t, "cudaminer_shares_total{%s,result=\"%s\"} %u\n",
+				labels, results[r], counts[r]);
+	}
+	if (have_stratum) {
+		METRIC(t, "cudaminer_pool_up", "gauge", "Stratum pool connected");
+		for (i = 0; i < num_pools; i++) {
+			metrics_pool_labels(i, labels, sizeof(labels));
+			text_printf(t, "cudaminer_pool_up{%s} %d\n", labels, stratum_is_online(&pools[i]) ? 1 : 0);
+		}
+		METRIC(t, "cudaminer_pool_disconnects_total", "counter", "Stratum disconnections");
+		for (i = 0; i < num_pools; i++) {
+			metrics_pool_labels(i, labels, sizeof(labels));
+			text_printf(t, "cudaminer_pool_disconnects_total{%s} %u\n", labels, pools[i].disconnects);
+		}
+		METRIC(t, "cudaminer_shares_unanswered_total", "counter", "Shares a pool never answered");
+		for (i = 0; i < num_pools; i++) {
+			metrics_pool_labels(i, labels, sizeof(labels));
+			text_printf(t, "cudaminer_shares_unanswered_total{%s} %u\n", labels, pools[i].unanswered);
+		}
+	}
+	METRIC(t, "cudaminer_submit_latency_seconds", "histogram", "Time for a pool to answer a share");
+	for (i = 0; i < num_pools; i++) {
+		metrics_pool_labels(i, labels, sizeof(labels));
+		metrics_hist_print(t, "cudaminer_submit_latency_seconds", labels, &pools[i].submit_latency);
+	}
+
+	METRIC(t, "cudaminer_batch_seconds", "histogram", "Time of a GPU batch");
+	for (i = 0; i < opt_n_threads; i++) {
+		if (is_cpu_thread(i))
+			continue;
+		metrics_thread_labels(i, labels, sizeof(labels));
+		metrics_hist_print(t, "cudaminer_batch_seconds", labels, &thr_info[i].gpu.batch_time);
+	}
+
+	METRIC(t, "cudaminer_batch_quantile_seconds", "gauge", "Time of the recent GPU batches");
+	for (i = 0; i < opt_n_threads; i++) {
+		struct stats_estimate est;
+		if (is_cpu_thread(i))
+			continue;
+		stats_get_estimate(i, &est);
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_batch_quantile_seconds{%s,quantile=\"0.5\"} %.6f\n", labels, est.batch_p50);
+		text_printf(t, "cudaminer_batch_quantile_seconds{%s,quantile=\"0.95\"} %.6f\n", labels, est.batch_p95);
+	}
+
+	METRIC(t, "cudaminer_work_restarts_total", "counter", "Restarts of the miner threads on new work");
+	text_printf(t, "cudaminer_work_restarts_total %llu\n",
+		(unsigned long long) metrics_work_restarts());
+
+	stats_getmeminfo(&smem, &srec);
+	hashlog_getmeminfo(&hmem, &hrec);
+	METRIC(t, "cudaminer_memory_bytes", "gauge", "Memory of the scan stats and the hash log");
+	text_printf(t, "cudaminer_memory_bytes{store=\"stats\"} %llu\n", (unsigned long long) smem);
+	text_printf(t, "cudaminer_memory_bytes{store=\"hashlog\"} %llu\n", (unsigned long long) hmem);
+	METRIC(t, "cudaminer_memory_records", "gauge", "Records of the scan stats and the hash log");
+	text_printf(t, "cudaminer_memory_records{store=\"stats\"} %u\n", srec);
+	text_printf(t, "cudaminer_memory_records{store=\"hashlog\"} %u\n", hrec);
+
+	/* sensors, one reading per device for all the series */
+	METRIC(t, "cudaminer_gpu_clock_hertz", "gauge", "GPU core clock");
+	for (i = 0; i < opt_n_threads; i++) {
+		struct cgpu_info *cgpu = &thr_info[i].gpu;
+		if (is_cpu_thread(i))
+			continue;
+#ifdef USE_WRAPNVML
+		cgpu->has_monitoring = true;
+		cgpu->gpu_temp = gpu_temp(cgpu);
+		cgpu->gpu_fan = (uint16_t) gpu_fanpercent(cgpu);
+		cgpu->gpu_fan_rpm = (uint16_t) gpu_fanrpm(cgpu);
+#endif
+		cuda_gpu_clocks(cgpu);
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_gpu_clock_hertz{%s} %.0f\n", labels, 1e6 * cgpu->gpu_clock);
+	}
+#ifdef USE_WRAPNVML
+	METRIC(t, "cudaminer_gpu_temperature_celsius", "gauge", "GPU temperature");
+	for (i = 0; i < opt_n_threads; i++) {
+		if (is_cpu_thread(i))
+			continue;
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_gpu_temperature_celsius{%s} %.1f\n", labels,
+			thr_info[i].gpu.gpu_temp);
+	}
+	METRIC(t, "cudaminer_gpu_fan_percent", "gauge", "GPU fan speed");
+	for (i = 0; i < opt_n_threads; i++) {
+		if (is_cpu_thread(i))
+			continue;
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_gpu_fan_percent{%s} %hu\n", labels, thr_info[i].gpu.gpu_fan);
+	}
+	METRIC(t, "cudaminer_gpu_fan_rpm", "gauge", "GPU fan speed");
+	for (i = 0; i < opt_n_threads; i++) {
+		if (is_cpu_thread(i))
+			continue;
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_gpu_fan_rpm{%s} %hu\n", labels, thr_info[i].gpu.gpu_fan_rpm);
+	}
+	METRIC(t, "cudaminer_gpu_power_watts", "gauge", "GPU power draw");
+	for (i = 0; i < opt_n_threads; i++) {
+		if (is_cpu_thread(i))
+			continue;
+		metrics_thread_labels(i, labels, sizeof(labels));
+		text_printf(t, "cudaminer_gpu_power_watts{%s} %.3f\n", labels,
+			1e-3 * gpu_power(&thr_info[i].gpu));
+	}
+#endif
+}
+
+static char *gethelp(char *params, char *buffer);
 struct CMDS {
 	const char *name;
-	char *(*func)(char *);
+	char *(*func)(char *, char *);
 } cmds[] = {
 	{ "summary", getsummary },
 	{ "threads", getthreads },
@@ -393,7 +717,7 @@ struct CMDS {
 };
 #define CMDMAX ARRAY_SIZE(cmds)
 
-static char *gethelp(char *params)
+static char *gethelp(char *params, char *buffer)
 {
 	*buffer = '\0';
 	char * p = buffer;
@@ -405,18 +729,6 @@ static char *gethelp(char *params)
 
 /*****************************************************************************/
 
-static int send_result(SOCKETTYPE c, char *result)
-{
-	int n;
-	if (!result) {
-		n = send(c, "", 1, 0);
-	} else {
-		// ignore failure - it's closed immediately anyway
-        n = send(c, result, (uint)(strlen(result) + 1), 0);
-	}
-	return n;
-}
-
 /* ---- Base64 Encoding/Decoding Table --- */
 static const char table64[]=
   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -488,7 +800,7 @@ static size_t base64_encode(const uchar *indata, size_t insize, char *outptr, si
 //#include "compat/curl-for-windows/openssl/openssl/crypto/sha/sha.h"
 
 /* websocket handshake (tested in Chrome) */
-static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
+static int websocket_handshake(struct api_conn *conn, char *result, char *clientkey)
 {
 	char answer[256];
 	char inpkey[128] = { 0 };
@@ -544,20 +856,14 @@ static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
 	}
 
 	size_t handlen = strlen(answer);
-	uchar *data = (uchar*) calloc(1, handlen + frames + (size_t) datalen + 1);
-	if (data == NULL)
-		return -1;
-	else {
-		uchar *p = data;
-		// HTTP header 101
-		memcpy(p, answer, handlen);
-		p += handlen;
-		// WebSocket Frame - Header + Data
-		memcpy(p, hd, frames);
-		memcpy(p + frames, result, (size_t)datalen);
-        send(c, (const char *) data, (uint)(strlen(answer) + frames + datalen + 1), 0);
-		free(data);
-	}
+	uchar *p = (uchar *) conn->out;
+	// HTTP header 101
+	memcpy(p, answer, handlen);
+	p += handlen;
+	// WebSocket Frame - Header + Data
+	memcpy(p, hd, frames);
+	memcpy(p + frames, result, (size_t)datalen + 1);
+	conn->out_len = (uint)(handlen + frames + datalen + 1);
 	return 0;
 }
 
@@ -679,24 +985,450 @@ static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *gro
 	return addrok;
 }
 
+static void api_nonblock(SOCKETTYPE sock)
+{
+#ifdef WIN32
+	u_long on = 1;
+	ioctlsocket(sock, FIONBIO, &on);
+#else
+	fcntl((int) sock, F_SETFL, fcntl((int) sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+/**
+ * Watch a client for its next request, or for room to send its response
+ */
+static void api_watch(struct api_conn *conn, bool add)
+{
+#ifdef API_EPOLL
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = conn->writing ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(api_epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, (int) conn->sock, &ev);
+#endif
+}
+
+static void api_close(struct api_conn *conn)
+{
+	/* closing also removes it from the epoll set */
+	CLOSESOCKET(conn->sock);
+	api_conns[conn->slot] = NULL;
+	free(conn->out);
+	free(conn);
+}
+
+static void api_accept(SOCKETTYPE apisock)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	struct api_conn *conn;
+	char *connectaddr;
+	char group;
+	SOCKETTYPE c;
+	bool addrok;
+	int slot;
+
+	while (1) {
+		clisiz = sizeof(cli);
+		c = accept(apisock, (struct sockaddr *)(&cli), &clisiz);
+		if (c == INVSOCK) {
+			if (!SOCKWOULDBLOCK && opt_debug)
+				applog(LOG_DEBUG, "API accept failed (%s)", SOCKERRMSG);
+			return;
+		}
+
+		addrok = check_connect(&cli, &connectaddr, &group);
+		if (opt_debug && opt_protocol)
+			applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+		if (!addrok) {
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		for (slot = 0; slot < API_MAX_CLIENTS && api_conns[slot]; slot++);
+		conn = (slot < API_MAX_CLIENTS) ?
+			(struct api_conn *) calloc(1, sizeof(*conn)) : NULL;
+		if (conn) {
+			conn->out_size = API_HDR_SIZE + MYBUFSIZ + 1;
+			conn->out = (char *) malloc(conn->out_size);
+			if (!conn->out) {
+				free(conn);
+				conn = NULL;
+			}
+		}
+		if (!conn) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "API: too many clients, %s turned away", connectaddr);
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		api_nonblock(c);
+		conn->sock = c;
+		conn->slot = slot;
+		conn->group = group;
+		conn->last_io = time(NULL);
+		api_conns[slot] = conn;
+		api_watch(conn, true);
+	}
+}
+
+/**
+ * Value of a header in a HTTP request, NULL if not there
+ */
+static const char *api_header(const char *req, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = req;
+
+	while ((p = strchr(p, '\n')) != NULL) {
+		p++;
+		if (!strncasecmp(p, name, len) && p[len] == ':') {
+			p += len + 1;
+			while (*p == ' ')
+				p++;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static bool api_keepalive(const char *req)
+{
+	const char *value = api_header(req, "Connection");
+	size_t len = strcspn(req, "\r\n");
+
+	if (value && !strncasecmp(value, "close", 5))
+		return false;
+	if (value && !strncasecmp(value, "keep-alive", 10))
+		return true;
+	/* the default of HTTP/1.1, not of 1.0 */
+	return len >= 8 && !strncmp(&req[len - 8], "HTTP/1.1", 8);
+}
+
+/**
+ * HTTP response of a request
+ * @param body const char * of len bytes, NULL if not found
+ * @return bool false if out of memory
+ */
+static bool api_http_reply(struct api_conn *conn, const char *type,
+	const char *body, size_t len)
+{
+	if (API_HDR_SIZE + len > conn->out_size) {
+		char *out = (char *) realloc(conn->out, API_HDR_SIZE + len);
+		if (!out)
+			return false;
+		conn->out = out;
+		conn->out_size = (uint) (API_HDR_SIZE + len);
+	}
+
+	conn->out_len = (uint) snprintf(conn->out, API_HDR_SIZE,
+		"HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\n"
+		"Connection: %s\r\n\r\n", body ? "200 OK" : "404 Not Found", type,
+		(uint) len, conn->keepalive ? "keep-alive" : "close");
+	memcpy(&conn->out[conn->out_len], body, len);
+	conn->out_len += (uint) len;
+	return true;
+}
+
+/**
+ * Run the command of the first request received into the connection output
+ * @return int 1 once done, 0 if the request is not complete yet, -1 if invalid
+ */
+static int api_request(struct api_conn *conn)
+{
+	char *buf = conn->in, *end, *params;
+	char cmd[256] = { 0 };
+	char wskey[64] = { 0 };
+	char *result = NULL;
+	bool http, metrics;
+	uint used;
+	int i;
+
+	buf[conn->in_len] = '\0';
+	http = !strncmp(buf, "GET /", 5);
+
+	if (http) {
+		/* the whole header first */
+		end = strstr(buf, "\r\n\r\n");
+		used = 4;
+		if (!end) {
+			end = strstr(buf, "\n\n");
+			used = 2;
+		}
+		if (!end)
+			return (conn->in_len < SOCK_REC_BUFSZ) ? 0 : -1;
+		*end = '\0';
+		used += (uint)(end - buf);
+
+		conn->keepalive = api_keepalive(buf);
+		conn->closing = !conn->keepalive;
+
+		sscanf(&buf[5], "%255s", cmd);
+		params = strchr(cmd, '/');
+		if (params)
+			*(params++) = '|';
+		params = strchr(cmd, '/');
+		if (params)
+			*(params++) = '\0';
+
+		/* Websocket requests compat. */
+		const char *key = api_header(buf, "Sec-WebSocket-Key");
+		if (key) {
+			for (i = 0; i < (int) sizeof(wskey) - 1 && key[i] > ' '; i++)
+				wskey[i] = key[i];
+			conn->closing = true;
+		}
+	} else {
+		/* a command line as sent by the monitoring tools, answered once */
+		end = strchr(buf, '\n');
+		used = end ? (uint)(end - buf) + 1 : conn->in_len;
+		if (end) {
+			/* telnet compat \r\n */
+			*end = '\0';
+			if (end > buf && end[-1] == '\r')
+				end[-1] = '\0';
+		}
+		snprintf(cmd, sizeof(cmd), "%.*s", (int) sizeof(cmd) - 1, buf);
+		conn->closing = true;
+	}
+
+	params = strchr(cmd, '|');
+	if (params != NULL)
+		*(params++) = '\0';
+
+	if (opt_debug && opt_protocol && *cmd)
+		applog(LOG_DEBUG, "API: exec command %s(%s)", cmd, params ? params : "");
+
+	metrics = http && !*wskey && !strcmp(cmd, "metrics");
+
+	for (i = 0; i < CMDMAX && *cmd && !metrics; i++) {
+		if (strcmp(cmd, cmds[i].name) == 0) {
+			result = (cmds[i].func)(params, conn->body);
+			break;
+		}
+	}
+
+	conn->in_len -= used;
+	memmove(buf, &buf[used], conn->in_len);
+
+	conn->out_len = conn->out_pos = 0;
+	if (metrics) {
+		/* Prometheus scrapes */
+		struct api_text text = { 0 };
+		bool ok;
+
+		getmetrics(&text);
+		ok = text.buf && api_http_reply(conn, "text/plain; version=0.0.4",
+			text.buf, text.len);
+		free(text.buf);
+		if (!ok)
+			return -1;
+	} else if (*wskey) {
+		if (result)
+			websocket_handshake(conn, result, wskey);
+	} else if (http) {
+		if (!api_http_reply(conn, "text/plain", result, result ? strlen(result) : 0))
+			return -1;
+	} else if (result) {
+		conn->out_len = (uint) strlen(result) + 1;
+		memcpy(conn->out, result, conn->out_len);
+	}
+
+	return 1;
+}
+
+/**
+ * Send what the socket takes of the response
+ * @return bool false if the connection is closed
+ */
+static bool api_flush(struct api_conn *conn)
+{
+	while (conn->out_pos < conn->out_len) {
+		int n = send(conn->sock, &conn->out[conn->out_pos],
+			(int)(conn->out_len - conn->out_pos), SENDFLAGS);
+		if (n < 0 && SOCKWOULDBLOCK)
+			break;
+		if (n <= 0) {
+			api_close(conn);
+			return false;
+		}
+		conn->out_pos += n;
+		conn->last_io = time(NULL);
+	}
+
+	if (conn->out_pos < conn->out_len) {
+		if (!conn->writing) {
+			conn->writing = true;
+			api_watch(conn, false);
+		}
+		return true;
+	}
+
+	conn->out_len = conn->out_pos = 0;
+	if (conn->closing) {
+		api_close(conn);
+		return false;
+	}
+	if (conn->writing) {
+		conn->writing = false;
+		api_watch(conn, false);
+	}
+	return true;
+}
+
+/**
+ * Answer the requests received, one response in flight at a time
+ */
+static void api_serve(struct api_conn *conn)
+{
+	while (!conn->writing && conn->in_len) {
+		int rc = api_request(conn);
+		if (rc < 0) {
+			api_close(conn);
+			return;
+		}
+		if (rc == 0)
+			return;
+		if (!api_flush(conn))
+			return;
+	}
+}
+
+static void api_read(struct api_conn *conn)
+{
+	int n = recv(conn->sock, &conn->in[conn->in_len],
+		(int)(SOCK_REC_BUFSZ - conn->in_len), 0);
+
+	if (n < 0 && SOCKWOULDBLOCK)
+		return;
+	if (n <= 0) {
+		api_close(conn);
+		return;
+	}
+	conn->in_len += n;
+	conn->last_io = time(NULL);
+	api_serve(conn);
+}
+
+/* idle and stalled clients go, they would hold their slot forever */
+static void api_expire()
+{
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < API_MAX_CLIENTS; i++) {
+		if (api_conns[i] && now - api_conns[i]->last_io > API_IDLE_TIMEOUT)
+			api_close(api_conns[i]);
+	}
+}
+
+/**
+ * Event loop of the API: the clients are served concurrently by this
+ * thread with non-blocking sockets, epoll on linux and select elsewhere
+ */
+static void api_loop(SOCKETTYPE apisock)
+{
+	time_t expired = time(NULL);
+	struct api_conn *conn;
+	int i, n;
+
+#ifdef API_EPOLL
+	struct epoll_event events[64];
+	struct epoll_event ev;
+
+	api_epfd = epoll_create(API_MAX_CLIENTS);
+	if (api_epfd < 0) {
+		applog(LOG_ERR, "API epoll failed (%s)%s", strerror(errno), UNAVAILABLE);
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(api_epfd, EPOLL_CTL_ADD, (int) apisock, &ev);
+#endif
+
+	while (bye == 0) {
+#ifdef API_EPOLL
+		n = epoll_wait(api_epfd, events, ARRAY_SIZE(events), 1000);
+		if (n < 0 && errno != EINTR) {
+			applog(LOG_ERR, "API failed (%s)%s", strerror(errno), UNAVAILABLE);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			conn = (struct api_conn *) events[i].data.ptr;
+			if (!conn)
+				api_accept(apisock);
+			else if (conn->writing) {
+				if (api_flush(conn))
+					api_serve(conn);
+			} else
+				api_read(conn);
+		}
+#else
+		fd_set rfds, wfds;
+		SOCKETTYPE maxfd = apisock;
+		struct timeval tv = { 1, 0 };
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(apisock, &rfds);
+		for (i = 0; i < API_MAX_CLIENTS; i++) {
+			if (!(conn = api_conns[i]))
+				continue;
+			FD_SET(conn->sock, conn->writing ? &wfds : &rfds);
+			if (conn->sock > maxfd)
+				maxfd = conn->sock;
+		}
+
+		n = select((int) maxfd + 1, &rfds, &wfds, NULL, &tv);
+		if (SOCKETFAIL(n)) {
+#ifndef WIN32
+			if (errno == EINTR)
+				continue;
+#endif
+			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+			break;
+		}
+		for (i = 0; i < API_MAX_CLIENTS && n > 0; i++) {
+			if (!(conn = api_conns[i]))
+				continue;
+			if (conn->writing && FD_ISSET(conn->sock, &wfds)) {
+				if (api_flush(conn))
+					api_serve(conn);
+			} else if (!conn->writing && FD_ISSET(conn->sock, &rfds))
+				api_read(conn);
+		}
+		if (FD_ISSET(apisock, &rfds))
+			api_accept(apisock);
+#endif
+		if (time(NULL) != expired) {
+			api_expire();
+			expired = time(NULL);
+		}
+	}
+
+	for (i = 0; i < API_MAX_CLIENTS; i++) {
+		if (api_conns[i])
+			api_close(api_conns[i]);
+	}
+#ifdef API_EPOLL
+	close(api_epfd);
+	api_epfd = -1;
+#endif
+}
+
 static void api()
 {
 	const char *addr = opt_api_allow;
 	short int port = opt_api_listen; // 4068
-	char buf[MYBUFSIZ];
-	int c, n, bound;
-	char *connectaddr;
+	int bound;
 	char *binderror;
-	char group;
 	time_t bindstart;
 	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
-	bool addrok = false;
-	long long counter;
-	char *result;
-	char *params;
-	int i;
 
 	SOCKETTYPE *apisock;
 	if (!opt_api_listen && opt_debug) {
@@ -777,94 +1509,11 @@ static void api()
 		return;
 	}
 
-	buffer = (char *) calloc(1, MYBUFSIZ + 1);
-
-	counter = 0;
-	while (bye == 0) {
-		counter++;
-
-		clisiz = sizeof(cli);
-        if(SOCKETFAIL(c = (int)accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
-			applog(LOG_ERR, "API failed (%s)%s", strerror(errno), UNAVAILABLE);
-			CLOSESOCKET(*apisock);
-			free(apisock);
-			free(buffer);
-			return;
-		}
-
-		addrok = check_connect(&cli, &connectaddr, &group);
-		if (opt_debug && opt_protocol)
-			applog(LOG_DEBUG, "API: connection from %s - %s",
-				connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			bool fail;
-			char *wskey = NULL;
-			n = recv(c, &buf[0], SOCK_REC_BUFSZ, 0);
-
-			fail = SOCKETFAIL(n);
-			if (fail)
-				buf[0] = '\0';
-			else if (n > 0 && buf[n-1] == '\n') {
-				/* telnet compat \r\n */
-				buf[n-1] = '\0'; n--;
-				if (n > 0 && buf[n-1] == '\r')
-					buf[n-1] = '\0';
-			}
-			buf[n] = '\0';
-
-			//if (opt_debug && opt_protocol && n > 0)
-			//	applog(LOG_DEBUG, "API: recv command: (%d) '%s'+char(%x)", n, buf, buf[n-1]);
-
-			if (!fail) {
-				char *msg = NULL;
-				/* Websocket requests compat. */
-				if ((msg = strstr(buf, "GET /")) && strlen(msg) > 5) {
-					char cmd[256] = { 0 };
-					sscanf(&msg[5], "%s\n", cmd);
-					params = strchr(cmd, '/');
-					if (params)
-						*(params++) = '|';
-					params = strchr(cmd, '/');
-					if (params)
-						*(params++) = '\0';
-					wskey = strstr(msg, "Sec-WebSocket-Key");
-					if (wskey) {
-						char *eol = strchr(wskey, '\r');
-						if (eol) *eol = '\0';
-						wskey = strchr(wskey, ':');
-						wskey++;
-						while ((*wskey) == ' ') wskey++; // ltrim
-					}
-					n = sprintf(buf, "%s", cmd);
-				}
-
-				params = strchr(buf, '|');
-				if (params != NULL)
-					*(params++) = '\0';
-
-				if (opt_debug && opt_protocol && n > 0)
-					applog(LOG_DEBUG, "API: exec command %s(%s)", buf, params ? params : "");
-
-				for (i = 0; i < CMDMAX; i++) {
-					if (strcmp(buf, cmds[i].name) == 0 && strlen(buf)) {
-						result = (cmds[i].func)(params);
-						if (wskey) {
-							websocket_handshake(c, result, wskey);
-							break;
-						}
-						send_result(c, result);
-						break;
-					}
-				}
-				CLOSESOCKET(c);
-			}
-		}
-	}
+	api_nonblock(*apisock);
+	api_loop(*apisock);
 
 	CLOSESOCKET(*apisock);
 	free(apisock);
-	free(buffer);
 }
 
 /* external access */
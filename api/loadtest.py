@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""
+Load test of the API of cudaminer
+
+Checks the request forms the monitoring tools send (raw commands, HTTP
+with keep-alive and pipelining, websocket upgrades), leaves stalled
+clients connected, then polls /summary from many keep-alive clients at
+once and reports the latency.
+
+usage: loadtest.py [port] [seconds] [clients] [host]
+"""
+import socket
+import sys
+import threading
+import time
+
+PORT = int(sys.argv[1]) if len(sys.argv) > 1 else 4068
+SECONDS = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+CLIENTS = int(sys.argv[3]) if len(sys.argv) > 3 else 200
+HOST = sys.argv[4] if len(sys.argv) > 4 else '127.0.0.1'
+
+failures = []
+
+
+def check(ok, what):
+    print('%s: %s' % ('ok' if ok else 'FAIL', what))
+    if not ok:
+        failures.append(what)
+
+
+def raw(request):
+    """Send a request, read the answer until the connection is closed"""
+    s = socket.create_connection((HOST, PORT))
+    s.sendall(request.encode())
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    return data
+
+
+def http_response(f):
+    """Read one HTTP response, (None, None) once the connection is closed"""
+    status = f.readline()
+    if not status:
+        return None, None
+    headers = {}
+    while True:
+        line = f.readline().strip()
+        if not line:
+            break
+        key, value = line.decode().split(':', 1)
+        headers[key.lower()] = value.strip()
+    body = f.read(int(headers['content-length']))
+    return status.decode().strip(), body
+
+
+def test_forms():
+    r = raw('summary')
+    check(r.startswith(b'NAME=') and r.endswith(b'\0'), 'raw summary, nul terminated')
+    r = raw('histo|0\r\n')
+    check(r.endswith(b'\0'), 'raw histo with telnet line end')
+    r = raw('GET /summary HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\n'
+            'Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n')
+    check(r.startswith(b'HTTP/1.1 101'), 'websocket upgrade')
+    r = raw('GET /summary HTTP/1.0\r\n\r\n')
+    check(r.startswith(b'HTTP/1.1 200') and b'Connection: close' in r, 'HTTP/1.0 closed')
+
+    s = socket.create_connection((HOST, PORT))
+    s.sendall(b'GET /summary HTTP/1.1\r\n\r\nGET /threads HTTP/1.1\r\n\r\n'
+              b'GET /nope HTTP/1.1\r\n\r\nGET /pool HTTP/1.1\r\nConnection: close\r\n\r\n')
+    f = s.makefile('rb')
+    answers = []
+    while True:
+        status, body = http_response(f)
+        if status is None:
+            break
+        answers.append(status)
+    s.close()
+    check(len(answers) == 4, 'pipelined requests answered in order: %s' % answers)
+
+
+def stall():
+    """Clients that are silent, send half a header or never read"""
+    stalled = []
+    for i in range(5):
+        stalled.append(socket.create_connection((HOST, PORT)))
+        half = socket.create_connection((HOST, PORT))
+        half.sendall(b'GET /summary HTTP/1.1\r\n')
+        stalled.append(half)
+        flood = socket.socket()
+        flood.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        flood.connect((HOST, PORT))
+        flood.setblocking(False)
+        try:
+            for k in range(20000):
+                flood.send(b'GET /hwinfo HTTP/1.1\r\n\r\n')
+        except (BlockingIOError, BrokenPipeError, ConnectionResetError):
+            pass
+        stalled.append(flood)
+    return stalled
+
+
+def test_load():
+    polls = [0] * CLIENTS
+    bad = []
+    latency = []
+
+    def client(i):
+        s = socket.create_connection((HOST, PORT))
+        f = s.makefile('rb')
+        end = time.time() + SECONDS
+        while time.time() < end:
+            start = time.time()
+            s.sendall(b'GET /summary HTTP/1.1\r\nHost: x\r\n\r\n')
+            status, body = http_response(f)
+            if status != 'HTTP/1.1 200 OK' or not body.startswith(b'NAME='):
+                bad.append(status)
+                break
+            polls[i] += 1
+            latency.append(time.time() - start)
+            time.sleep(0.2)
+        s.close()
+
+    threads = [threading.Thread(target=client, args=(i,)) for i in range(CLIENTS)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - start
+
+    check(not bad and latency, '%d keep-alive clients, %d bad answers' % (CLIENTS, len(bad)))
+    if latency:
+        latency.sort()
+        print('%d polls in %.1f s, %.0f/s, latency p50 %.1f ms p99 %.1f ms max %.1f ms' % (
+            sum(polls), elapsed, sum(polls) / elapsed, latency[len(latency) // 2] * 1e3,
+            latency[int(len(latency) * .99)] * 1e3, latency[-1] * 1e3))
+
+
+if __name__ == '__main__':
+    test_forms()
+    stalled = stall()
+    test_load()
+    for s in stalled:
+        s.close()
+    sys.exit(1 if failures else 0)
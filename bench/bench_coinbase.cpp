@@ -0,0 +1,99 @@
+/**
+ * Coinbase hashing benchmark
+ *
+ * Times the Merkle root of a work unit as stratum_gen_header() makes it,
+ * for each extranonce2: the coinbase hashed from its start, or resumed
+ * from the midstate of coinb1 + extranonce1 kept with the job, then the
+ * Merkle branches. The coinbase is shaped as the pools send it: 106 bytes
+ * of coinb1, 4 + 4 bytes of extranonce, 240 bytes of coinb2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miner.h"
+
+extern void sha256d(unsigned char *hash, const unsigned char *data, int len);
+
+#define COINB1_SIZE  106
+#define XNONCE1_SIZE 4
+#define XNONCE2_SIZE 4
+#define COINB2_SIZE  240
+#define COINBASE_SIZE (COINB1_SIZE + XNONCE1_SIZE + XNONCE2_SIZE + COINB2_SIZE)
+#define MAX_BRANCHES 12
+
+#define WORKS 200000
+
+static uchar coinbase[COINBASE_SIZE];
+static uchar merkle[MAX_BRANCHES * 32];
+
+static double seconds_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + 1e-6 * (now.tv_usec - start->tv_usec);
+}
+
+static void merkle_root(uchar *root, const uint32_t *midstate, int midlen, int branches)
+{
+	int i;
+
+	if (midstate)
+		sha256d_from(root, midstate, coinbase, midlen, COINBASE_SIZE);
+	else
+		sha256d(root, coinbase, COINBASE_SIZE);
+	for (i = 0; i < branches; i++) {
+		memcpy(root + 32, merkle + i * 32, 32);
+		sha256d(root, root, 64);
+	}
+}
+
+/**
+ * Work units per second with each extranonce2
+ * @param check uint32_t* roots folded, the same with or without midstate
+ */
+static double bench(const uint32_t *midstate, int midlen, int branches, uint32_t *check)
+{
+	uchar *xnonce2 = coinbase + COINB1_SIZE + XNONCE1_SIZE;
+	struct timeval start;
+	uchar root[64];
+	uint32_t n;
+
+	*check = 0;
+	gettimeofday(&start, NULL);
+	for (n = 0; n < WORKS; n++) {
+		memcpy(xnonce2, &n, XNONCE2_SIZE);
+		merkle_root(root, midstate, midlen, branches);
+		*check = (*check << 1 | *check >> 31) ^ le32dec(root);
+	}
+	return WORKS / seconds_since(&start);
+}
+
+int main(void)
+{
+	static const int branches[] = { 0, 6, 12 };
+	uint32_t midstate[8], check_full, check_mid;
+	double full, mid;
+	int i, midlen;
+
+	for (i = 0; i < COINBASE_SIZE; i++)
+		coinbase[i] = (uchar) (i * 131 + 7);
+	for (i = 0; i < MAX_BRANCHES * 32; i++)
+		merkle[i] = (uchar) (i * 17 + 3);
+
+	/* once per job */
+	midlen = sha256_midstate(midstate, coinbase, COINB1_SIZE + XNONCE1_SIZE);
+
+	printf("coinbase of %d bytes, %d hashed once per job\n", COINBASE_SIZE, midlen);
+	for (i = 0; i < (int) ARRAY_SIZE(branches); i++) {
+		full = bench(NULL, 0, branches[i], &check_full);
+		mid = bench(midstate, midlen, branches[i], &check_mid);
+		printf("%2d branches: from the start %6.0fK work/s, from the midstate %6.0fK work/s,"
+			" %+.0f%%%s\n", branches[i], full / 1e3, mid / 1e3, (mid / full - 1.) * 100.,
+			check_full == check_mid ? "" : ", ROOTS DIFFER");
+		if (check_full != check_mid)
+			return 1;
+	}
+	return 0;
+}
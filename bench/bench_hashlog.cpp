@@ -0,0 +1,104 @@
+/**
+ * Share log microbenchmark
+ *
+ * Fills the share log of hashlog.cpp with 10k then 100k records, 100
+ * shares per job, and times the calls the miner makes: a share and a
+ * scan range remembered, the lookups of a submit, the purge of a job.
+ * The cost per call must not grow with the records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miner.h"
+
+bool opt_debug = false;
+
+void applog(int prio, const char *fmt, ...)
+{
+}
+
+#define SHARES_PER_JOB 100
+#define LOOKUPS 400000
+
+static double seconds_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + 1e-6 * (now.tv_usec - start->tv_usec);
+}
+
+/* job ids as pools send them, the hex job number first */
+static void job_id(char *s, uint32_t job)
+{
+	snprintf(s, 128, "%07x %x", job, job * 7);
+}
+
+static void bench(uint32_t jobs)
+{
+	struct work work;
+	struct timeval start;
+	char id[128];
+	uint64_t check = 0;
+	uint32_t records, j, k, i;
+	uint64_t mem;
+	double t_add, t_lookup, t_range, t_purge;
+
+	memset(&work, 0, sizeof(work));
+	hashlog_purge_all();
+
+	gettimeofday(&start, NULL);
+	for (j = 1; j <= jobs; j++) {
+		job_id(work.job_id, j);
+		work.height = j;
+		for (k = 1; k <= SHARES_PER_JOB; k++) {
+			work.scanned_from = k * 1000;
+			hashlog_remember_submit(&work, k * 1000 + 7);
+		}
+	}
+	t_add = seconds_since(&start) / ((double) jobs * SHARES_PER_JOB);
+
+	/* a submit checks the share and the job of a found nonce */
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOOKUPS / 4; i++) {
+		job_id(id, 1 + (i * 37) % jobs);
+		check += hashlog_already_submittted(id, (i % SHARES_PER_JOB + 1) * 1000 + 7) != 0;
+		check += hashlog_already_submittted(id, 5);
+		check += hashlog_get_scan_range(id);
+		check += hashlog_get_last_sent(id);
+	}
+	t_lookup = seconds_since(&start) / LOOKUPS;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOOKUPS; i++) {
+		job_id(work.job_id, 1 + (i * 37) % jobs);
+		work.scanned_from = 1;
+		work.scanned_to = 5000 + i;
+		hashlog_remember_scan_range(&work);
+	}
+	t_range = seconds_since(&start) / LOOKUPS;
+
+	hashlog_getmeminfo(&mem, &records);
+
+	/* one job in five */
+	gettimeofday(&start, NULL);
+	for (j = 5; j <= jobs; j += 5) {
+		job_id(id, j);
+		hashlog_purge_job(id);
+	}
+	t_purge = seconds_since(&start) / (jobs / 5);
+
+	printf("%6u records %5u KB: remember %5.0f ns, lookup %5.0f ns, scan range %5.0f ns,"
+		" purge job %7.0f ns (check %llx)\n", records, (uint32_t) (mem >> 10),
+		t_add * 1e9, t_lookup * 1e9, t_range * 1e9, t_purge * 1e9,
+		(unsigned long long) check);
+}
+
+int main(void)
+{
+	bench(100);
+	bench(1000);
+	hashlog_purge_all();
+	return 0;
+}
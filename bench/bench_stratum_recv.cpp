@@ -0,0 +1,217 @@
+/**
+ * Stratum line reader benchmark
+ *
+ * A stream shaped as the notifications of a pool is fed through a socket
+ * pair, in TCP sized segments then in large writes: 20000 mining.notify
+ * of 8 to 14 Merkle branches, then the same with blank keep-alive lines.
+ * It is read by stratum_recv_line() and by the reader it replaced, which
+ * searched the whole buffer and moved it back after every line, and lost
+ * lines after a blank one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "miner.h"
+
+bool opt_debug = false;
+bool opt_quiet = true;
+bool opt_protocol = false;
+int opt_timeout = 300;
+bool have_longpoll = false;
+bool want_stratum = true;
+bool have_stratum = true;
+char *opt_cert = NULL;
+char *opt_proxy = NULL;
+long opt_proxy_type = -1;
+struct thr_info *thr_info = NULL;
+int longpoll_thr_id = -1;
+int stratum_thr_id = -1;
+uint64_t global_hashrate = 0;
+double global_diff = 0.;
+
+void applog(int prio, const char *fmt, ...)
+{
+}
+
+#define NOTIFIES 20000
+#define RBUFSIZE 2048
+#define RECVSIZE (RBUFSIZE - 4)
+
+struct feed {
+	int sock;
+	const char *stream;
+	size_t len;
+	size_t segment;
+};
+
+static uint32_t stream_seed = 0x4E4F5449;
+
+static uint32_t stream_rand(void)
+{
+	stream_seed ^= stream_seed << 13;
+	stream_seed ^= stream_seed >> 17;
+	stream_seed ^= stream_seed << 5;
+	return stream_seed;
+}
+
+static char *stream_hex(char *p, int bytes)
+{
+	while (bytes--)
+		p += sprintf(p, "%02x", stream_rand() & 0xff);
+	return p;
+}
+
+/* NOTIFIES lines, with a blank line every 7 if keepalive */
+static char *stream_make(size_t *len, bool keepalive)
+{
+	char *stream = (char *) malloc(NOTIFIES * 2048), *p = stream;
+	int i, b, branches;
+
+	for (i = 0; i < NOTIFIES; i++) {
+		p += sprintf(p, "{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"%x\",\"", i);
+		p = stream_hex(p, 32);
+		p += sprintf(p, "\",\"");
+		p = stream_hex(p, 42);
+		p += sprintf(p, "\",\"");
+		p = stream_hex(p, 60);
+		p += sprintf(p, "\",[");
+		branches = 8 + stream_rand() % 7;
+		for (b = 0; b < branches; b++) {
+			p += sprintf(p, "%s\"", b ? "," : "");
+			p = stream_hex(p, 32);
+			p += sprintf(p, "\"");
+		}
+		p += sprintf(p, "],\"00000007\",\"1b0404cb\",\"5f5e1000\",%s]}\n",
+			(i % 50) ? "false" : "true");
+		if (keepalive && i % 7 == 6)
+			p += sprintf(p, "\n");
+	}
+	*len = (size_t) (p - stream);
+	return stream;
+}
+
+static void *feed_thread(void *userdata)
+{
+	struct feed *f = (struct feed *) userdata;
+	size_t pos = 0, n;
+	ssize_t sent;
+
+	while (pos < f->len) {
+		n = min(f->segment, f->len - pos);
+		sent = send(f->sock, f->stream + pos, n, MSG_NOSIGNAL);
+		if (sent <= 0)
+			break;
+		pos += sent;
+	}
+	shutdown(f->sock, SHUT_WR);
+	return NULL;
+}
+
+/* The reader of before: strstr() over the buffer, strdup() of each line */
+static char *copy_recv_line(struct stratum_ctx *sctx)
+{
+	size_t len, buflen, old;
+	char s[RBUFSIZE], *tok, *sret;
+	ssize_t n;
+
+	while (!strstr(sctx->sockbuf, "\n")) {
+		memset(s, 0, RBUFSIZE);
+		n = recv(sctx->sock, s, RECVSIZE, 0);
+		if (n <= 0)
+			return NULL;
+		old = strlen(sctx->sockbuf);
+		if (old + n + 1 >= sctx->sockbuf_size) {
+			sctx->sockbuf_size = old + n + 1 + RBUFSIZE;
+			sctx->sockbuf = (char *) realloc(sctx->sockbuf, sctx->sockbuf_size);
+		}
+		strcpy(sctx->sockbuf + old, s);
+	}
+
+	buflen = strlen(sctx->sockbuf);
+	tok = strtok(sctx->sockbuf, "\n");
+	if (!tok)
+		return NULL;
+	sret = strdup(tok);
+	len = strlen(sret);
+	if (buflen > len + 1)
+		memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
+	else
+		sctx->sockbuf[0] = '\0';
+	return sret;
+}
+
+static void bench(const char *name, const char *stream, size_t len, size_t segment, bool copy)
+{
+	struct stratum_ctx sctx;
+	struct timeval start, end, diff;
+	struct feed f;
+	pthread_t feeder;
+	int sv[2], lines = 0, bad = 0;
+	double seconds;
+	char *line;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+	memset(&sctx, 0, sizeof(sctx));
+	sctx.sock = sv[0];
+	sctx.sockbuf = (char *) calloc(RBUFSIZE, 1);
+	sctx.sockbuf_size = RBUFSIZE;
+
+	f.sock = sv[1];
+	f.stream = stream;
+	f.len = len;
+	f.segment = segment;
+
+	gettimeofday(&start, NULL);
+	pthread_create(&feeder, NULL, feed_thread, &f);
+	/* up to the end of the stream */
+	while ((line = copy ? copy_recv_line(&sctx) : stratum_recv_line(&sctx))) {
+		if (strncmp(line, "{\"id\":null,\"method\":\"mining.notify\"", 35) ||
+		    line[strlen(line) - 1] != '}')
+			bad++;
+		lines++;
+		if (copy)
+			free(line);
+	}
+	gettimeofday(&end, NULL);
+	/* the reader of before may give up early */
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(feeder, NULL);
+	timeval_subtract(&diff, &end, &start);
+	seconds = diff.tv_sec + 1e-6 * diff.tv_usec;
+
+	if (lines == NOTIFIES && !bad)
+		printf("%-8s %5u byte segments: %6.1f ms, %5.0f MB/s\n",
+			name, (uint32_t) segment, seconds * 1e3, len / seconds / 1e6);
+	else
+		printf("%-8s %5u byte segments: %d lines read, %d of them mangled\n",
+			name, (uint32_t) segment, lines, bad);
+
+	close(sv[0]);
+	close(sv[1]);
+	free(sctx.sockbuf);
+}
+
+int main(void)
+{
+	size_t len;
+	char *stream;
+	int keepalive;
+
+	for (keepalive = 0; keepalive <= 1; keepalive++) {
+		stream = stream_make(&len, keepalive != 0);
+		printf("%u notifies%s, %.1f MB\n", NOTIFIES,
+			keepalive ? " and keep-alive lines" : "", len / 1e6);
+		bench("in place", stream, len, 1400, false);
+		bench("copy", stream, len, 1400, true);
+		bench("in place", stream, len, 65536, false);
+		bench("copy", stream, len, 65536, true);
+		free(stream);
+	}
+	return 0;
+}
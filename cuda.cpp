@@ -31,14 +31,14 @@ int cuda_num_devices()
 	if (err != cudaSuccess)
 	{
 		applog(LOG_ERR, "Unable to query CUDA driver version! Is an nVidia driver installed?");
-		exit(1);
+		return 0;
 	}
 
 	int maj = version / 1000, min = version % 100; // same as in deviceQuery sample
 	if (maj < 5 || (maj == 5 && min < 5))
 	{
 		applog(LOG_ERR, "Driver does not support CUDA %d.%d API! Update your nVidia driver!", 5, 5);
-		exit(1);
+		return 0;
 	}
 
 	int GPU_N;
@@ -46,7 +46,7 @@ int cuda_num_devices()
 	if (err != cudaSuccess)
 	{
 		applog(LOG_ERR, "Unable to query number of CUDA devices! Is an nVidia driver installed?");
-		exit(1);
+		return 0;
 	}
 	return GPU_N;
 }
@@ -59,7 +59,7 @@ void cuda_devicenames()
 	if (err != cudaSuccess)
 	{
 		applog(LOG_ERR, "Unable to query number of CUDA devices! Is an nVidia driver installed?");
-		exit(1);
+		return;
 	}
 
 	for (int i = 0; i < GPU_N*opt_n_gputhreads; i++)
@@ -133,6 +133,23 @@ uint32_t device_intensity(int thr_id, const char *func, uint32_t defcount)
 	return throughput;
 }
 
+/**
+ * Key of a device in the tuning cache, see tune.cpp:
+ * its name, SM version, memory size and the driver version, same for
+ * every card of a model; a driver upgrade tunes the device again
+ */
+void cuda_tune_key(int dev_id, char *key, size_t len)
+{
+	cudaDeviceProp props;
+	int driver = 0;
+
+	memset(&props, 0, sizeof(props));
+	cudaGetDeviceProperties(&props, dev_id);
+	cudaDriverGetVersion(&driver);
+	snprintf(key, len, "%s sm_%d%d %uMB drv%d", props.name, props.major, props.minor,
+		(uint32_t) (props.totalGlobalMem >> 20), driver);
+}
+
 // Zeitsynchronisations-Routine von cudaminer mit CPU sleep
 typedef struct { double value[8]; } tsumarray;
 
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #if (_MSC_VER < 1800)
 /* nothing */
@@ -87,8 +88,17 @@ struct workio_cmd {
 	union {
 		struct work	*work;
 	} u;
+	/* share of a WC_SUBMIT_WORK, pointed to by u.work */
+	struct work _ALIGN(64)	work;
+	struct workio_cmd	*next;
 };
 
+/* workio commands come from a fixed pool, no allocation per share;
+ * up to WORKIO_CMDS of them are shares, the rest are kept for one work
+ * request per mining thread and an abort so that these never fail */
+#define WORKIO_CMDS 32
+#define WORKIO_RESERVE (opt_n_threads + 2)
+
 enum sha_algos {
     ALGO_NEOSCRYPT,
     ALGO_COUNT
@@ -123,12 +133,16 @@ static const bool opt_time = true;
 static enum sha_algos opt_algo = ALGO_NEOSCRYPT;
 int opt_n_threads = 0;
 int opt_n_gputhreads = 1;
+int opt_n_cputhreads = 0;
+int opt_n_verifythreads = 1;
 int opt_affinity = -1;
 int opt_priority = 0;
 static bool opt_extranonce = true;
 int gpu_threads = 1;
 
 uint hash_mode = 0;
+bool opt_autotune = true;
+char *opt_tune_file = NULL;
 
 int num_cpus = 0;
 int active_gpus = 0;
@@ -166,12 +180,27 @@ int stratum_thr_id = -1;
 int api_thr_id = -1;
 bool stratum_need_reset = false;
 struct work_restart *work_restart = NULL;
-struct stratum_ctx stratum = { 0 };
+/* pool mined, changed under g_work_lock */
+struct stratum_ctx *stratum = &pools[0];
+
+static const char *pool_strategy_names[] = {
+	"failover",
+	"round-robin",
+	"quota",
+};
+
+static int opt_pool_strategy = POOL_FAILOVER;
+static int opt_pool_rotate = 10;
+static int opt_pool_quota = 1;
+static time_t pool_switch_time = 0;
 
 static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 uint32_t accepted_count = 0L;
 uint32_t rejected_count = 0L;
-static double thr_hashrates[MAX_GPUS] = { 0 };
+/* bits of the last hashrate of each thread, written by the thread only
+ * and read without stats_lock, see stats_store_double */
+static uint64_t thr_hashrates[MAX_GPUS] = { 0 };
+#define thr_hashrate(thr_id) stats_load_double(&thr_hashrates[thr_id])
 uint64_t global_hashrate = 0;
 double   global_diff = 0.0;
 uint32_t opt_statsavg = 30;
@@ -195,15 +224,25 @@ Usage: " PROGRAM_NAME " [OPTIONS]\n\
 Options:\n\
   -d, --devices         comma separated list of CUDA devices to use \n\
   -i, --intensity=N     GPU intensity 8-31 (default: auto) \n\
-  -m, --mode=N          internal hashing mode (1 to 3, default depends on GPU)\n\
+  -m, --mode=N          internal hashing mode (1 to 3, default: auto)\n\
+      --tune-file=FILE  GPU settings tuned, reused on the next start\n\
+                          (default: cudaminer-tune.json)\n\
+      --no-autotune     use default GPU settings instead of tuning them\n\
   -o, --url=URL         URL of mining server\n\
   -O, --userpass=U:P    username:password pair for mining server\n\
   -u, --user=USERNAME   username for mining server\n\
   -p, --pass=PASSWORD   password for mining server\n\
+                          repeat -o with its -u and -p for backup pools\n\
+      --pool-strategy=S pool selection: failover (default), round-robin, quota\n\
+      --pool-rotate=N   minutes mining each pool in round-robin (default: 10)\n\
+      --pool-quota=N    quota of accepted shares of the pool given last\n\
+                          (default: 1)\n\
       --cert=FILE       certificate for mining server using SSL\n\
   -x, --proxy=[PROTOCOL://]HOST[:PORT]  connect through a proxy\n\
   -t, --threads=N       number of GPU mining threads (default: number of GPUs)\n\
   -g, --gputhreads=N    number of threads per GPU (default: 1)\n\
+      --cpu-threads=N   number of CPU mining threads (default: 0)\n\
+      --verify-threads=N  number of threads verifying GPU results (default: 1)\n\
   -r, --retries=N       number of times to retry if a network call fails\n\
                           (default: retry indefinitely)\n\
   -R, --retry-pause=N   time to pause between retries, in seconds (default: 30)\n\
@@ -240,6 +279,7 @@ struct option const options[] = {
 	{ "config", 1, NULL, 'c' },
 	{ "cpu-affinity", 1, NULL, 1020 },
 	{ "cpu-priority", 1, NULL, 1021 },
+	{ "cpu-threads", 1, NULL, 1022 },
 	{ "debug", 0, NULL, 'D' },
 	{ "help", 0, NULL, 'h' },
 	{ "intensity", 1, NULL, 'i' },
@@ -250,6 +290,9 @@ struct option const options[] = {
 	{ "no-longpoll", 0, NULL, 1003 },
 	{ "no-stratum", 0, NULL, 1007 },
 	{ "pass", 1, NULL, 'p' },
+	{ "pool-quota", 1, NULL, 1026 },
+	{ "pool-rotate", 1, NULL, 1025 },
+	{ "pool-strategy", 1, NULL, 1024 },
 	{ "protocol-dump", 0, NULL, 'P' },
 	{ "proxy", 1, NULL, 'x' },
 	{ "quiet", 0, NULL, 'q' },
@@ -267,6 +310,9 @@ struct option const options[] = {
 	{ "url", 1, NULL, 'o' },
 	{ "user", 1, NULL, 'u' },
 	{ "userpass", 1, NULL, 'O' },
+	{ "verify-threads", 1, NULL, 1023 },
+	{ "tune-file", 1, NULL, 1027 },
+	{ "no-autotune", 0, NULL, 1028 },
 	{ "version", 0, NULL, 'V' },
 	{ "devices", 1, NULL, 'd' },
 	{ 0, 0, 0, 0 }
@@ -276,6 +322,69 @@ static struct work _ALIGN(64) g_work;
 static time_t g_work_time;
 static pthread_mutex_t g_work_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* g_work version, odd while being written: writers hold g_work_lock,
+ * miner threads copy g_work without it when the version changes */
+static uint32_t _ALIGN(64) g_work_seq = 0;
+
+/* nonces of g_work claimed by the miner threads, stratum only */
+static struct work_sched _ALIGN(64) g_sched;
+
+/* extranonce2 values a published stratum work covers */
+#define xnonce2_rolls(len) ((len) >= 2 ? WORK_SCHED_ROLLS : 1)
+
+#ifdef _MSC_VER
+#define g_work_fence() MemoryBarrier()
+#define g_work_seq_load() (*(volatile uint32_t *) &g_work_seq)
+#define g_work_seq_store(v) (*(volatile uint32_t *) &g_work_seq = (v))
+#else
+#define g_work_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define g_work_seq_load() __atomic_load_n(&g_work_seq, __ATOMIC_ACQUIRE)
+#define g_work_seq_store(v) __atomic_store_n(&g_work_seq, (v), __ATOMIC_RELEASE)
+#endif
+
+/**
+ * Enclose the updates of g_work, g_work_lock held
+ */
+static inline void g_work_write_begin(void)
+{
+	g_work_seq_store(g_work_seq + 1);
+	g_work_fence();
+}
+
+static inline void g_work_write_end(void)
+{
+	/* the work space of the new version, see worksched.cpp */
+	work_sched_reset(&g_sched, (g_work_seq + 1) >> 1, xnonce2_rolls(g_work.xnonce2_len));
+	g_work_seq_store(g_work_seq + 1);
+}
+
+/**
+ * Copy g_work if published since the version seen last
+ * @param work struct work * receiving the copy
+ * @param seq uint32_t * version seen last, updated
+ * @return bool false if unchanged, one atomic load then
+ */
+static bool g_work_fetch(struct work *work, uint32_t *seq)
+{
+	uint32_t s;
+
+	/* orders the restart flag cleared before against the load */
+	g_work_fence();
+	while (1) {
+		s = g_work_seq_load();
+		if (s == *seq)
+			return false;
+		if (s & 1)
+			continue;
+		memcpy(work, &g_work, sizeof(struct work));
+		g_work_fence();
+		if (g_work_seq_load() == s)
+			break;
+	}
+	*seq = s;
+	return true;
+}
+
 
 #ifdef __linux__
 #include <sched.h>
@@ -338,6 +447,8 @@ void restart_threads(void) {
     if(opt_debug && !opt_quiet)
         applog(LOG_DEBUG,"%s", __FUNCTION__);
 
+    metrics_work_restart();
+
     for(int i = 0; (i < opt_n_threads) && work_restart; i++)
       work_restart[i].restart = 1;
 }
@@ -455,18 +566,51 @@ static void calc_diff(struct work *work, int known)
 	work->difficulty = (double)diffone / d64;
 }
 
-static int share_result(int result, const char *reason) {
+static const char *pool_name(struct stratum_ctx *pool)
+{
+	const char *p = strstr(pool->url, "://");
+
+	return p ? p + 3 : pool->url;
+}
+
+/* Adds the pool given last with its credentials to the pool list */
+static void pool_save(void)
+{
+	if (!rpc_url)
+		return;
+	pool_add(rpc_url, rpc_user, rpc_pass, opt_pool_quota);
+	opt_pool_quota = 1;
+}
+
+/* Tells if a reject reason is about a share too late for its job */
+static bool reason_is_stale(const char *reason)
+{
+	char s[64];
+	int i;
+
+	for (i = 0; reason && reason[i] && i < (int) sizeof(s) - 1; i++)
+		s[i] = (char) tolower((uchar) reason[i]);
+	s[i] = '\0';
+	return strstr(s, "stale") || strstr(s, "job not found");
+}
+
+static int share_result(struct stratum_ctx *pool, int result, const char *reason) {
     char s[32];
 	double hashrate = 0.;
 	const char *sres;
 
-	pthread_mutex_lock(&stats_lock);
-
 	for (int i = 0; i < opt_n_threads; i++) {
-		hashrate += stats_get_speed(i, thr_hashrates[i]);
+		hashrate += stats_get_speed(i, thr_hashrate(i));
 	}
 
+	pthread_mutex_lock(&stats_lock);
 	result ? accepted_count++ : rejected_count++;
+	if (result)
+		pool->accepted++;
+	else if (reason_is_stale(reason))
+		pool->stale++;
+	else
+		pool->rejected++;
 	pthread_mutex_unlock(&stats_lock);
 
 #if (_MSC_VER < 1800)
@@ -533,10 +677,16 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 
 	if (have_stratum) 
 	{
-		uint32_t sent = 0;
+		struct stratum_ctx *pool = &pools[work->pooln];
+		uint32_t sent = 0, id;
         uint32_t ntime, nonce;
         char *ntimestr, *noncestr, *xnonce2str;
 
+		if (!stratum_is_online(pool)) {
+			applog(LOG_WARNING, "%s is offline, share discarded", pool_name(pool));
+			return true;
+		}
+
         if(opt_algo != ALGO_NEOSCRYPT) {
             le32enc(&ntime, work->data[17]);
             le32enc(&nonce, work->data[19]);
@@ -566,17 +716,19 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 		ntimestr = bin2hex((const uchar*)(&ntime), 4);
 		xnonce2str = bin2hex(work->xnonce2, work->xnonce2_len);
 
+		/* registered first, the answer may come back before the send returns */
+		id = stratum_share_sent(pool, work);
 		{
 			sprintf(s,
-				"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
-				rpc_user, work->job_id + 8, xnonce2str, ntimestr, noncestr);
+				"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%u}",
+				pool->user, work->job_id + 8, xnonce2str, ntimestr, noncestr, id);
 		}
 		free(xnonce2str);
 		free(ntimestr);
 		free(noncestr);
 
-		gettimeofday(&stratum.tv_submit, NULL);
-		if (unlikely(!stratum_send_line(&stratum, s))) {
+		if (unlikely(!stratum_send_line(pool, s))) {
+			stratum_share_answered(pool, id, NULL);
 			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
 			sleep(10);
 			return false;
@@ -617,7 +769,10 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 
 		res = json_object_get(val, "result");
 		reason = json_object_get(val, "reject-reason");
-		if (!share_result(json_is_true(res), reason ? json_string_value(reason) : NULL)) {
+		if (json_is_true(res))
+			stats_remember_share(work->thr_id, target_to_hashes(work->target));
+		if (!share_result(&pools[work->pooln], json_is_true(res),
+				reason ? json_string_value(reason) : NULL)) {
 			if (check_dups)
 				hashlog_purge_job(work->job_id);
 		}
@@ -719,21 +874,148 @@ static bool get_upstream_work(CURL *curl, struct work *work)
 	return rc;
 }
 
+static struct workio_cmd *workio_cmds = NULL;
+static struct workio_cmd *workio_free_cmds = NULL;
+static int workio_free_count = 0;
+/* commands queued to the workio thread, oldest first */
+static struct workio_cmd *workio_queue_head = NULL;
+static struct workio_cmd *workio_queue_tail = NULL;
+/* set once the workio thread is gone, nothing more is queued */
+static bool workio_closed = false;
+static pthread_mutex_t workio_cmds_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workio_cmds_room = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workio_cmds_ready = PTHREAD_COND_INITIALIZER;
+
+static bool workio_init()
+{
+	int i, count = WORKIO_CMDS + WORKIO_RESERVE;
+
+	workio_cmds = (struct workio_cmd *)aligned_calloc(count * sizeof(*workio_cmds));
+	if (!workio_cmds)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		workio_cmds[i].next = workio_free_cmds;
+		workio_free_cmds = &workio_cmds[i];
+	}
+	workio_free_count = count;
+
+	return true;
+}
+
+/**
+ * Take a command from the pool
+ * @param wait bool for one to be freed if all shares are queued, else fail
+ * @return NULL once the workio thread has exited
+ */
+static struct workio_cmd *workio_cmd_new(enum workio_commands cmd,
+	struct thr_info *thr, bool wait)
+{
+	/* shares leave the reserve alone */
+	int reserve = (cmd == WC_SUBMIT_WORK) ? WORKIO_RESERVE : 0;
+	struct workio_cmd *wc = NULL;
+
+	pthread_mutex_lock(&workio_cmds_lock);
+	while (!workio_closed && workio_free_count <= reserve && wait)
+		pthread_cond_wait(&workio_cmds_room, &workio_cmds_lock);
+	if (!workio_closed && workio_free_count > reserve) {
+		wc = workio_free_cmds;
+		workio_free_cmds = wc->next;
+		workio_free_count--;
+	}
+	pthread_mutex_unlock(&workio_cmds_lock);
+
+	if (!wc)
+		return NULL;
+
+	wc->cmd = cmd;
+	wc->thr = thr;
+	wc->u.work = (cmd == WC_SUBMIT_WORK) ? &wc->work : NULL;
+	wc->next = NULL;
+	return wc;
+}
+
+/* Must be called with workio_cmds_lock held */
+static void workio_cmd_release(struct workio_cmd *wc)
+{
+	wc->next = workio_free_cmds;
+	workio_free_cmds = wc;
+	workio_free_count++;
+	pthread_cond_signal(&workio_cmds_room);
+}
+
 static void workio_cmd_free(struct workio_cmd *wc)
 {
 	if (!wc)
 		return;
 
-	switch (wc->cmd) {
-	case WC_SUBMIT_WORK:
-		aligned_free(wc->u.work);
-		break;
-	default: /* do nothing */
-		break;
+	pthread_mutex_lock(&workio_cmds_lock);
+	workio_cmd_release(wc);
+	pthread_mutex_unlock(&workio_cmds_lock);
+}
+
+/**
+ * Queue a command to the workio thread
+ * @return bool false if the workio thread has exited, the command is freed
+ */
+static bool workio_push(struct workio_cmd *wc)
+{
+	bool rc = true;
+
+	pthread_mutex_lock(&workio_cmds_lock);
+	if (workio_closed) {
+		workio_cmd_release(wc);
+		rc = false;
+	} else {
+		if (workio_queue_tail)
+			workio_queue_tail->next = wc;
+		else
+			workio_queue_head = wc;
+		workio_queue_tail = wc;
+		pthread_cond_signal(&workio_cmds_ready);
 	}
+	pthread_mutex_unlock(&workio_cmds_lock);
+
+	return rc;
+}
 
-	memset(wc, 0, sizeof(*wc));	/* poison */
-	free(wc);
+static struct workio_cmd *workio_pop()
+{
+	struct workio_cmd *wc;
+
+	pthread_mutex_lock(&workio_cmds_lock);
+	while (!workio_queue_head)
+		pthread_cond_wait(&workio_cmds_ready, &workio_cmds_lock);
+	wc = workio_queue_head;
+	workio_queue_head = wc->next;
+	if (!workio_queue_head)
+		workio_queue_tail = NULL;
+	wc->next = NULL;
+	pthread_mutex_unlock(&workio_cmds_lock);
+
+	return wc;
+}
+
+/**
+ * Refuse any further command and return the queued ones to the pool,
+ * waking the threads waiting on them
+ */
+static void workio_close()
+{
+	struct workio_cmd *wc;
+
+	pthread_mutex_lock(&workio_cmds_lock);
+	workio_closed = true;
+	while ((wc = workio_queue_head)) {
+		workio_queue_head = wc->next;
+		/* a NULL unit of work makes get_work() fail */
+		if (wc->cmd == WC_GET_WORK)
+			tq_push(wc->thr->q, NULL);
+		workio_cmd_release(wc);
+	}
+	workio_queue_tail = NULL;
+	pthread_cond_broadcast(&workio_cmds_room);
+	pthread_mutex_unlock(&workio_cmds_lock);
 }
 
 static void workio_abort()
@@ -741,16 +1023,12 @@ static void workio_abort()
 	struct workio_cmd *wc;
 
 	/* fill out work request message */
-	wc = (struct workio_cmd *)calloc(1, sizeof(*wc));
+	wc = workio_cmd_new(WC_ABORT, NULL, false);
 	if (!wc)
 		return;
 
-	wc->cmd = WC_ABORT;
-
 	/* send work request to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc)) {
-		workio_cmd_free(wc);
-	}
+	workio_push(wc);
 }
 
 static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
@@ -767,6 +1045,7 @@ static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
 		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
 			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
 			aligned_free(ret_work);
+			tq_push(wc->thr->q, NULL);
 			return false;
 		}
 
@@ -819,12 +1098,8 @@ static void *workio_thread(void *userdata)
 	while (ok && !abort_flag) {
 		struct workio_cmd *wc;
 
-		/* wait for workio_cmd sent to us, on our queue */
-		wc = (struct workio_cmd *)tq_pop(mythr->q, NULL);
-		if (!wc) {
-			ok = false;
-			break;
-		}
+		/* wait for workio_cmd sent to us */
+		wc = workio_pop();
 
 		/* process workio_cmd */
 		switch (wc->cmd) {
@@ -843,6 +1118,7 @@ static void *workio_thread(void *userdata)
 		workio_cmd_free(wc);
 	}
 
+	workio_close();
 	tq_freeze(mythr->q);
 	curl_easy_cleanup(curl);
 
@@ -865,18 +1141,13 @@ static bool get_work(struct thr_info *thr, struct work *work)
 	}
 
 	/* fill out work request message */
-	wc = (struct workio_cmd *)calloc(1, sizeof(*wc));
+	wc = workio_cmd_new(WC_GET_WORK, thr, false);
 	if (!wc)
 		return false;
 
-	wc->cmd = WC_GET_WORK;
-	wc->thr = thr;
-
 	/* send work request to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc)) {
-		workio_cmd_free(wc);
+	if (!workio_push(wc))
 		return false;
-	}
 
 	/* wait for response, a unit of work */
 	work_heap = (struct work *)tq_pop(thr->q, NULL);
@@ -893,65 +1164,48 @@ static bool get_work(struct thr_info *thr, struct work *work)
 static bool submit_work(struct thr_info *thr, const struct work *work_in)
 {
 	struct workio_cmd *wc;
-	/* fill out work request message */
-	wc = (struct workio_cmd *)calloc(1, sizeof(*wc));
+
+	/* fill out work request message, waits while
+	 * the workio thread is behind on submissions */
+	wc = workio_cmd_new(WC_SUBMIT_WORK, thr, true);
 	if (!wc)
 		return false;
-
-	wc->u.work = (struct work *)aligned_calloc(sizeof(*work_in));
-	if (!wc->u.work)
-		goto err_out;
-
-	wc->cmd = WC_SUBMIT_WORK;
-	wc->thr = thr;
 	memcpy(wc->u.work, work_in, sizeof(*work_in));
+	wc->u.work->thr_id = thr->id;
 
 	/* send solution to workio thread */
-	if (!tq_push(thr_info[work_thr_id].q, wc))
-		goto err_out;
+	return workio_push(wc);
+}
 
-	return true;
+/* Adds to a little endian extranonce2 */
+static void xnonce2_add(uchar *xnonce2, size_t len, uint32_t n)
+{
+	uint64_t carry = n;
+	size_t i;
 
-err_out:
-	workio_cmd_free(wc);
-	return false;
+	for (i = 0; i < len && carry; i++) {
+		carry += xnonce2[i];
+		xnonce2[i] = (uchar) carry;
+		carry >>= 8;
+	}
 }
 
-static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
+/* Block header of the current job with the extranonce2 in its coinbase,
+ * sctx->work_lock held */
+static void stratum_gen_header(struct stratum_ctx *sctx, struct work *work)
 {
 	uchar merkle_root[64];
 	int i;
 
-	if (!sctx->job.job_id) {
-		// applog(LOG_WARNING, "stratum_gen_work: job not yet retrieved");
-		return;
-	}
-
-	pthread_mutex_lock(&sctx->work_lock);
-
-	// store the job ntime as high part of jobid
-	snprintf(work->job_id, sizeof(work->job_id), "%07x %s",
-		be32dec(sctx->job.ntime) & 0xfffffff, sctx->job.job_id);
-	work->xnonce2_len = sctx->xnonce2_size;
-	memcpy(work->xnonce2, sctx->job.xnonce2, sctx->xnonce2_size);
-
-	// also store the bloc number
-	work->height = sctx->job.height;
-
-    /* Generate merkle root */
-    sha256d(merkle_root, sctx->job.coinbase, (uint)sctx->job.coinbase_size);
+    /* Generate merkle root, the coinbase hashing resumes
+     * from the midstate of the part before extranonce2 */
+    sha256d_from(merkle_root, sctx->job.coinbase_midstate, sctx->job.coinbase,
+      (int)sctx->job.coinbase_midlen, (int)sctx->job.coinbase_size);
     for(i = 0; i < sctx->job.merkle_count; i++) {
-        memcpy(merkle_root + 32, sctx->job.merkle[i], 32);
+        memcpy(merkle_root + 32, sctx->job.merkle + i * 32, 32);
         sha256d(merkle_root, merkle_root, 64);
     }
 
-//	/+Increment extranonce2 +/
-
-	for (i = 0; i < (int)sctx->xnonce2_size && !++sctx->job.xnonce2[i]; i++);
-	{
-		sctx->job.xnonce2[i]++;		
-	}
-
     /* Assemble block header;
      * reverse byte order for NeoScrypt */
     memset(work->data, 0, 128);
@@ -974,6 +1228,31 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
     }
     work->data[20] = 0x80000000;
     work->data[31] = 0x00000280;
+}
+
+static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
+{
+	if (!sctx->job.job_id) {
+		// applog(LOG_WARNING, "stratum_gen_work: job not yet retrieved");
+		return;
+	}
+
+	pthread_mutex_lock(&sctx->work_lock);
+
+	// store the job ntime as high part of jobid
+	snprintf(work->job_id, sizeof(work->job_id), "%07x %s",
+		be32dec(sctx->job.ntime) & 0xfffffff, sctx->job.job_id);
+	work->xnonce2_len = sctx->xnonce2_size;
+	memcpy(work->xnonce2, sctx->job.xnonce2, sctx->xnonce2_size);
+
+	// also store the bloc number
+	work->height = sctx->job.height;
+	work->pooln = sctx->pooln;
+
+	stratum_gen_header(sctx, work);
+
+	/* reserve the extranonce2 values rolled by the miner threads */
+	xnonce2_add(sctx->job.xnonce2, sctx->xnonce2_size, xnonce2_rolls(sctx->xnonce2_size));
 
 	pthread_mutex_unlock(&sctx->work_lock);
 
@@ -990,6 +1269,55 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
     diff_to_target(work->target, sctx->job.diff / 65536.0);
 }
 
+/**
+ * Work of a stratum job with the extranonce2 rolled from the one published
+ * @param tmpl struct work * as published, by stratum_gen_work()
+ * @param roll uint32_t added to its extranonce2, below xnonce2_rolls()
+ * @return bool false if the job has changed since
+ */
+static bool stratum_roll_work(struct stratum_ctx *sctx, const struct work *tmpl,
+	struct work *work, uint32_t roll)
+{
+	uchar xnonce2[sizeof(work->xnonce2)];
+	bool same;
+
+	pthread_mutex_lock(&sctx->work_lock);
+
+	same = sctx->job.job_id && !strcmp(sctx->job.job_id, tmpl->job_id + 8) &&
+		sctx->xnonce2_size == tmpl->xnonce2_len;
+	if (same) {
+		memcpy(work, tmpl, sizeof(struct work));
+		xnonce2_add(work->xnonce2, work->xnonce2_len, roll);
+
+		/* the coinbase holds the next extranonce2 to publish */
+		memcpy(xnonce2, sctx->job.xnonce2, sctx->xnonce2_size);
+		memcpy(sctx->job.xnonce2, work->xnonce2, sctx->xnonce2_size);
+		stratum_gen_header(sctx, work);
+		memcpy(sctx->job.xnonce2, xnonce2, sctx->xnonce2_size);
+	}
+
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	return same;
+}
+
+/**
+ * Publish a new work of the current job once the work space of the last
+ * one is used up or stale, unless another thread did it already
+ * @param seq uint32_t version of g_work used up
+ */
+static void stratum_republish(uint32_t seq)
+{
+	pthread_mutex_lock(&g_work_lock);
+	if (g_work_seq == seq && g_work_time && stratum->job.job_id) {
+		g_work_write_begin();
+		stratum_gen_work(stratum, &g_work);
+		g_work_write_end();
+		g_work_time = time(NULL);
+	}
+	pthread_mutex_unlock(&g_work_lock);
+}
+
 static void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = (struct thr_info *)userdata;
@@ -999,10 +1327,16 @@ static void *miner_thread(void *userdata)
 	uint32_t max_nonce;
 	uint32_t end_nonce = 0xffffffffU / opt_n_threads * (thr_id + 1) - (thr_id + 1);
 	time_t firstwork_time = 0;
-	bool work_done = false;
+	time_t tune_time = time(NULL);
 	bool extrajob = false;
+	struct work fresh;
+	uint32_t work_seq = 0;
+	struct work_slice slices[2];
+	int nslices = 0;
+	uint32_t work_roll = 0;
 	char s[16];
 	int rc = 0;
+	neoscrypt_ctx *scratchpad = NULL;
 
 	memset(&work, 0, sizeof(work)); // prevent work from being used uninitialized
 
@@ -1061,6 +1395,12 @@ static void *miner_thread(void *userdata)
 		}
 	}
 
+	/* CPU hashing scratchpad, allocated once bound to the CPU */
+	if (is_cpu_thread(thr_id)) {
+		scratchpad = neoscrypt_ctx_new(NEOSCRYPT_CTX_HUGEPAGES);
+		neoscrypt_ctx_set(scratchpad);
+	}
+
 	while (!abort_flag)
 	{
 		if (opt_benchmark)
@@ -1071,9 +1411,11 @@ static void *miner_thread(void *userdata)
 
 		struct timeval tv_start, tv_end, diff;
         uint64_t hashes_done = 0;
+		uint32_t nonces[MAX_NONCES];
 		uint32_t start_nonce;
 		uint32_t scan_time = have_longpoll ? LP_SCANTIME : opt_scantime;
 		uint64_t max64, minmax = 0x100000;
+		uint64_t slice_size;
 
 		// &work.data[19]
 		int wcmplen = 76;
@@ -1082,7 +1424,7 @@ static void *miner_thread(void *userdata)
 		if (have_stratum) 
 		{
 			uint32_t sleeptime = 0;
-			while (!work_done && time(NULL) >= (g_work_time + 60)) 
+			while (time(NULL) >= (g_work_time + 60)) 
 			{
 				usleep(100*1000);
 				if (sleeptime > 4) {
@@ -1095,15 +1437,7 @@ static void *miner_thread(void *userdata)
 			{
 				applog(LOG_DEBUG, "sleeptime: %u ms", sleeptime * 100);
 			}
-				nonceptr = (uint32_t*) (((char*)work.data) + wcmplen);
-			pthread_mutex_lock(&g_work_lock);
-			extrajob |= work_done;
-			if (nonceptr[0] >= end_nonce || extrajob) {
-				work_done = false;
-				extrajob = false;
-				stratum_gen_work(&stratum, &g_work);
-			}
-		} else 
+		} else
 		{
 			pthread_mutex_lock(&g_work_lock);
 			if ((time(NULL) - g_work_time) >= scan_time || nonceptr[0] >= (end_nonce - 0x100)) {
@@ -1111,52 +1445,62 @@ static void *miner_thread(void *userdata)
 					applog(LOG_DEBUG, "work time %u/%us nonce %x/%x", time(NULL) - g_work_time,
 						scan_time, nonceptr[0], end_nonce);
 				/* obtain new work from internal workio thread */
-				if (unlikely(!get_work(mythr, &g_work))) {
+				memcpy(&fresh, &g_work, sizeof(struct work));
+				if (unlikely(!get_work(mythr, &fresh))) {
 					pthread_mutex_unlock(&g_work_lock);
 					applog(LOG_ERR, "work retrieval failed, exiting mining thread %d", mythr->id);
 					goto out;
 				}
+				g_work_write_begin();
+				memcpy(&g_work, &fresh, sizeof(struct work));
+				g_work_write_end();
 				g_work_time = time(NULL);
 			}
+			pthread_mutex_unlock(&g_work_lock);
 		}
 
-		if (!opt_benchmark && (g_work.height != work.height || memcmp(work.target, g_work.target, sizeof(work.target))))
-		{
-			calc_diff(&g_work, 0);
-			if (!have_stratum)
-				global_diff = g_work.difficulty;
-			if (opt_debug) {
-				uint64_t target64 = g_work.target[7] * 0x100000000ULL + g_work.target[6];
-				applog(LOG_DEBUG, "job %s target change: %llx (%.1f)", g_work.job_id, target64, g_work.difficulty);
-			}
-			memcpy(work.target, g_work.target, sizeof(work.target));
-			work.difficulty = g_work.difficulty;
-			work.height = g_work.height;
-			/* on new target, ignoring nonce, clear sent data (hashlog) */
-			if (memcmp(work.target, g_work.target, sizeof(work.target))) {
-				if (check_dups)
-					hashlog_purge_job(work.job_id);
-			}
-		}
-		if (memcmp(work.data, g_work.data, wcmplen)) {
-			#if 0
-			if (opt_debug) {
-				for (int n=0; n <= (wcmplen-8); n+=8) {
-					if (memcmp(work.data + n, g_work.data + n, 8)) {
-						applog(LOG_DEBUG, "job %s work updated at offset %d:", g_work.job_id, n);
-						applog_hash((uchar*) &work.data[n]);
-						applog_compare_hash((uchar*) &g_work.data[n], (uchar*) &work.data[n]);
-					}
+		/* cleared before looking for new work, a restart after is seen by the scan */
+		work_restart[thr_id].restart = 0;
+
+		if (g_work_fetch(&fresh, &work_seq)) {
+			if (!opt_benchmark && (fresh.height != work.height || memcmp(work.target, fresh.target, sizeof(work.target))))
+			{
+				calc_diff(&fresh, 0);
+				if (!have_stratum)
+					global_diff = fresh.difficulty;
+				if (opt_debug) {
+					uint64_t target64 = fresh.target[7] * 0x100000000ULL + fresh.target[6];
+					applog(LOG_DEBUG, "job %s target change: %llx (%.1f)", fresh.job_id, target64, fresh.difficulty);
+				}
+				memcpy(work.target, fresh.target, sizeof(work.target));
+				work.difficulty = fresh.difficulty;
+				work.height = fresh.height;
+				/* on new target, ignoring nonce, clear sent data (hashlog) */
+				if (memcmp(work.target, fresh.target, sizeof(work.target))) {
+					if (check_dups)
+						hashlog_purge_job(work.job_id);
 				}
 			}
-			#endif
-			memcpy(&work, &g_work, sizeof(struct work));
-			nonceptr[0] = (UINT32_MAX / opt_n_threads) * thr_id; // 0 if single thr
-		} else
+			if (have_stratum) {
+				/* a new work space, the slices claimed before are void */
+				memcpy(&work, &fresh, sizeof(struct work));
+				work_roll = 0;
+				if (nslices && work_sched_cmp_epoch(slices[0].epoch, work_seq >> 1) < 0)
+					nslices = 0;
+			} else if (memcmp(work.data, fresh.data, wcmplen)) {
+				memcpy(&work, &fresh, sizeof(struct work));
+				nonceptr[0] = (UINT32_MAX / opt_n_threads) * thr_id; // 0 if single thr
+			} else
+				nonceptr[0]++;
+		} else if (!have_stratum)
 			nonceptr[0]++; //??
 
-		work_restart[thr_id].restart = 0;
-		pthread_mutex_unlock(&g_work_lock);
+		if (have_stratum && extrajob && work.data[0]) {
+			/* stale job: a new extranonce2 for all the threads */
+			extrajob = false;
+			stratum_republish(work_seq);
+			continue;
+		}
 
 		/* prevent gpu scans before a job is received */
 		if ((have_stratum && work.data[0] == 0 || network_fail_flag) && !opt_benchmark)
@@ -1194,7 +1538,10 @@ static void *miner_thread(void *userdata)
 		}
 
 
-		max64 *= (uint32_t)thr_hashrates[thr_id];
+		/* work space slices are sized from the device hashrate */
+		slice_size = work_sched_size(thr_hashrate(thr_id), (double) max64, 0x2000000);
+
+		max64 *= (uint32_t)thr_hashrate(thr_id);
 
 		/* on start, max64 should not be 0,
 		 *    before hashrate is computed */
@@ -1211,7 +1558,36 @@ static void *miner_thread(void *userdata)
 		max64 = min(UINT32_MAX, max64);
 		start_nonce = nonceptr[0];
 
-		if (opt_benchmark)
+		if (have_stratum)
+		{
+			if (!nslices) {
+				nslices = work_sched_claim(&g_sched, slice_size, slices);
+				if (!nslices) {
+					/* every extranonce2 of the work used up */
+					stratum_republish(work_seq);
+					continue;
+				}
+			}
+			if (work_sched_cmp_epoch(slices[0].epoch, work_seq >> 1)) {
+				/* claimed from a work about to be fetched, or a dead one */
+				if (work_sched_cmp_epoch(slices[0].epoch, work_seq >> 1) < 0)
+					nslices = 0;
+				continue;
+			}
+			if (slices[0].roll != work_roll) {
+				if (!stratum_roll_work(&pools[fresh.pooln], &fresh, &work, slices[0].roll)) {
+					/* the new job is about to be published */
+					usleep(100*1000);
+					continue;
+				}
+				work_roll = slices[0].roll;
+			}
+			start_nonce = slices[0].first;
+			max_nonce = slices[0].last;
+			work.scanned_from = start_nonce;
+			nonceptr[0] = start_nonce;
+		}
+		else if (opt_benchmark)
 		{
 			max_nonce = start_nonce + 0x5000000U;
 		}
@@ -1239,18 +1615,24 @@ static void *miner_thread(void *userdata)
 		gettimeofday(&tv_start, NULL);
 
         /* NeoScrypt */
-        rc = scanhash_neoscrypt(thr_id, work.data, work.target, max_nonce, &hashes_done, hash_mode);
+        if(is_cpu_thread(thr_id))
+          rc = scanhash_neoscrypt_cpu(thr_id, work.data, work.target, max_nonce, &hashes_done, nonces, hash_mode);
+        else
+          rc = scanhash_neoscrypt(thr_id, work.data, work.target, max_nonce, &hashes_done, nonces, hash_mode);
 
 		/* record scanhash elapsed time */
 		gettimeofday(&tv_end, NULL);
 
+		if (unlikely(rc < 0)) {
+			applog(LOG_ERR, "out of memory for the scratchpad, exiting mining thread %d", mythr->id);
+			goto out;
+		}
+
 		if (firstwork_time == 0)
 			firstwork_time = time(NULL);
 
-		if (rc && opt_debug)
-			applog(LOG_NOTICE, CL_CYN "found => %08x" CL_GRN " %08x", nonceptr[0], swab32(nonceptr[0])); // data[19]
-		if (rc > 1 && opt_debug)
-			applog(LOG_NOTICE, CL_CYN "found => %08x" CL_GRN " %08x", nonceptr[2], swab32(nonceptr[2])); // data[21]
+		for (int i = 0; i < rc && opt_debug; i++)
+			applog(LOG_NOTICE, CL_CYN "found => %08x" CL_GRN " %08x", nonces[i], swab32(nonces[i]));
 
 		timeval_subtract(&diff, &tv_end, &tv_start);
 
@@ -1264,15 +1646,32 @@ static void *miner_thread(void *userdata)
 
 			/* store thread hashrate */
 			if (dtime > 0.0) {
-				pthread_mutex_lock(&stats_lock);
-				thr_hashrates[thr_id] = hashes_done / dtime;
-				thr_hashrates[thr_id] *= rate_factor;
-                stats_remember_speed(thr_id, (uint)hashes_done, thr_hashrates[thr_id], (uchar)rc, work.height);
-				pthread_mutex_unlock(&stats_lock);
+				stats_store_double(&thr_hashrates[thr_id], hashes_done / dtime * rate_factor);
+				stats_remember_speed(thr_id, (uint)hashes_done, hashes_done * rate_factor / dtime,
+					(uchar)rc, work.height);
 			}
 		}
 
+		/* the tuning cache learns the speed of the settings in use,
+		 * averaged over the interval */
+		if (!is_cpu_thread(thr_id) && time(NULL) - tune_time >= TUNE_UPDATE_INTERVAL) {
+			struct stats_estimate est;
+			stats_get_estimate(thr_id, &est);
+			neoscrypt_tune_update(thr_id, est.ewma[1] > 0. ? est.ewma[1] :
+				stats_get_speed(thr_id, 0.0));
+			tune_time = time(NULL);
+		}
+
         work.scanned_to = start_nonce + (uint)hashes_done;
+
+		if (have_stratum && nslices) {
+			/* what is left of the slice comes next */
+			if ((uint64_t) start_nonce + hashes_done > slices[0].last) {
+				slices[0] = slices[1];
+				nslices--;
+			} else
+				slices[0].first = start_nonce + (uint32_t) hashes_done;
+		}
 		if (opt_debug && opt_benchmark) 
 		{
 			// to debug nonce ranges
@@ -1288,14 +1687,14 @@ static void *miner_thread(void *userdata)
 			bool   writelog = false;
 			double hashrate = 0.0;
 
-			if (opt_n_gputhreads != 1)
+			if (opt_n_gputhreads != 1 && !is_cpu_thread(thr_id))
 			{
 				if (loopcnt%opt_n_gputhreads == 0 ) //Display the hash 1 time per gpu and not opt_n_gputhreads times per gpu
 				{
 					int index = thr_id / opt_n_gputhreads;
 					for (int i = 0; i < opt_n_gputhreads; i++)
 					{
-						hashrate += thr_hashrates[(index*opt_n_gputhreads) + i];
+						hashrate += thr_hashrate((index*opt_n_gputhreads) + i);
 					}
 					if (!opt_quiet) writelog = true;
 				}
@@ -1304,10 +1703,15 @@ static void *miner_thread(void *userdata)
 			{	
 
 				if(!opt_quiet) writelog = true;
-				hashrate = thr_hashrates[thr_id];
+				hashrate = thr_hashrate(thr_id);
 			}
 			if (hashrate == 0.0) writelog = false;
-			if (writelog)
+			if (writelog && is_cpu_thread(thr_id))
+			{
+				applog(LOG_INFO, "CPU #%d: %*.f", cpu_thread_index(thr_id),
+					(hashrate > 1e6) ? 0 : 2, 1e-3 * hashrate);
+			}
+			else if (writelog)
 			{
 #ifdef USE_WRAPNVML
 				if (hnvml != NULL) {
@@ -1333,17 +1737,13 @@ static void *miner_thread(void *userdata)
 		if ((loopcnt>0) && thr_id == (opt_n_threads - 1)) 
 		{
 			double hashrate = 0.;
-			pthread_mutex_lock(&stats_lock);
 			for (int i = 0; i < opt_n_threads; i++)
-				hashrate += stats_get_speed(i, thr_hashrates[i]);
-			pthread_mutex_unlock(&stats_lock);
+				hashrate += stats_get_speed(i, thr_hashrate(i));
 			if (opt_benchmark) 
 			{
 				double hashrate = 0.;
-				pthread_mutex_lock(&stats_lock);
-				for (int i = 0; i < opt_n_threads && thr_hashrates[i]; i++)
-					hashrate += stats_get_speed(i, thr_hashrates[i]);
-				pthread_mutex_unlock(&stats_lock);
+				for (int i = 0; i < opt_n_threads && thr_hashrate(i); i++)
+					hashrate += stats_get_speed(i, thr_hashrate(i));
 				if (opt_benchmark && loopcnt >1) {
 					format_hashrate(hashrate, s);
 					applog(LOG_NOTICE, "Total: %s", s);
@@ -1357,11 +1757,22 @@ static void *miner_thread(void *userdata)
 			}
 		}
 
-		/* if nonce found, submit work */
-		if (rc && !opt_benchmark) {
-			if (!submit_work(mythr, &work))
+		/* if nonces found, submit work;
+		 * GPU nonces are verified on the CPU before submission,
+		 * the GPU thread waits while the verify queue is full */
+		int submitted = 0;
+		while (submitted < rc) {
+			work.data[19] = nonces[submitted];
+			if (!is_cpu_thread(thr_id))
+				verify_push(mythr, &work);
+			else if (!opt_benchmark && !submit_work(mythr, &work))
 				break;
+			submitted++;
+		}
+		if (submitted < rc)
+			break;
 
+		if (rc && !opt_benchmark) {
 			// prevent stale work in solo
 			// we can't submit twice a block!
 			if (!have_stratum) {
@@ -1371,23 +1782,17 @@ static void *miner_thread(void *userdata)
 				pthread_mutex_unlock(&g_work_lock);
 				continue;
 			}
-
-			// second nonce found, submit too (on pool only!)
-			if (rc > 1 && work.data[21]) {
-				work.data[19] = work.data[21];
-				work.data[21] = 0;
-				if (!submit_work(mythr, &work))
-					break;
-			}
 		}
         work.data[19] = start_nonce + (uint)hashes_done;
 		loopcnt++;
 	}
 
+	neoscrypt_ctx_free(scratchpad);
 	return NULL;
 
 out:
 	tq_freeze(mythr->q);
+	neoscrypt_ctx_free(scratchpad);
 
 	return NULL;
 }
@@ -1398,6 +1803,7 @@ static void *longpoll_thread(void *userdata)
 	CURL *curl = NULL;
 	char *copy_start, *hdr_path = NULL, *lp_url = NULL;
 	bool need_slash = false;
+	bool decoded;
 
 	curl = curl_easy_init();
 	if (unlikely(!curl)) {
@@ -1451,7 +1857,10 @@ static void *longpoll_thread(void *userdata)
 			soval = json_object_get(json_object_get(val, "result"), "submitold");
 			submit_old = soval ? json_is_true(soval) : false;
 			pthread_mutex_lock(&g_work_lock);
-			if (work_decode(json_object_get(val, "result"), &g_work)) {
+			g_work_write_begin();
+			decoded = work_decode(json_object_get(val, "result"), &g_work);
+			g_work_write_end();
+			if (decoded) {
 				if (opt_debug)
 					applog(LOG_BLUE, "LONGPOLL pushed new work");
 				g_work_time = time(NULL);
@@ -1485,11 +1894,12 @@ out:
 	return NULL;
 }
 
-static bool stratum_handle_response(char *buf)
+static bool stratum_handle_response(struct stratum_ctx *sctx, char *buf)
 {
 	json_t *val, *err_val, *res_val, *id_val;
 	json_error_t err;
 	struct timeval tv_answer, diff;
+	struct stratum_share share;
 	bool ret = false;
 
 	val = JSON_LOADS(buf, &err);
@@ -1506,15 +1916,27 @@ static bool stratum_handle_response(char *buf)
 		goto out;
 
 	// ignore subscribe late answer (yaamp)
-	if (json_integer_value(id_val) < 4)
+	if (json_integer_value(id_val) < STRATUM_SUBMIT_ID)
 		goto out;
 
+	if (!stratum_share_answered(sctx, (uint32_t) json_integer_value(id_val), &share)) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "answer to unknown share %u", (uint32_t) json_integer_value(id_val));
+		goto out;
+	}
+
 	gettimeofday(&tv_answer, NULL);
-	timeval_subtract(&diff, &tv_answer, &stratum.tv_submit);
-	// store time required to the pool to answer to a submit
-	stratum.answer_msec = (1000 * diff.tv_sec) + (uint32_t) (0.001 * diff.tv_usec);
+	timeval_subtract(&diff, &tv_answer, &share.tv_submit);
+	// store time required to the pool to answer to this submit
+	sctx->answer_msec = (1000 * diff.tv_sec) + (uint32_t) (0.001 * diff.tv_usec);
+	metrics_observe(&sctx->submit_latency, diff.tv_sec + 1e-6 * diff.tv_usec);
+	if (opt_debug)
+		applog(LOG_DEBUG, "share %u nonce %08x %s in %u ms", share.id, share.nonce,
+			json_is_true(res_val) ? "accepted" : "rejected", sctx->answer_msec);
 
-	share_result(json_is_true(res_val),
+	if (json_is_true(res_val))
+		stats_remember_share(share.thr_id, share.hashes);
+	share_result(sctx, json_is_true(res_val),
 		err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
 
 	ret = true;
@@ -1525,40 +1947,76 @@ out:
 	return ret;
 }
 
+/**
+ * Switch to the pool chosen by the strategy; the switch is immediate as
+ * every pool is kept connected with a current job
+ * @param rotate bool move on from the current pool (round-robin)
+ */
+static void pool_select(bool rotate)
+{
+	struct stratum_ctx *best;
+
+	pthread_mutex_lock(&g_work_lock);
+
+	best = pool_choose(stratum, opt_pool_strategy, rotate);
+	if (best && best != stratum) {
+		applog(LOG_BLUE, "Switching to pool %d: %s", best->pooln, pool_name(best));
+		stratum = best;
+		g_work_write_begin();
+		stratum_gen_work(stratum, &g_work);
+		g_work_write_end();
+		g_work_time = time(NULL);
+		network_fail_flag = false;
+		restart_threads();
+	} else if (!best) {
+		/* nothing to mine until a pool is back */
+		g_work_time = 0;
+		restart_threads();
+	}
+	if (best != stratum || rotate)
+		pool_switch_time = time(NULL);
+
+	pthread_mutex_unlock(&g_work_lock);
+}
+
 static void *stratum_thread(void *userdata)
 {
 	struct thr_info *mythr = (struct thr_info *)userdata;
+	struct stratum_ctx *pool;
+	bool ready = false, block;
 	char *s;
 
-	stratum.url = (char*)tq_pop(mythr->q, NULL);
-	if (!stratum.url)
+	pool = (struct stratum_ctx *)tq_pop(mythr->q, NULL);
+	if (!pool)
 		goto out;
-	applog(LOG_BLUE, "Starting Stratum on %s", stratum.url);
+	applog(LOG_BLUE, "Starting Stratum on %s", pool->url);
 
 	while (!abort_flag) {
 		int failures = 0;
 
-		if (stratum_need_reset) {
+		if (stratum_need_reset && pool == stratum) {
 			stratum_need_reset = false;
-			stratum_disconnect(&stratum);
+			stratum_disconnect(pool);
 			applog(LOG_DEBUG, "stratum connection reset");
 		}
 
-		while (!stratum.curl && !abort_flag) {
-			pthread_mutex_lock(&g_work_lock);
-			g_work_time = 0;
-			pthread_mutex_unlock(&g_work_lock);
-			restart_threads();
-
-			if (!stratum_connect(&stratum, stratum.url) ||
-			    !stratum_subscribe(&stratum) ||
-			    !stratum_authorize(&stratum, rpc_user, rpc_pass,opt_extranonce)) {
-				stratum_disconnect(&stratum);
-				network_fail_flag = true;
-
-				if (opt_retries >= 0 && ++failures > opt_retries) {
+		while (!pool->curl && !abort_flag) {
+			/* another pool takes over while this one reconnects */
+			ready = false;
+			pool_select(false);
+
+			if (!stratum_connect(pool, pool->url) ||
+			    !stratum_subscribe(pool) ||
+			    !stratum_authorize(pool, pool->user, pool->pass, opt_extranonce) ||
+			    !stratum_online(pool)) {
+				stratum_disconnect(pool);
+				if (pool == stratum)
+					network_fail_flag = true;
+
+				/* backup pools keep trying */
+				if (opt_retries >= 0 && ++failures > opt_retries && num_pools == 1) {
 					applog(LOG_ERR, "...terminating workio thread");
-					tq_push(thr_info[work_thr_id].q, NULL);
+					workio_abort();
 					abort_flag = true;
 					goto out;
 				}
@@ -1568,44 +2026,54 @@ static void *stratum_thread(void *userdata)
 			}
 		}
 
-		if (stratum.job.job_id &&
-		    (!g_work_time || strncmp(stratum.job.job_id, g_work.job_id + 8, 120))) {
-			pthread_mutex_lock(&g_work_lock);
-			stratum_gen_work(&stratum, &g_work);
+		block = false;
+		pthread_mutex_lock(&g_work_lock);
+		if (pool == stratum && pool->job.job_id &&
+		    (!g_work_time || strncmp(pool->job.job_id, g_work.job_id + 8, 120))) {
+			g_work_write_begin();
+			stratum_gen_work(pool, &g_work);
+			g_work_write_end();
 			g_work_time = time(NULL);
-			if (stratum.job.clean) 
+			if (pool->job.clean) 
 			{
 				network_fail_flag = false;
+				block = true;
 				if (!opt_quiet)
-					applog(LOG_BLUE, "%s %s block %d", short_url, algo_names[opt_algo],
-						stratum.job.height);
+					applog(LOG_BLUE, "%s %s block %d", pool_name(pool), algo_names[opt_algo],
+						pool->job.height);
 				restart_threads();
 				if (check_dups)
 					hashlog_purge_old();
-				stats_purge_old();
 			} else if (opt_debug && !opt_quiet) {
-					applog(LOG_BLUE, "%s asks job %d for block %d", short_url,
-						strtoul(stratum.job.job_id, NULL, 16), stratum.job.height);
+					applog(LOG_BLUE, "%s asks job %d for block %d", pool_name(pool),
+						strtoul(pool->job.job_id, NULL, 16), pool->job.height);
 			}
-			pthread_mutex_unlock(&g_work_lock);
 		}
-		
-		if (!stratum_socket_full(&stratum, 120)) {
-			applog(LOG_ERR, "Stratum connection timed out");
-			s = NULL;
-		} else
-			s = stratum_recv_line(&stratum);
+		pthread_mutex_unlock(&g_work_lock);
+
+		if (!ready && pool_ready(pool)) {
+			/* first job since connected, this pool may take over */
+			ready = true;
+			if (num_pools > 1)
+				pool_select(false);
+		} else if (pool == stratum && num_pools > 1) {
+			if ((opt_pool_strategy == POOL_ROUNDROBIN &&
+			     time(NULL) - pool_switch_time >= opt_pool_rotate * 60) ||
+			    (opt_pool_strategy == POOL_QUOTA && block))
+				pool_select(true);
+		}
+
+		s = stratum_next_line(pool, 120);
 		if (!s) {
-			stratum_disconnect(&stratum);
-			applog(LOG_ERR, "Stratum connection interrupted");
+			stratum_disconnect(pool);
+			applog(LOG_ERR, "Stratum connection to %s interrupted", pool_name(pool));
 			continue;
 		}
-		if (!stratum_handle_method(&stratum, s))
-			stratum_handle_response(s);
-		free(s);
+		if (!stratum_handle_method(pool, s))
+			stratum_handle_response(pool, s);
 	}
 
-	stratum_disconnect(&stratum);
+	stratum_disconnect(pool);
 
 out:
 	return NULL;
@@ -1771,6 +2239,8 @@ static void parse_arg(int key, char *arg)
 		rpc_user = strdup(arg);
 		break;
 	case 'o':			/* --url */
+		/* the previous one is a pool with higher priority */
+		pool_save();
 		p = strstr(arg, "://");
 		if (p) {
 			if (strncasecmp(arg, "http://", 7) && strncasecmp(arg, "https://", 8) &&
@@ -1886,6 +2356,46 @@ static void parse_arg(int key, char *arg)
 			show_usage_and_exit(1);
 		opt_priority = v;
 		break;
+	case 1022:
+		v = atoi(arg);
+		if (v < 0 || v > MAX_GPUS)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_n_cputhreads = v;
+		break;
+	case 1023:
+		v = atoi(arg);
+		if (v < 1 || v > 64)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_n_verifythreads = v;
+		break;
+	case 1024:
+		for (v = 0; v < (int) ARRAY_SIZE(pool_strategy_names); v++) {
+			if (!strcasecmp(arg, pool_strategy_names[v]))
+				break;
+		}
+		if (v == (int) ARRAY_SIZE(pool_strategy_names))
+			show_usage_and_exit(1);
+		opt_pool_strategy = v;
+		break;
+	case 1025:
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_pool_rotate = v;
+		break;
+	case 1026:
+		v = atoi(arg);
+		if (v < 1 || v > 9999)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_pool_quota = v;
+		break;
+	case 1027:
+		free(opt_tune_file);
+		opt_tune_file = strdup(arg);
+		break;
+	case 1028:
+		opt_autotune = false;
+		break;
 	case 'd': // CB
 		{
 			int ngpus = cuda_num_devices();
@@ -2047,6 +2557,20 @@ static void parse_cmdline(int argc, char *argv[])
 
 	parse_config();
 
+	/* the pool given last, then mine the first one */
+	pool_save();
+	if (num_pools > 1) {
+		free(rpc_url);
+		rpc_url = strdup(pools[0].url);
+		short_url = strstr(rpc_url, "://") + 3;
+		free(rpc_user);
+		rpc_user = strdup(pools[0].user);
+		free(rpc_pass);
+		rpc_pass = strdup(pools[0].pass);
+		free(rpc_userpass);
+		rpc_userpass = NULL;
+		have_stratum = !opt_benchmark && !strncasecmp(rpc_url, "stratum", 7);
+	}
 }
 
 #ifndef WIN32
@@ -2174,6 +2698,14 @@ int main(int argc, char *argv[])
 	parse_cmdline(argc, argv);
 	if (abort_flag) return 0;
 
+	if (!opt_tune_file)
+		opt_tune_file = strdup("cudaminer-tune.json");
+
+	/* select the CPU NeoScrypt engines before any thread starts */
+	uint lanes = neoscrypt_lanes();
+	if (opt_debug)
+		applog(LOG_DEBUG, "CPU NeoScrypt engine: %u lanes", lanes);
+
 	if (!opt_benchmark && !rpc_url) {
 		fprintf(stderr, "%s: no URL supplied\n", argv[0]);
 		show_usage_and_exit(1);
@@ -2187,10 +2719,11 @@ int main(int argc, char *argv[])
 	}
 
 	/* init stratum data.. */
-	memset(&stratum.url, 0, sizeof(stratum));
-
-	pthread_mutex_init(&stratum.sock_lock, NULL);
-	pthread_mutex_init(&stratum.work_lock, NULL);
+	for (i = 0; i < MAX_POOLS; i++) {
+		pthread_mutex_init(&pools[i].sock_lock, NULL);
+		pthread_mutex_init(&pools[i].share_lock, NULL);
+		pthread_mutex_init(&pools[i].work_lock, NULL);
+	}
 
 	flags = !opt_benchmark && rpc_url && strncmp(rpc_url, "https:", 6)
 	      ? (CURL_GLOBAL_ALL & ~CURL_GLOBAL_SSL)
@@ -2283,11 +2816,19 @@ int main(int argc, char *argv[])
 		affine_to_cpu_mask(-1, opt_affinity);
 	}
 	if (active_gpus == 0) {
-		applog(LOG_ERR, "No CUDA devices found! terminating.");
-		exit(1);
-	}
-	if (!opt_n_threads)
+		if (!opt_n_cputhreads) {
+			applog(LOG_ERR, "No CUDA devices found! terminating.");
+			exit(1);
+		}
+		opt_n_threads = 0;
+	} else if (!opt_n_threads)
 		opt_n_threads = active_gpus;
+	/* CPU miner threads are appended to the GPU ones */
+	if (opt_n_threads + opt_n_cputhreads > MAX_GPUS) {
+		opt_n_cputhreads = max(0, MAX_GPUS - opt_n_threads);
+		applog(LOG_WARNING, "Too many miner threads, using %d CPU threads", opt_n_cputhreads);
+	}
+	opt_n_threads += opt_n_cputhreads;
 
 
 
@@ -2320,7 +2861,10 @@ int main(int argc, char *argv[])
 	if (!work_restart)
 		return 1;
 
-	thr_info = (struct thr_info *)calloc(opt_n_threads + 4, sizeof(*thr));
+	if (!stats_init(opt_n_threads))
+		return 1;
+
+	thr_info = (struct thr_info *)calloc(opt_n_threads + 4 + MAX_POOLS, sizeof(*thr));
 	if (!thr_info)
 		return 1;
 
@@ -2329,7 +2873,7 @@ int main(int argc, char *argv[])
 	thr = &thr_info[work_thr_id];
 	thr->id = work_thr_id;
 	thr->q = tq_new();
-	if (!thr->q)
+	if (!thr->q || !workio_init())
 		return 1;
 
 	/* start work I/O thread */
@@ -2338,6 +2882,13 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* start GPU result verification threads */
+	if (opt_n_threads > opt_n_cputhreads &&
+		!verify_init(opt_n_verifythreads, submit_work)) {
+		applog(LOG_ERR, "verify thread create failed");
+		return 1;
+	}
+
 	if (want_longpoll && !have_stratum) {
 		/* init longpoll thread info */
 		longpoll_thr_id = opt_n_threads + 1;
@@ -2370,7 +2921,22 @@ int main(int argc, char *argv[])
 		}
 
 		if (have_stratum)
-			tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
+			tq_push(thr_info[stratum_thr_id].q, &pools[0]);
+	}
+
+	/* backup pools, connected ahead of time */
+	for (i = 1; have_stratum && i < num_pools; i++) {
+		thr = &thr_info[opt_n_threads + 3 + i];
+		thr->id = opt_n_threads + 3 + i;
+		thr->q = tq_new();
+		if (!thr->q)
+			return 1;
+
+		if (unlikely(pthread_create(&thr->pth, NULL, stratum_thread, thr))) {
+			applog(LOG_ERR, "stratum thread create failed");
+			return 1;
+		}
+		tq_push(thr->q, &pools[i]);
 	}
 
 #ifdef USE_WRAPNVML
@@ -2,13 +2,18 @@
  * Hash log of submitted job nonces
  * Prevent duplicate shares
  *
+ * The nonces sent are kept in an open addressing table keyed by job and
+ * nonce, chained per job from an index of the jobs (open addressing too)
+ * which also holds the scanned range and the last nonce sent, so a job
+ * is looked up or purged without going over the other ones
+ *
  * (to be merged later with stats)
  *
  * tpruvot@github 2014
  */
 #include <stdlib.h>
 #include <memory.h>
-#include <map>
+#include <pthread.h>
 
 #include "miner.h"
 #include "log.h"
@@ -21,6 +26,8 @@
 struct hashlog_data {
 	uint32_t tm_sent;
 	uint32_t height;
+	uint32_t njobid;
+	uint32_t nonce;
 	uint32_t scanned_from;
 	uint32_t scanned_to;
 	uint32_t last_from;
@@ -29,18 +36,249 @@ struct hashlog_data {
 };
 */
 
-static std::map<uint64_t, hashlog_data> tlastshares;
-
 #define LOG_PURGE_TIMEOUT 5*60
 
+/* slots of the tables, powers of 2 */
+#define HASHLOG_MIN_SHARES 256
+#define HASHLOG_MIN_JOBS   64
+
+#define SLOT_EMPTY   0
+#define SLOT_USED    1
+#define SLOT_DELETED 2
+
+struct hashlog_share {
+	uint32_t njobid;
+	uint32_t nonce;
+	uint32_t tm_sent;
+	uint32_t height;
+	uint32_t scanned_from;
+	/* next share of the job, -1 for none */
+	int32_t next;
+	uint8_t state;
+};
+
+struct hashlog_job {
+	uint32_t njobid;
+	uint8_t state;
+	/* range scanned by the miner threads, known */
+	bool ranged;
+	uint32_t height;
+	uint32_t scanned_from;
+	uint32_t scanned_to;
+	uint32_t last_from;
+	uint32_t tm_add;
+	uint32_t tm_upd;
+	/* range and highest nonce of the shares sent */
+	uint32_t sent_from;
+	uint32_t last_sent;
+	uint32_t shares;
+	/* first share, -1 for none */
+	int32_t first;
+};
+
+static struct hashlog_share *shares = NULL;
+static uint32_t shares_size = 0, shares_used = 0, shares_deleted = 0;
+static struct hashlog_job *jobs = NULL;
+static uint32_t jobs_size = 0, jobs_used = 0, jobs_deleted = 0;
+
+/* submits, scans and API may come from different threads */
+static pthread_mutex_t hashlog_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * str hex to uint32
+ * job id as given by stratum_gen_work ("%07x %s") or from the getwork
+ * ntime: up to 8 hex digits
  */
-static uint64_t hextouint(char* jobid)
+static uint32_t hextouint(const char* jobid)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		char c = jobid[i];
+		if (c >= '0' && c <= '9')
+			v = (v << 4) | (c - '0');
+		else if (c >= 'a' && c <= 'f')
+			v = (v << 4) | (c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			v = (v << 4) | (c - 'A' + 10);
+		else
+			break;
+	}
+	return v;
+}
+
+static uint32_t slot_hash(uint64_t key, uint32_t size)
+{
+	return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+/* Table size for a number of entries, three quarters full at most */
+static uint32_t table_size(uint32_t entries, uint32_t minimum)
+{
+	uint32_t size = minimum;
+
+	while (size * 3 < (entries + 1) * 4)
+		size *= 2;
+	return size;
+}
+
+static struct hashlog_job *job_find(uint32_t njobid)
+{
+	uint32_t i;
+
+	if (!jobs)
+		return NULL;
+
+	for (i = slot_hash(njobid, jobs_size); jobs[i].state != SLOT_EMPTY; i = (i + 1) & (jobs_size - 1)) {
+		if (jobs[i].state == SLOT_USED && jobs[i].njobid == njobid)
+			return &jobs[i];
+	}
+	return NULL;
+}
+
+static int share_find(uint32_t njobid, uint32_t nonce)
+{
+	uint32_t i;
+
+	if (!shares)
+		return -1;
+
+	for (i = slot_hash(MK_HI64(njobid) + nonce, shares_size); shares[i].state != SLOT_EMPTY;
+	     i = (i + 1) & (shares_size - 1)) {
+		if (shares[i].state == SLOT_USED && shares[i].njobid == njobid && shares[i].nonce == nonce)
+			return (int) i;
+	}
+	return -1;
+}
+
+/* Moves the shares to a table of a size, rebuilding the chains of the jobs */
+static bool shares_rehash(uint32_t size)
+{
+	struct hashlog_share *old = shares;
+	uint32_t old_size = shares_size, i, j;
+
+	shares = (struct hashlog_share *) calloc(size, sizeof(*shares));
+	if (!shares) {
+		shares = old;
+		return false;
+	}
+	shares_size = size;
+	shares_deleted = 0;
+
+	for (i = 0; i < jobs_size; i++)
+		jobs[i].first = -1;
+
+	for (i = 0; i < old_size; i++) {
+		struct hashlog_job *job;
+		if (old[i].state != SLOT_USED)
+			continue;
+		j = slot_hash(MK_HI64(old[i].njobid) + old[i].nonce, size);
+		while (shares[j].state != SLOT_EMPTY)
+			j = (j + 1) & (size - 1);
+		shares[j] = old[i];
+		job = job_find(old[i].njobid);
+		shares[j].next = job->first;
+		job->first = (int32_t) j;
+	}
+
+	free(old);
+	return true;
+}
+
+static bool jobs_rehash(uint32_t size)
+{
+	struct hashlog_job *old = jobs;
+	uint32_t old_size = jobs_size, i, j;
+
+	jobs = (struct hashlog_job *) calloc(size, sizeof(*jobs));
+	if (!jobs) {
+		jobs = old;
+		return false;
+	}
+	jobs_size = size;
+	jobs_deleted = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].state != SLOT_USED)
+			continue;
+		j = slot_hash(old[i].njobid, size);
+		while (jobs[j].state != SLOT_EMPTY)
+			j = (j + 1) & (size - 1);
+		jobs[j] = old[i];
+	}
+
+	free(old);
+	return true;
+}
+
+/* Job of an id, added if new */
+static struct hashlog_job *job_get(uint32_t njobid)
+{
+	struct hashlog_job *job = job_find(njobid);
+	uint32_t i;
+
+	if (job)
+		return job;
+
+	if ((jobs_used + jobs_deleted + 1) * 4 > jobs_size * 3 &&
+	    !jobs_rehash(table_size(jobs_used + 1, HASHLOG_MIN_JOBS)))
+		return NULL;
+
+	i = slot_hash(njobid, jobs_size);
+	while (jobs[i].state == SLOT_USED)
+		i = (i + 1) & (jobs_size - 1);
+	if (jobs[i].state == SLOT_DELETED)
+		jobs_deleted--;
+	jobs_used++;
+
+	job = &jobs[i];
+	memset(job, 0, sizeof(*job));
+	job->state = SLOT_USED;
+	job->njobid = njobid;
+	job->first = -1;
+	return job;
+}
+
+static void job_delete(struct hashlog_job *job)
+{
+	job->state = SLOT_DELETED;
+	jobs_used--;
+	jobs_deleted++;
+}
+
+/* Sent range of a job from its shares, after some are gone */
+static void job_sent_range(struct hashlog_job *job)
+{
+	int32_t i;
+
+	job->sent_from = job->last_sent = 0;
+	for (i = job->first; i >= 0; i = shares[i].next) {
+		if (shares[i].nonce > job->last_sent)
+			job->last_sent = shares[i].nonce;
+		if (shares[i].scanned_from && (shares[i].scanned_from < job->sent_from || !job->sent_from))
+			job->sent_from = shares[i].scanned_from;
+	}
+}
+
+/* Range of a job: min and max of the miner threads range and the shares */
+static uint64_t job_range(struct hashlog_job *job)
 {
-	char *ptr;
-	/* dont use strtoull(), only since VS2013 */
-	return (uint64_t) strtoul(jobid, &ptr, 16);
+	uint32_t from = 0, to = 0;
+
+	if (!job)
+		return 0;
+
+	if (job->ranged && job->scanned_to) {
+		from = job->scanned_from;
+		to = job->scanned_to;
+	}
+	if (job->last_sent) {
+		if (job->last_sent > to)
+			to = job->last_sent;
+		if (job->sent_from && (job->sent_from < from || !from))
+			from = job->sent_from;
+	}
+	return from + MK_HI64(to);
 }
 
 /**
@@ -49,16 +287,18 @@ static uint64_t hextouint(char* jobid)
 uint32_t hashlog_already_submittted(char* jobid, uint32_t nonce)
 {
 	uint32_t ret = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t key = (njobid << 32) + nonce;
+	int i;
 
 	if (nonce == 0) {
 		// search last submitted nonce for job
-		ret = hashlog_get_last_sent(jobid);
-	} else if (tlastshares.find(key) != tlastshares.end()) {
-		hashlog_data data = tlastshares[key];
-		ret = data.tm_sent;
+		return hashlog_get_last_sent(jobid);
 	}
+
+	pthread_mutex_lock(&hashlog_lock);
+	i = share_find(hextouint(jobid), nonce);
+	if (i >= 0)
+		ret = shares[i].tm_sent;
+	pthread_mutex_unlock(&hashlog_lock);
 	return ret;
 }
 /**
@@ -66,17 +306,45 @@ uint32_t hashlog_already_submittted(char* jobid, uint32_t nonce)
  */
 void hashlog_remember_submit(struct work* work, uint32_t nonce)
 {
-	uint64_t njobid = hextouint(work->job_id);
-	uint64_t key = (njobid << 32) + nonce;
-	hashlog_data data;
-
-	memset(&data, 0, sizeof(data));
-	data.scanned_from = work->scanned_from;
-	data.scanned_to = nonce;
-	data.height = work->height;
-	data.njobid = (uint32_t) njobid;
-	data.tm_add = data.tm_upd = data.tm_sent = (uint32_t) time(NULL);
-	tlastshares[key] = data;
+	uint32_t njobid = hextouint(work->job_id);
+	struct hashlog_job *job;
+	int i;
+
+	pthread_mutex_lock(&hashlog_lock);
+
+	job = job_get(njobid);
+	if (!job)
+		goto out;
+
+	i = share_find(njobid, nonce);
+	if (i < 0) {
+		if ((shares_used + shares_deleted + 1) * 4 > shares_size * 3 &&
+		    !shares_rehash(table_size(shares_used + 1, HASHLOG_MIN_SHARES)))
+			goto out;
+		i = (int) slot_hash(MK_HI64(njobid) + nonce, shares_size);
+		while (shares[i].state == SLOT_USED)
+			i = (i + 1) & (shares_size - 1);
+		if (shares[i].state == SLOT_DELETED)
+			shares_deleted--;
+		shares_used++;
+		shares[i].state = SLOT_USED;
+		shares[i].njobid = njobid;
+		shares[i].nonce = nonce;
+		shares[i].next = job->first;
+		job->first = i;
+		job->shares++;
+	}
+	shares[i].scanned_from = work->scanned_from;
+	shares[i].height = work->height;
+	shares[i].tm_sent = (uint32_t) time(NULL);
+
+	job->height = work->height;
+	if (nonce > job->last_sent)
+		job->last_sent = nonce;
+	if (work->scanned_from && (work->scanned_from < job->sent_from || !job->sent_from))
+		job->sent_from = work->scanned_from;
+out:
+	pthread_mutex_unlock(&hashlog_lock);
 }
 
 /**
@@ -84,39 +352,46 @@ void hashlog_remember_submit(struct work* work, uint32_t nonce)
  */
 void hashlog_remember_scan_range(struct work* work)
 {
-	uint64_t njobid = hextouint(work->job_id);
-	uint64_t key = (njobid << 32);
-	uint64_t range = hashlog_get_scan_range(work->job_id);
-	hashlog_data data;
+	struct hashlog_job *job;
+	uint64_t range;
+
+	pthread_mutex_lock(&hashlog_lock);
+
+	job = job_get(hextouint(work->job_id));
+	if (!job) {
+		pthread_mutex_unlock(&hashlog_lock);
+		return;
+	}
 
 	// global scan range of a job
-	data = tlastshares[key];
+	range = job_range(job);
 	if (range == 0) {
-		memset(&data, 0, sizeof(data));
-		data.njobid = (uint32_t) njobid;
+		job->scanned_from = job->scanned_to = 0;
+		job->tm_add = 0;
 	} else {
 		// get min and max from all sent records
-		data.scanned_from = LO_DWORD(range);
-		data.scanned_to   = HI_DWORD(range);
+		job->scanned_from = LO_DWORD(range);
+		job->scanned_to   = HI_DWORD(range);
 	}
 
-	if (data.tm_add == 0)
-		data.tm_add = (uint32_t) time(NULL);
+	if (!job->ranged || job->tm_add == 0)
+		job->tm_add = (uint32_t) time(NULL);
+	job->ranged = true;
 
-	data.last_from = work->scanned_from;
+	job->last_from = work->scanned_from;
 
 	if (work->scanned_from < work->scanned_to) {
-		if (data.scanned_to == 0 || work->scanned_from == data.scanned_to + 1)
-			data.scanned_to = work->scanned_to;
-		if (data.scanned_from == 0)
-			data.scanned_from = work->scanned_from ? work->scanned_from : 1; // min 1
-		else if (work->scanned_from < data.scanned_from || work->scanned_to == (data.scanned_from - 1))
-			data.scanned_from = work->scanned_from;
+		if (job->scanned_to == 0 || work->scanned_from == job->scanned_to + 1)
+			job->scanned_to = work->scanned_to;
+		if (job->scanned_from == 0)
+			job->scanned_from = work->scanned_from ? work->scanned_from : 1; // min 1
+		else if (work->scanned_from < job->scanned_from || work->scanned_to == (job->scanned_from - 1))
+			job->scanned_from = work->scanned_from;
 	}
 
-	data.tm_upd = (uint32_t) time(NULL);
+	job->tm_upd = (uint32_t) time(NULL);
 
-	tlastshares[key] = data;
+	pthread_mutex_unlock(&hashlog_lock);
 /* 	applog(LOG_BLUE, "job %s range : %x %x -> %x %x", jobid,
 		scanned_from, scanned_to, data.scanned_from, data.scanned_to); */
 }
@@ -127,26 +402,11 @@ void hashlog_remember_scan_range(struct work* work)
  */
 uint64_t hashlog_get_scan_range(char* jobid)
 {
-	uint64_t ret = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t keypfx = (njobid << 32);
-	uint64_t keymsk = (0xffffffffULL << 32);
-	hashlog_data data;
-
-	data.scanned_from = 0;
-	data.scanned_to = 0;
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((keymsk & i->first) == keypfx && i->second.scanned_to > ret) {
-			if (i->second.scanned_to > data.scanned_to)
-				data.scanned_to = i->second.scanned_to;
-			if (i->second.scanned_from < data.scanned_from || data.scanned_from == 0)
-				data.scanned_from = i->second.scanned_from;
-		}
-		i++;
-	}
-	ret = data.scanned_from;
-	ret += MK_HI64(data.scanned_to);
+	uint64_t ret;
+
+	pthread_mutex_lock(&hashlog_lock);
+	ret = job_range(job_find(hextouint(jobid)));
+	pthread_mutex_unlock(&hashlog_lock);
 	return ret;
 }
 
@@ -156,75 +416,154 @@ uint64_t hashlog_get_scan_range(char* jobid)
  */
 uint32_t hashlog_get_last_sent(char* jobid)
 {
+	struct hashlog_job *job;
 	uint32_t nonce = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t keypfx = (njobid << 32);
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((keypfx & i->first) == keypfx && i->second.tm_sent > 0) {
-			nonce = LO_DWORD(i->first);
-		}
-		i++;
-	}
+
+	pthread_mutex_lock(&hashlog_lock);
+	job = job_find(hextouint(jobid));
+	if (job)
+		nonce = job->last_sent;
+	pthread_mutex_unlock(&hashlog_lock);
 	return nonce;
 }
 
+static int cmp_history(const void *a, const void *b)
+{
+	const struct hashlog_data *x = (const struct hashlog_data *) a;
+	const struct hashlog_data *y = (const struct hashlog_data *) b;
+	uint64_t kx = MK_HI64(x->njobid) + x->nonce;
+	uint64_t ky = MK_HI64(y->njobid) + y->nonce;
+
+	return (kx < ky) - (kx > ky);
+}
+
 /**
- * Export data for api calls
+ * Export data for api calls, last jobs and nonces first
  */
 int hashlog_get_history(struct hashlog_data *data, int max_records)
 {
+	struct hashlog_data *all;
 	int records = 0;
+	uint32_t i;
+
+	pthread_mutex_lock(&hashlog_lock);
+
+	all = (struct hashlog_data *) calloc(shares_used + jobs_used + 1, sizeof(*all));
+	if (!all) {
+		pthread_mutex_unlock(&hashlog_lock);
+		return 0;
+	}
 
-	std::map<uint64_t, hashlog_data>::reverse_iterator it = tlastshares.rbegin();
-	while (it != tlastshares.rend() && records < max_records) {
-		memcpy(&data[records], &(it->second), sizeof(struct hashlog_data));
-		data[records].nonce = LO_DWORD(it->first);
-		data[records].njobid = (uint32_t) HI_DWORD(it->first);
+	for (i = 0; i < jobs_size; i++) {
+		struct hashlog_job *job = &jobs[i];
+		if (job->state != SLOT_USED || !job->ranged)
+			continue;
+		all[records].njobid = job->njobid;
+		all[records].scanned_from = job->scanned_from;
+		all[records].scanned_to = job->scanned_to;
+		all[records].last_from = job->last_from;
+		all[records].tm_add = job->tm_add;
+		all[records].tm_upd = job->tm_upd;
 		records++;
-		++it;
 	}
+	for (i = 0; i < shares_size; i++) {
+		struct hashlog_share *share = &shares[i];
+		if (share->state != SLOT_USED)
+			continue;
+		all[records].njobid = share->njobid;
+		all[records].nonce = share->nonce;
+		all[records].height = share->height;
+		all[records].scanned_from = share->scanned_from;
+		all[records].scanned_to = share->nonce;
+		all[records].tm_add = all[records].tm_upd = all[records].tm_sent = share->tm_sent;
+		records++;
+	}
+
+	pthread_mutex_unlock(&hashlog_lock);
+
+	qsort(all, records, sizeof(*all), cmp_history);
+	records = min(records, max_records);
+	memcpy(data, all, records * sizeof(*data));
+	free(all);
 	return records;
 }
 
+/* Removes the shares of a job, the ones sent before a time if not 0 */
+static int job_purge(struct hashlog_job *job, uint32_t before)
+{
+	int32_t *link = &job->first;
+	int deleted = 0;
+
+	while (*link >= 0) {
+		struct hashlog_share *share = &shares[*link];
+		if (before && share->tm_sent >= before) {
+			link = &share->next;
+			continue;
+		}
+		*link = share->next;
+		share->state = SLOT_DELETED;
+		shares_used--;
+		shares_deleted++;
+		job->shares--;
+		deleted++;
+	}
+	return deleted;
+}
+
 /**
  * Remove entries of a job...
  */
 void hashlog_purge_job(char* jobid)
 {
+	struct hashlog_job *job;
 	int deleted = 0;
-	uint64_t njobid = hextouint(jobid);
-	uint64_t keypfx = (njobid << 32);
-    uint sz = (uint)tlastshares.size();
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((keypfx & i->first) == keypfx) {
-			deleted++;
-			tlastshares.erase(i++);
-		}
-		else ++i;
+	uint sz;
+
+	pthread_mutex_lock(&hashlog_lock);
+	sz = shares_used;
+	job = job_find(hextouint(jobid));
+	if (job) {
+		deleted = job_purge(job, 0) + (job->ranged ? 1 : 0);
+		job_delete(job);
 	}
+	pthread_mutex_unlock(&hashlog_lock);
+
 	if (opt_debug && deleted) {
 		applog(LOG_DEBUG, "hashlog: purge job %s, del %d/%d", jobid, deleted, sz);
 	}
 }
 
 /**
- * Remove old entries to reduce memory usage
+ * Remove old entries to reduce memory usage,
+ * the scanned ranges of the jobs on each call
  */
 void hashlog_purge_old(void)
 {
 	int deleted = 0;
 	uint32_t now = (uint32_t) time(NULL);
-    uint sz = (uint)tlastshares.size();
-	std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-	while (i != tlastshares.end()) {
-		if ((now - i->second.tm_sent) > LOG_PURGE_TIMEOUT) {
-			deleted++;
-			tlastshares.erase(i++);
+	uint32_t i;
+	uint sz;
+
+	pthread_mutex_lock(&hashlog_lock);
+	sz = shares_used;
+	for (i = 0; i < jobs_size; i++) {
+		struct hashlog_job *job = &jobs[i];
+		int n;
+		if (job->state != SLOT_USED)
+			continue;
+		n = job_purge(job, now - LOG_PURGE_TIMEOUT);
+		if (n)
+			job_sent_range(job);
+		if (job->ranged) {
+			job->ranged = false;
+			n++;
 		}
-		else ++i;
+		if (!job->shares)
+			job_delete(job);
+		deleted += n;
 	}
+	pthread_mutex_unlock(&hashlog_lock);
+
 	if (opt_debug && deleted) {
 		applog(LOG_DEBUG, "hashlog: %d/%d purged", deleted, sz);
 	}
@@ -235,7 +574,14 @@ void hashlog_purge_old(void)
  */
 void hashlog_purge_all(void)
 {
-	tlastshares.clear();
+	pthread_mutex_lock(&hashlog_lock);
+	free(shares);
+	free(jobs);
+	shares = NULL;
+	jobs = NULL;
+	shares_size = shares_used = shares_deleted = 0;
+	jobs_size = jobs_used = jobs_deleted = 0;
+	pthread_mutex_unlock(&hashlog_lock);
 }
 
 /**
@@ -243,8 +589,11 @@ void hashlog_purge_all(void)
  */
 void hashlog_getmeminfo(uint64_t *mem, uint32_t *records)
 {
-    (*records) = (uint)tlastshares.size();
-	(*mem) = (*records) * sizeof(hashlog_data);
+	pthread_mutex_lock(&hashlog_lock);
+	(*records) = shares_used + jobs_used;
+	(*mem) = (uint64_t) shares_size * sizeof(struct hashlog_share) +
+		(uint64_t) jobs_size * sizeof(struct hashlog_job);
+	pthread_mutex_unlock(&hashlog_lock);
 }
 
 /**
@@ -253,19 +602,18 @@ void hashlog_getmeminfo(uint64_t *mem, uint32_t *records)
 void hashlog_dump_job(char* jobid)
 {
 	if (opt_debug) {
-		uint64_t njobid = hextouint(jobid);
-		uint64_t keypfx = (njobid << 32);
-		// uint32_t sz = tlastshares.size();
-		std::map<uint64_t, hashlog_data>::iterator i = tlastshares.begin();
-		while (i != tlastshares.end()) {
-			if ((keypfx & i->first) == keypfx) {
-				if (i->first != keypfx)
-					applog(LOG_DEBUG, CL_YLW "job %s, found %08x ", jobid, LO_DWORD(i->first));
-				else
-					applog(LOG_DEBUG, CL_YLW "job %s(%u) range done: %08x-%08x", jobid,
-						i->second.height, i->second.scanned_from, i->second.scanned_to);
-			}
-			i++;
+		struct hashlog_job *job;
+		int32_t i;
+
+		pthread_mutex_lock(&hashlog_lock);
+		job = job_find(hextouint(jobid));
+		if (job) {
+			for (i = job->first; i >= 0; i = shares[i].next)
+				applog(LOG_DEBUG, CL_YLW "job %s, found %08x ", jobid, shares[i].nonce);
+			if (job->ranged)
+				applog(LOG_DEBUG, CL_YLW "job %s(%u) range done: %08x-%08x", jobid,
+					job->height, job->scanned_from, job->scanned_to);
 		}
+		pthread_mutex_unlock(&hashlog_lock);
 	}
 }
@@ -179,7 +179,11 @@ void gpulog(int prio, int thr_id, const char *fmt, ...) {
 
     if((prio == LOG_DEBUG) && !opt_debug) return;
 
-    len = snprintf(pfmt, 128, "GPU%d t%d: %s", dev_id, thr_id, fmt);
+    if(is_cpu_thread(thr_id))
+      len = snprintf(pfmt, 128, "CPU%d t%d: %s",
+        cpu_thread_index(thr_id), thr_id, fmt);
+    else
+      len = snprintf(pfmt, 128, "GPU%d t%d: %s", dev_id, thr_id, fmt);
 
     pfmt[sizeof(pfmt) - 1] = '\0';
 
@@ -0,0 +1,102 @@
+/**
+ * Metrics of the API /metrics endpoint
+ *
+ * Durations go into histograms of fixed buckets, the same for every
+ * series so that they aggregate across devices and pools.
+ *
+ * A histogram is versioned: its writers hold metrics_lock, or there is
+ * only one (the GPU batch times of a miner thread) and it writes without
+ * a lock; the API copies it without a lock while the version holds
+ */
+#include <string.h>
+#include <pthread.h>
+
+#include "miner.h"
+
+/* upper bounds of the buckets, in seconds */
+const double metrics_bounds[METRICS_BUCKETS] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0
+};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t work_restarts = 0;
+
+#ifdef _MSC_VER
+#define metrics_fence() MemoryBarrier()
+#define metrics_seq_load(p) (*(volatile uint32_t *) (p))
+#define metrics_seq_store(p, v) (*(volatile uint32_t *) (p) = (v))
+#else
+#define metrics_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define metrics_seq_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define metrics_seq_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+static void metrics_hist_add(struct metrics_hist *hist, double seconds)
+{
+	int i;
+
+	for (i = 0; i < METRICS_BUCKETS && seconds > metrics_bounds[i]; i++);
+
+	metrics_seq_store(&hist->seq, hist->seq + 1);
+	metrics_fence();
+	hist->count[i]++;
+	hist->sum += seconds;
+	metrics_seq_store(&hist->seq, hist->seq + 1);
+}
+
+/**
+ * Account a duration
+ * @param hist struct metrics_hist * of the series
+ * @param seconds double measured
+ */
+void metrics_observe(struct metrics_hist *hist, double seconds)
+{
+	pthread_mutex_lock(&metrics_lock);
+	metrics_hist_add(hist, seconds);
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * Account a duration into a histogram only the calling thread writes
+ * @param hist struct metrics_hist * of the series
+ * @param seconds double measured
+ */
+void metrics_observe_own(struct metrics_hist *hist, double seconds)
+{
+	metrics_hist_add(hist, seconds);
+}
+
+/**
+ * Consistent copy of a histogram being updated, retried while written
+ */
+void metrics_hist_get(const struct metrics_hist *hist, struct metrics_hist *copy)
+{
+	uint32_t s;
+
+	while (1) {
+		s = metrics_seq_load(&hist->seq);
+		if (s & 1)
+			continue;
+		memcpy(copy, hist, sizeof(*copy));
+		metrics_fence();
+		if (metrics_seq_load(&hist->seq) == s)
+			break;
+	}
+}
+
+void metrics_work_restart(void)
+{
+	pthread_mutex_lock(&metrics_lock);
+	work_restarts++;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+uint64_t metrics_work_restarts(void)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&metrics_lock);
+	n = work_restarts;
+	pthread_mutex_unlock(&metrics_lock);
+	return n;
+}
@@ -294,13 +294,46 @@ void aligned_free(void *ptr);
 
 #define USER_AGENT PACKAGE_NAME "/" PACKAGE_VERSION
 
+/* sha256.cpp, also used by neoscrypt.c */
+void sha256_init(uint32_t *state);
+void sha256_transform(uint32_t *state, const uint32_t *block, int swap);
+int sha256_midstate(uint32_t *state, const unsigned char *data, int len);
+void sha256d_from(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int off, int len);
+
+/* nonces found per scanhash call at most */
+#define MAX_NONCES 8
+
 extern int scanhash_neoscrypt(int thr_id, uint32_t *pdata,
-  const uint32_t *ptarget, uint32_t max_nonce, uint64_t *hashes_done, uint hash_mode);
+  const uint32_t *ptarget, uint32_t max_nonce, uint64_t *hashes_done,
+  uint32_t *nonces, uint hash_mode);
+extern int scanhash_neoscrypt_cpu(int thr_id, uint32_t *pdata,
+  const uint32_t *ptarget, uint32_t max_nonce, uint64_t *hashes_done,
+  uint32_t *nonces, uint hash_mode);
+extern void neoscrypt_tune_update(int thr_id, double hashrate);
 
 /* api related */
 void *api_thread(void *userdata);
 void api_set_throughput(int thr_id, uint32_t throughput);
 
+/* histogram of durations, see metrics.cpp */
+#define METRICS_BUCKETS 12
+
+struct metrics_hist {
+	/* version, odd while being written */
+	uint32_t seq;
+	/* per bucket, the last one past all the bounds */
+	uint64_t count[METRICS_BUCKETS + 1];
+	double sum;
+};
+
+extern const double metrics_bounds[METRICS_BUCKETS];
+void metrics_observe(struct metrics_hist *hist, double seconds);
+void metrics_observe_own(struct metrics_hist *hist, double seconds);
+void metrics_hist_get(const struct metrics_hist *hist, struct metrics_hist *copy);
+void metrics_work_restart(void);
+uint64_t metrics_work_restarts(void);
+
 struct cgpu_info {
 	uint8_t gpu_id;
 	uint8_t thr_id;
@@ -331,6 +364,10 @@ struct cgpu_info {
 	char gpu_desc[64];
 	float intensity;
 	uint32_t throughput;
+
+	/* time of the GPU batches, written by the thread only,
+	 * see neoscrypt_pipeline_scan */
+	struct metrics_hist batch_time;
 };
 
 struct thr_api {
@@ -346,6 +383,8 @@ struct stats_data {
 	uint32_t height;
 	double difficulty;
 	double hashrate;
+	/* time weighted over the first horizon, as of the scan */
+	double ewma;
 	uint8_t thr_id;
 	uint8_t gpu_id;
 	uint8_t hashfound;
@@ -385,6 +424,7 @@ extern bool opt_protocol;
 extern bool opt_tracegpu;
 extern int opt_n_threads;
 extern int opt_n_gputhreads;
+extern int opt_n_cputhreads;
 extern bool opt_cpumining;
 extern int num_cpus;
 extern int active_gpus;
@@ -405,6 +445,8 @@ extern int api_thr_id;
 extern struct work_restart *work_restart;
 extern bool opt_trust_pool;
 extern uint16_t opt_vote;
+extern bool opt_autotune;
+extern char *opt_tune_file;
 
 extern uint64_t global_hashrate;
 extern double   global_diff;
@@ -417,6 +459,11 @@ extern int device_map[MAX_GPUS];
 extern long  device_sm[MAX_GPUS];
 extern uint32_t gpus_intensity[MAX_GPUS];
 
+/* CPU miner threads follow the GPU ones */
+#define is_cpu_thread(thr_id) ((thr_id) >= opt_n_threads - opt_n_cputhreads)
+/* CPU #n of a CPU thread, in the logs, the API and the metrics */
+#define cpu_thread_index(thr_id) ((thr_id) - (opt_n_threads - opt_n_cputhreads))
+
 extern void format_hashrate(double hashrate, char *output);
 extern void applog(int prio, const char *fmt, ...);
 extern void gpulog(int prio, int thr_id, const char *fmt, ...);
@@ -430,8 +477,10 @@ extern int timeval_subtract(struct timeval *result, struct timeval *x,
 	struct timeval *y);
 extern bool fulltest(const uint32_t *hash, const uint32_t *target);
 extern void diff_to_target(uint32_t *target, double diff);
+extern double target_to_hashes(const uint32_t *target);
 extern void get_currentalgo(char* buf, int sz);
 extern uint32_t device_intensity(int thr_id, const char *func, uint32_t defcount);
+extern void cuda_tune_key(int dev_id, char *key, size_t len);
 
 struct stratum_job {
 	char *job_id;
@@ -439,8 +488,12 @@ struct stratum_job {
 	size_t coinbase_size;
 	unsigned char *coinbase;
 	unsigned char *xnonce2;
+	/* SHA-256 state of the coinbase up to extranonce2 */
+	uint32_t coinbase_midstate[8];
+	size_t coinbase_midlen;
 	int merkle_count;
-	unsigned char **merkle;
+	/* merkle_count branches of 32 bytes */
+	unsigned char *merkle;
 	unsigned char version[4];
 	unsigned char nbits[4];
 	unsigned char ntime[4];
@@ -450,17 +503,71 @@ struct stratum_job {
 	double diff;
 };
 
+/* Ids below are used by subscribe, authorize and extranonce */
+#define STRATUM_SUBMIT_ID 4
+/* Shares waiting for an answer: the table starts with room for
+ * STRATUM_MIN_INFLIGHT and grows up to STRATUM_MAX_INFLIGHT, then the
+ * oldest share is forgotten */
+#define STRATUM_MIN_INFLIGHT 64
+#define STRATUM_MAX_INFLIGHT 4096
+
+/* Share submitted, keyed by the id of its mining.submit */
+struct stratum_share {
+	uint32_t id;
+	uint32_t nonce;
+	struct timeval tv_submit;
+	/* miner thread and hashes the share stands for */
+	int thr_id;
+	double hashes;
+};
+
+/* Line queued for sending by the stratum event loop */
+struct stratum_msg {
+	struct stratum_msg *next;
+	char line[1];
+};
+
+/* Pools given with -o, the first ones are preferred */
+#define MAX_POOLS 8
+
 struct stratum_ctx {
 	char *url;
+	char *user;
+	char *pass;
+	int pooln;
+	int quota;
+	uint32_t accepted;
+	uint32_t rejected;
+	/* rejected as stale, not counted in rejected */
+	uint32_t stale;
+	struct metrics_hist submit_latency;
 
 	CURL *curl;
 	char *curl_url;
 	char curl_err_str[CURL_ERROR_SIZE];
 	curl_socket_t sock;
 	size_t sockbuf_size;
+	size_t sockbuf_rpos;
+	size_t sockbuf_wpos;
+	size_t sockbuf_scan;
 	char *sockbuf;
 	pthread_mutex_t sock_lock;
 
+	/* event loop owning the socket once online, read it with
+	 * stratum_is_online() from other threads; woken up by an eventfd
+	 * under epoll, elsewhere by a socket pair: [0] read, [1] written */
+	bool online;
+	int epfd;
+	int wakefd;
+	curl_socket_t wakesock[2];
+	struct stratum_msg *sendq_head;
+	struct stratum_msg *sendq_tail;
+	struct stratum_msg sendq_stub;
+	size_t sendbuf_size;
+	size_t sendbuf_pos;
+	size_t sendbuf_len;
+	char *sendbuf;
+
 	double next_diff;
 
 	char *session_id;
@@ -470,7 +577,14 @@ struct stratum_ctx {
 	struct stratum_job job;
 	pthread_mutex_t work_lock;
 
-	struct timeval tv_submit;
+	uint32_t submit_id;
+	/* open addressing by id, linear probing, a power of 2 in size */
+	struct stratum_share *inflight;
+	uint32_t inflight_size;
+	uint32_t inflight_count;
+	/* shares forgotten without an answer: table full or disconnected */
+	uint32_t unanswered;
+	pthread_mutex_t share_lock;
 	uint32_t answer_msec;
 	uint32_t disconnects;
 	time_t tm_connected;
@@ -497,16 +611,44 @@ struct work {
 
 	uint32_t scanned_from;
 	uint32_t scanned_to;
+
+	/* stratum pool of the job */
+	int pooln;
+	/* miner thread of a solution */
+	int thr_id;
 };
 
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout);
 bool stratum_send_line(struct stratum_ctx *sctx, char *s);
 char *stratum_recv_line(struct stratum_ctx *sctx);
+bool stratum_online(struct stratum_ctx *sctx);
+#ifdef _MSC_VER
+#define stratum_is_online(sctx) (*(volatile bool *) &(sctx)->online)
+#else
+#define stratum_is_online(sctx) __atomic_load_n(&(sctx)->online, __ATOMIC_ACQUIRE)
+#endif
+char *stratum_next_line(struct stratum_ctx *sctx, int timeout);
 bool stratum_connect(struct stratum_ctx *sctx, const char *url);
 void stratum_disconnect(struct stratum_ctx *sctx);
 bool stratum_subscribe(struct stratum_ctx *sctx);
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass,bool extranonce);
 bool stratum_handle_method(struct stratum_ctx *sctx, const char *s);
+uint32_t stratum_share_sent(struct stratum_ctx *sctx, const struct work *work);
+bool stratum_share_answered(struct stratum_ctx *sctx, uint32_t id, struct stratum_share *share);
+void stratum_shares_forget(struct stratum_ctx *sctx);
+
+enum pool_strategies {
+	POOL_FAILOVER,
+	POOL_ROUNDROBIN,
+	POOL_QUOTA,
+};
+
+extern struct stratum_ctx pools[MAX_POOLS];
+extern int num_pools;
+
+bool pool_add(const char *url, const char *user, const char *pass, int quota);
+bool pool_ready(struct stratum_ctx *pool);
+struct stratum_ctx *pool_choose(struct stratum_ctx *current, int strategy, bool rotate);
 
 void hashlog_remember_submit(struct work* work, uint32_t nonce);
 void hashlog_remember_scan_range(struct work* work);
@@ -520,12 +662,96 @@ void hashlog_purge_all(void);
 void hashlog_dump_job(char* jobid);
 void hashlog_getmeminfo(uint64_t *mem, uint32_t *records);
 
+/* horizons of the time weighted averages: 1, 5 and 15 minutes */
+#define STATS_HORIZONS 3
+extern const int stats_horizons[STATS_HORIZONS];
+
+struct stats_estimate {
+	/* hashes per second, time weighted */
+	double ewma[STATS_HORIZONS];
+	/* hashes per second, from the accepted shares */
+	double effective[STATS_HORIZONS];
+	/* seconds of the GPU batches, 0 without */
+	double batch_p50;
+	double batch_p95;
+};
+
+bool stats_init(int threads);
 void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate, uint8_t found, uint32_t height);
 double stats_get_speed(int thr_id, double def_speed);
 int  stats_get_history(int thr_id, struct stats_data *data, int max_records);
-void stats_purge_old(void);
+void stats_remember_batch(int thr_id, double seconds);
+void stats_remember_share(int thr_id, double hashes);
+bool stats_get_estimate(int thr_id, struct stats_estimate *est);
 void stats_purge_all(void);
 void stats_getmeminfo(uint64_t *mem, uint32_t *records);
+double stats_load_double(uint64_t *p);
+void stats_store_double(uint64_t *p, double v);
+
+typedef bool (*verify_submit_fn)(struct thr_info *thr, const struct work *work);
+bool verify_init(int workers, verify_submit_fn submit);
+void verify_push(struct thr_info *thr, const struct work *work);
+
+/* extranonce2 values a published work covers at most */
+#define WORK_SCHED_ROLLS 256
+/* slice sizes are rounded to it */
+#define WORK_SCHED_GRAIN 0x10000
+
+/* work space cursor: epoch 16 | extranonce2 roll 16 | nonce 32 bits */
+struct work_sched {
+	uint64_t cursor;
+	uint32_t rolls;
+};
+
+/* nonces first to last of an extranonce2 roll */
+struct work_slice {
+	uint32_t epoch;
+	uint32_t roll;
+	uint32_t first;
+	uint32_t last;
+};
+
+void work_sched_reset(struct work_sched *ws, uint32_t epoch, uint32_t rolls);
+int  work_sched_claim(struct work_sched *ws, uint64_t size, struct work_slice *slices);
+uint64_t work_sched_size(double hashrate, double seconds, uint64_t minimum);
+int  work_sched_cmp_epoch(uint32_t a, uint32_t b);
+
+/* settings tried by the autotuner, 5 batch sizes of 3 modes */
+#define TUNE_MAX_CANDIDATES 15
+/* seconds between updates of the tuning cache from the measured speed */
+#define TUNE_UPDATE_INTERVAL 300
+
+struct tune_candidate {
+	uint32_t throughput;
+	uint mode;
+	double hashrate;
+	double batch_time;
+};
+
+struct tune_state {
+	struct tune_candidate cand[TUNE_MAX_CANDIDATES];
+	int count;
+	int cur;
+	int best;
+	/* measure of the current candidate */
+	bool warm;
+	uint64_t hashes;
+	uint32_t batches;
+	double seconds;
+};
+
+void tune_init(struct tune_state *ts, uint32_t unit, uint32_t max_throughput,
+	uint32_t throughput, uint mode);
+const struct tune_candidate *tune_current(const struct tune_state *ts);
+bool tune_report(struct tune_state *ts, uint64_t hashes, uint32_t batches, double seconds);
+bool tune_step(struct tune_state **tsp, uint64_t hashes, uint32_t batches, double seconds,
+	struct tune_candidate *next);
+bool tune_cache_get(const char *key, uint32_t *throughput, uint *mode);
+void tune_cache_put(const char *key, uint32_t throughput, uint mode, double hashrate);
+void tune_cache_update(const char *key, uint32_t throughput, uint mode, double hashrate);
+
+/* messages a thread queue holds at most */
+#define TQ_DEPTH 64
 
 struct thread_q;
 
@@ -31,9 +31,56 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #include "neoscrypt.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+
+#define NEOSCRYPT_X86
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#if defined(__GNUC__) && !defined(__clang__) && \
+  ((__GNUC__ < 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ < 9)))
+/* Older GCC cannot use intrinsics through the target attribute */
+#define NEOSCRYPT_NO_SSE41
+#define NEOSCRYPT_NO_AVX2
+#define NEOSCRYPT_NO_AVX512
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ < 5)
+#define NEOSCRYPT_NO_AVX512
+#endif
+
+#if defined(_MSC_VER) && (_MSC_VER < 1800)
+#define NEOSCRYPT_NO_AVX2
+#endif
+
+#if defined(_MSC_VER) && (_MSC_VER < 1910)
+#define NEOSCRYPT_NO_AVX512
+#endif
+
+#endif /* x86 */
+
+/* Forced inlining lets constant arguments specialise the code */
+#if defined(_MSC_VER)
+#define NEOSCRYPT_INLINE static __forceinline
+#elif defined(__GNUC__)
+#define NEOSCRYPT_INLINE static __inline __attribute__((always_inline))
+#else
+#define NEOSCRYPT_INLINE static __inline
+#endif
+
 
 /* Salsa20, rounds must be a multiple of 2 */
 static void neoscrypt_salsa(uint *X, uint rounds) {
@@ -214,6 +261,139 @@ void neoscrypt_xor(void *dstp, const void *srcp, uint len) {
 }
 
 
+/* SHA-256 of sha256.cpp */
+
+extern void sha256_init(uint *state);
+extern void sha256_transform(uint *state, const uint *block, int swap);
+
+typedef struct neoscrypt_sha256_state_t {
+    uint   h[8];
+    uint   buf[16];
+    uint   buflen;
+    ullong total;
+} neoscrypt_sha256_state;
+
+static void neoscrypt_sha256_init(neoscrypt_sha256_state *S) {
+
+    sha256_init(S->h);
+    S->buflen = 0;
+    S->total = 0;
+}
+
+static void neoscrypt_sha256_update(neoscrypt_sha256_state *S,
+  const uchar *input, uint input_size) {
+    uint todo;
+
+    S->total += input_size;
+
+    while(input_size) {
+        todo = MIN(BLOCK_SIZE - S->buflen, input_size);
+        neoscrypt_copy((uchar *) S->buf + S->buflen, input, todo);
+        S->buflen += todo;
+        input += todo;
+        input_size -= todo;
+        if(S->buflen == BLOCK_SIZE) {
+            /* The message words are big endian */
+            sha256_transform(S->h, S->buf, 1);
+            S->buflen = 0;
+        }
+    }
+}
+
+static void neoscrypt_sha256_final(neoscrypt_sha256_state *S, uchar *output) {
+    uchar *buf = (uchar *) S->buf;
+    ullong bits = S->total << 3;
+    uint i;
+
+    buf[S->buflen++] = 0x80;
+    if(S->buflen > BLOCK_SIZE - 8) {
+        neoscrypt_erase(buf + S->buflen, BLOCK_SIZE - S->buflen);
+        sha256_transform(S->h, S->buf, 1);
+        S->buflen = 0;
+    }
+    neoscrypt_erase(buf + S->buflen, BLOCK_SIZE - 8 - S->buflen);
+    U64TO8_BE(&buf[BLOCK_SIZE - 8], bits);
+    sha256_transform(S->h, S->buf, 1);
+
+    for(i = 0; i < 8; i++) {
+        U32TO8_BE(&output[i * 4], S->h[i]);
+    }
+}
+
+/* HMAC-SHA256 with the inner and outer states keyed in advance */
+static void neoscrypt_hmac_sha256_key(neoscrypt_sha256_state *inner,
+  neoscrypt_sha256_state *outer, const uchar *key, uint key_size) {
+    uchar pad[BLOCK_SIZE];
+    hash_digest key_h;
+    uint i;
+
+    /* Keys longer than a block are hashed */
+    if(key_size > BLOCK_SIZE) {
+        neoscrypt_sha256_init(inner);
+        neoscrypt_sha256_update(inner, key, key_size);
+        neoscrypt_sha256_final(inner, key_h);
+        key = key_h;
+        key_size = DIGEST_SIZE;
+    }
+
+    neoscrypt_erase(pad, BLOCK_SIZE);
+    neoscrypt_copy(pad, key, key_size);
+    for(i = 0; i < BLOCK_SIZE; i++)
+      pad[i] ^= 0x36;
+    neoscrypt_sha256_init(inner);
+    neoscrypt_sha256_update(inner, pad, BLOCK_SIZE);
+
+    for(i = 0; i < BLOCK_SIZE; i++)
+      pad[i] ^= (0x36 ^ 0x5C);
+    neoscrypt_sha256_init(outer);
+    neoscrypt_sha256_update(outer, pad, BLOCK_SIZE);
+}
+
+/* PBKDF2-HMAC-SHA256 of output_len bytes */
+static void neoscrypt_pbkdf2_sha256(const uchar *password, uint password_len,
+  const uchar *salt, uint salt_len, uint num_iter, uchar *output,
+  uint output_len) {
+    neoscrypt_sha256_state inner, outer, S;
+    hash_digest U, T;
+    uchar ctr[4];
+    uint i, j, k, todo;
+
+    neoscrypt_hmac_sha256_key(&inner, &outer, password, password_len);
+
+    for(i = 1; output_len; i++) {
+
+        U32TO8_BE(ctr, i);
+
+        /* U1 = HMAC(password, salt || i) */
+        S = inner;
+        neoscrypt_sha256_update(&S, salt, salt_len);
+        neoscrypt_sha256_update(&S, ctr, 4);
+        neoscrypt_sha256_final(&S, U);
+        S = outer;
+        neoscrypt_sha256_update(&S, U, DIGEST_SIZE);
+        neoscrypt_sha256_final(&S, U);
+        neoscrypt_copy(T, U, DIGEST_SIZE);
+
+        /* Un = HMAC(password, Un-1) */
+        for(j = 1; j < num_iter; j++) {
+            S = inner;
+            neoscrypt_sha256_update(&S, U, DIGEST_SIZE);
+            neoscrypt_sha256_final(&S, U);
+            S = outer;
+            neoscrypt_sha256_update(&S, U, DIGEST_SIZE);
+            neoscrypt_sha256_final(&S, U);
+            for(k = 0; k < DIGEST_SIZE; k++)
+              T[k] ^= U[k];
+        }
+
+        todo = MIN(DIGEST_SIZE, output_len);
+        neoscrypt_copy(output, T, todo);
+        output += todo;
+        output_len -= todo;
+    }
+}
+
+
 /* BLAKE2s */
 
 /* Parameter block of 32 bytes */
@@ -248,7 +428,7 @@ static const uint blake2s_IV[8] = {
 
 
 /* Buffer mixer (compressor) */
-static void blake2s_compress(blake2s_state *S) {
+static void blake2s_compress_scalar(blake2s_state *S) {
     uint *v = (uint *) S->tempbuf;
     uint *m = (uint *) S->buf;
     register uint t0, t1, t2, t3;
@@ -1650,6 +1830,104 @@ static void blake2s_compress(blake2s_state *S) {
     S->h[7] ^= v[7] ^ v[15];
 }
 
+#if defined(NEOSCRYPT_X86)
+
+/* Message schedule */
+static const uchar blake2s_sigma[10][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+#if !defined(NEOSCRYPT_NO_SSE41)
+
+#if defined(__GNUC__)
+#define NS_SSE41 __attribute__((target("sse4.1")))
+#else
+#define NS_SSE41
+#endif
+
+/* Row-parallel buffer mixer (compressor), SSE4.1;
+ * rotations by 16 and 8 are byte shuffles */
+static NS_SSE41 void blake2s_compress_sse41(blake2s_state *S) {
+    const uint *m = (const uint *) S->buf;
+    const uchar *s;
+    __m128i row1, row2, row3, row4, h1, h2, b, r16, r8;
+    uint i;
+
+    r16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    r8  = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+
+    row1 = h1 = _mm_loadu_si128((const __m128i *) &S->h[0]);
+    row2 = h2 = _mm_loadu_si128((const __m128i *) &S->h[4]);
+    row3 = _mm_loadu_si128((const __m128i *) &blake2s_IV[0]);
+    /* t[0], t[1], f[0] and f[1] are adjacent */
+    row4 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &blake2s_IV[4]),
+      _mm_loadu_si128((const __m128i *) &S->t[0]));
+
+#define G1(b) \
+    row1 = _mm_add_epi32(_mm_add_epi32(row1, b), row2); \
+    row4 = _mm_shuffle_epi8(_mm_xor_si128(row4, row1), r16); \
+    row3 = _mm_add_epi32(row3, row4); \
+    row2 = _mm_xor_si128(row2, row3); \
+    row2 = _mm_or_si128(_mm_srli_epi32(row2, 12), _mm_slli_epi32(row2, 20));
+
+#define G2(b) \
+    row1 = _mm_add_epi32(_mm_add_epi32(row1, b), row2); \
+    row4 = _mm_shuffle_epi8(_mm_xor_si128(row4, row1), r8); \
+    row3 = _mm_add_epi32(row3, row4); \
+    row2 = _mm_xor_si128(row2, row3); \
+    row2 = _mm_or_si128(_mm_srli_epi32(row2, 7), _mm_slli_epi32(row2, 25));
+
+    for(i = 0; i < 10; i++) {
+        s = blake2s_sigma[i];
+
+        /* Columns */
+        b = _mm_set_epi32(m[s[6]], m[s[4]], m[s[2]], m[s[0]]);
+        G1(b);
+        b = _mm_set_epi32(m[s[7]], m[s[5]], m[s[3]], m[s[1]]);
+        G2(b);
+
+        /* Diagonalise */
+        row2 = _mm_shuffle_epi32(row2, _MM_SHUFFLE(0, 3, 2, 1));
+        row3 = _mm_shuffle_epi32(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm_shuffle_epi32(row4, _MM_SHUFFLE(2, 1, 0, 3));
+
+        /* Diagonals */
+        b = _mm_set_epi32(m[s[14]], m[s[12]], m[s[10]], m[s[8]]);
+        G1(b);
+        b = _mm_set_epi32(m[s[15]], m[s[13]], m[s[11]], m[s[9]]);
+        G2(b);
+
+        /* Undiagonalise */
+        row2 = _mm_shuffle_epi32(row2, _MM_SHUFFLE(2, 1, 0, 3));
+        row3 = _mm_shuffle_epi32(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm_shuffle_epi32(row4, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+#undef G1
+#undef G2
+
+    _mm_storeu_si128((__m128i *) &S->h[0],
+      _mm_xor_si128(h1, _mm_xor_si128(row1, row3)));
+    _mm_storeu_si128((__m128i *) &S->h[4],
+      _mm_xor_si128(h2, _mm_xor_si128(row2, row4)));
+}
+
+#endif /* !NEOSCRYPT_NO_SSE41 */
+
+#endif /* NEOSCRYPT_X86 */
+
+/* Buffer mixer selected at run time, see neoscrypt_lanes() */
+static void (*blake2s_compress)(blake2s_state *S) = blake2s_compress_scalar;
+
 static void blake2s_update(blake2s_state *S, const uchar *input,
   uint input_size) {
     uint left, fill;
@@ -1727,23 +2005,9 @@ static const uint blake2s_IV_P_XOR[8] = {
     0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
 };
 
-/* Performance optimised FastKDF with BLAKE2s integrated */
-void neoscrypt_fastkdf_opt(const uchar *password, const uchar *salt,
-  uchar *output, uint mode) {
-    const size_t stack_align = 0x40;
-    uint bufptr, output_len, i, j;
-    uchar *A, *B;
-    uint *S;
-
-    /* Align and set up the buffers in stack */
-#ifdef _MSC_VER
-    uchar *stack = (uchar *) malloc(864 + stack_align);
-#else
-    uchar stack[864 + stack_align];
-#endif
-    A = (uchar *) (((size_t)stack & ~(stack_align - 1)) + stack_align);
-    B = &A[320];
-    S = (uint *) &A[608];
+/* FastKDF buffer setup, salt = password for mode 0 */
+static void neoscrypt_fastkdf_setup(uchar *A, uchar *B, const uchar *password,
+  const uchar *salt, uint mode) {
 
     neoscrypt_copy(&A[0],   &password[0], 80);
     neoscrypt_copy(&A[80],  &password[0], 80);
@@ -1752,31 +2016,83 @@ void neoscrypt_fastkdf_opt(const uchar *password, const uchar *salt,
     neoscrypt_copy(&A[256], &password[0], 64);
 
     if(!mode) {
-        output_len = 256;
         neoscrypt_copy(&B[0],   &salt[0], 80);
         neoscrypt_copy(&B[80],  &salt[0], 80);
         neoscrypt_copy(&B[160], &salt[0], 80);
         neoscrypt_copy(&B[240], &salt[0], 16);
         neoscrypt_copy(&B[256], &salt[0], 32);
     } else {
-        output_len = 32;
         neoscrypt_copy(&B[0],   &salt[0], 256);
         neoscrypt_copy(&B[256], &salt[0], 32);
     }
+}
 
-    for(i = 0, bufptr = 0; i < 32; i++) {
+/* FastKDF buffer update with the BLAKE2s digest S;
+ * returns the new buffer pointer */
+static uint neoscrypt_fastkdf_step(uchar *B, const uint *S) {
+    uint bufptr, j;
 
-        /* BLAKE2s: initialise */
-        neoscrypt_copy(&S[0], blake2s_IV_P_XOR, 32);
-        neoscrypt_erase(&S[8], 16);
+    for(j = 0, bufptr = 0; j < 8; j++) {
+      bufptr += S[j];
+      bufptr += (S[j] >> 8);
+      bufptr += (S[j] >> 16);
+      bufptr += (S[j] >> 24);
+    }
+    bufptr &= 0xFF;
 
-        /* BLAKE2s: update key */
-        neoscrypt_copy(&S[12], &B[bufptr], 32);
-        neoscrypt_erase(&S[20], 32);
+    neoscrypt_xor(&B[bufptr], &S[0], 32);
 
-        /* BLAKE2s: compress IV using key */
-        S[8] = 64;
-        blake2s_compress((blake2s_state *) S);
+    if(bufptr < 32)
+      neoscrypt_copy(&B[256 + bufptr], &B[bufptr], 32 - bufptr);
+    else if(bufptr > 224)
+      neoscrypt_copy(&B[0], &B[256], bufptr - 224);
+
+    return(bufptr);
+}
+
+/* FastKDF output of output_len bytes */
+static void neoscrypt_fastkdf_tail(const uchar *A, uchar *B, uint bufptr,
+  uchar *output, uint output_len) {
+    uint i;
+
+    i = 256 - bufptr;
+    if(i >= output_len) {
+        neoscrypt_xor(&B[bufptr], &A[0], output_len);
+        neoscrypt_copy(&output[0], &B[bufptr], output_len);
+    } else {
+        neoscrypt_xor(&B[bufptr], &A[0], i);
+        neoscrypt_xor(&B[0], &A[i], output_len - i);
+        neoscrypt_copy(&output[0], &B[bufptr], i);
+        neoscrypt_copy(&output[i], &B[0], output_len - i);
+    }
+}
+
+/* FastKDF iterations from i to 31 with the buffers set up already;
+ * key_h is the state after the key compression of iteration i if known */
+static void neoscrypt_fastkdf_core(const uchar *A, uchar *B, uint *S,
+  uint bufptr, uint i, const uint *key_h, uchar *output, uint output_len) {
+
+    for(; i < 32; i++) {
+
+        if(key_h) {
+            /* BLAKE2s: key compression done in advance */
+            neoscrypt_copy(&S[0], key_h, 32);
+            neoscrypt_erase(&S[8], 16);
+            S[8] = 64;
+            key_h = NULL;
+        } else {
+            /* BLAKE2s: initialise */
+            neoscrypt_copy(&S[0], blake2s_IV_P_XOR, 32);
+            neoscrypt_erase(&S[8], 16);
+
+            /* BLAKE2s: update key */
+            neoscrypt_copy(&S[12], &B[bufptr], 32);
+            neoscrypt_erase(&S[20], 32);
+
+            /* BLAKE2s: compress IV using key */
+            S[8] = 64;
+            blake2s_compress((blake2s_state *) S);
+        }
 
         /* BLAKE2s: update input */
         neoscrypt_copy(&S[12], &A[bufptr], 64);
@@ -1786,42 +2102,172 @@ void neoscrypt_fastkdf_opt(const uchar *password, const uchar *salt,
         S[10] = ~0U;
         blake2s_compress((blake2s_state *) S);
 
-        for(j = 0, bufptr = 0; j < 8; j++) {
-          bufptr += S[j];
-          bufptr += (S[j] >> 8);
-          bufptr += (S[j] >> 16);
-          bufptr += (S[j] >> 24);
+        bufptr = neoscrypt_fastkdf_step(B, S);
+
+    }
+
+    neoscrypt_fastkdf_tail(A, B, bufptr, output, output_len);
+}
+
+/* Performance optimised FastKDF with BLAKE2s integrated */
+void neoscrypt_fastkdf_opt(const uchar *password, const uchar *salt,
+  uchar *output, uint mode) {
+    uint A[80], B[72], S[64];
+    uint output_len;
+
+    neoscrypt_fastkdf_setup((uchar *) A, (uchar *) B, password, salt, mode);
+    output_len = mode ? 32 : 256;
+
+    neoscrypt_fastkdf_core((uchar *) A, (uchar *) B, S, 0, 0, NULL,
+      output, output_len);
+}
+
+/* Fills len bytes of dst with the src data repeated */
+static void neoscrypt_fastkdf_fill(uchar *dst, uint len, const uchar *src,
+  uint src_len) {
+    uint todo;
+
+    while(len) {
+        todo = MIN(src_len, len);
+        neoscrypt_copy(dst, src, todo);
+        dst += todo;
+        len -= todo;
+    }
+}
+
+/* FastKDF with the password and salt of any length;
+ * output_len must not exceed 256 bytes */
+static void neoscrypt_fastkdf_gen(const uchar *password, uint password_len,
+  const uchar *salt, uint salt_len, uchar *output, uint output_len) {
+    uint A[80], B[72], S[64];
+
+    /* The buffers are extended with copies of their heads */
+    neoscrypt_fastkdf_fill((uchar *) A, 256, password, password_len);
+    neoscrypt_copy(&A[64], &A[0], 64);
+    neoscrypt_fastkdf_fill((uchar *) B, 256, salt, salt_len);
+    neoscrypt_copy(&B[64], &B[0], 32);
+
+    neoscrypt_fastkdf_core((uchar *) A, (uchar *) B, S, 0, 0, NULL,
+      output, output_len);
+}
+
+
+/* FastKDF midstate of a block header;
+ * the nonce is the 32-bit word 19 of the header and appears in words
+ * 19, 39 and 59 of both FastKDF buffers, every other byte of them
+ * depends on the job only */
+
+/* Returns 1 if len bytes of the buffer at offset ptr include the nonce */
+static uint neoscrypt_kdf_hits_nonce(uint ptr, uint len) {
+    return(((ptr < 80) && (ptr + len > 76)) ||
+      ((ptr < 160) && (ptr + len > 156)) ||
+      ((ptr < 240) && (ptr + len > 236)));
+}
+
+/* Prepares a FastKDF context of the header;
+ * the buffers are kept with the nonce cleared and the leading iterations
+ * which never read the nonce are run in advance; the nonce bytes of B are
+ * only ever XOR'ed into, so they may be patched in later */
+void neoscrypt_kdf_prehash(neoscrypt_kdf_ctx *ctx, const uchar *password) {
+    uint S[64];
+    uchar *A = (uchar *) ctx->A;
+    uchar *B = (uchar *) ctx->B;
+    uint bufptr, i;
+
+    neoscrypt_copy(&A[0],   &password[0], 80);
+    ctx->A[19] = 0;
+    neoscrypt_copy(&A[80],  &A[0], 80);
+    neoscrypt_copy(&A[160], &A[0], 80);
+    neoscrypt_copy(&A[240], &A[0], 16);
+    neoscrypt_copy(&A[256], &A[0], 64);
+
+    neoscrypt_copy(&B[0],   &A[0], 256);
+    neoscrypt_copy(&B[256], &A[0], 32);
+
+    ctx->key_ready = 0;
+
+    for(i = 0, bufptr = 0; i < 32; i++) {
+
+        if(neoscrypt_kdf_hits_nonce(bufptr, 32))
+          break;
+
+        /* BLAKE2s: initialise, update key and compress */
+        neoscrypt_copy(&S[0], blake2s_IV_P_XOR, 32);
+        neoscrypt_erase(&S[8], 16);
+        neoscrypt_copy(&S[12], &B[bufptr], 32);
+        neoscrypt_erase(&S[20], 32);
+        S[8] = 64;
+        blake2s_compress((blake2s_state *) S);
+
+        if(neoscrypt_kdf_hits_nonce(bufptr, 64)) {
+            /* The input depends on the nonce, keep the key state only */
+            neoscrypt_copy(ctx->key_h, &S[0], 32);
+            ctx->key_ready = 1;
+            break;
         }
-        bufptr &= 0xFF;
 
-        neoscrypt_xor(&B[bufptr], &S[0], 32);
+        /* BLAKE2s: update input and compress */
+        neoscrypt_copy(&S[12], &A[bufptr], 64);
+        S[8] = 128;
+        S[10] = ~0U;
+        blake2s_compress((blake2s_state *) S);
 
-        if(bufptr < 32)
-          neoscrypt_copy(&B[256 + bufptr], &B[bufptr], 32 - bufptr);
-        else if(bufptr > 224)
-          neoscrypt_copy(&B[0], &B[256], bufptr - 224);
+        bufptr = neoscrypt_fastkdf_step(B, S);
 
     }
 
-    i = 256 - bufptr;
-    if(i >= output_len) {
-        neoscrypt_xor(&B[bufptr], &A[0], output_len);
-        neoscrypt_copy(&output[0], &B[bufptr], output_len);
+    ctx->bufptr = bufptr;
+    ctx->iter   = i;
+}
+
+/* FastKDF buffer setup of the header with the nonce given;
+ * B is restored from ctx if salt is NULL, set up from the 256-byte salt
+ * otherwise */
+static void neoscrypt_kdf_setup(const neoscrypt_kdf_ctx *ctx, uint nonce,
+  uint *A, uint *B, const uchar *salt) {
+
+    neoscrypt_copy(A, ctx->A, 320);
+    A[19] = nonce;
+    A[39] = nonce;
+    A[59] = nonce;
+
+    if(!salt) {
+        neoscrypt_copy(B, ctx->B, 288);
+        B[19] ^= nonce;
+        B[39] ^= nonce;
+        B[59] ^= nonce;
     } else {
-        neoscrypt_xor(&B[bufptr], &A[0], i);
-        neoscrypt_xor(&B[0], &A[i], output_len - i);
-        neoscrypt_copy(&output[0], &B[bufptr], i);
-        neoscrypt_copy(&output[i], &B[0], output_len - i);
+        neoscrypt_copy(&B[0],  &salt[0], 256);
+        neoscrypt_copy(&B[64], &salt[0], 32);
     }
+}
 
-#ifdef _MSC_VER
-    free(stack);
-#endif
+/* FastKDF of the header with the nonce given, salt = password;
+ * output is 256 bytes */
+static void neoscrypt_kdf_first(const neoscrypt_kdf_ctx *ctx, uint nonce,
+  uchar *output) {
+    uint A[80], B[72], S[64];
+
+    neoscrypt_kdf_setup(ctx, nonce, A, B, NULL);
+
+    neoscrypt_fastkdf_core((uchar *) A, (uchar *) B, S, ctx->bufptr, ctx->iter,
+      ctx->key_ready ? ctx->key_h : NULL, output, 256);
+}
+
+/* FastKDF of the header with the nonce given and a 256-byte salt;
+ * output is 32 bytes */
+static void neoscrypt_kdf_last(const neoscrypt_kdf_ctx *ctx, uint nonce,
+  const uchar *salt, uchar *output) {
+    uint A[80], B[72], S[64];
+
+    neoscrypt_kdf_setup(ctx, nonce, A, B, salt);
+
+    neoscrypt_fastkdf_core((uchar *) A, (uchar *) B, S, 0, 0, NULL, output, 32);
 }
 
 
 /* Configurable optimised block mixer */
-static void neoscrypt_blkmix(uint *X, uint *Y, uint r, uint mixmode) {
+NEOSCRYPT_INLINE void neoscrypt_blkmix(uint *X, uint *Y, uint r, uint mixmode) {
     uint i, mixer, rounds;
 
     mixer  = mixmode >> 8;
@@ -1892,50 +2338,13 @@ static void neoscrypt_blkmix(uint *X, uint *Y, uint r, uint mixmode) {
 }
 
 
-/* NeoScrypt core engine:
- * p = 1, salt = password;
- * Basic customisation (required):
- *   profile bit 0:
- *     0 = NeoScrypt(128, 2, 1) with Salsa20/20 and ChaCha20/20;
- *     1 = Scrypt(1024, 1, 1) with Salsa20/8;
- *   profile bits 4 to 1:
- *     0000 = FastKDF-BLAKE2s;
- *     0001 = PBKDF2-HMAC-SHA256;
- *     0010 = PBKDF2-HMAC-BLAKE256;
- * Extended customisation (optional):
- *   profile bit 31:
- *     0 = extended customisation absent;
- *     1 = extended customisation present;
- *   profile bits 7 to 5 (rfactor):
- *     000 = r of 1;
- *     001 = r of 2;
- *     010 = r of 4;
- *     ...
- *     111 = r of 128;
- *   profile bits 12 to 8 (Nfactor):
- *     00000 = N of 2;
- *     00001 = N of 4;
- *     00010 = N of 8;
- *     .....
- *     00110 = N of 128;
- *     .....
- *     01001 = N of 1024;
- *     .....
- *     11110 = N of 2147483648;
- *   profile bits 30 to 13 are reserved */
-void neoscrypt(const uchar *password, uchar *output) {
-    const size_t stack_align = 0x40;
-    uint N = 128, r = 2, dblmix = 1, mixmode = 0x14;
+/* Configurable SMix of X, ChaCha and Salsa if dblmix, Salsa only otherwise;
+ * X is followed by (N + 2) * r * 2 * BLOCK_SIZE bytes of Z, Y and V */
+NEOSCRYPT_INLINE void neoscrypt_smix(uint *X, uint N, uint r, uint dblmix,
+  uint mixmode) {
     uint i, j;
-    uint *X, *Y, *Z, *V;
-    
-#ifdef _MSC_VER
-    uchar *stack = (uchar *) malloc((N + 3) * r * 2 * BLOCK_SIZE + stack_align);
-#else
-    uchar stack[(N + 3) * r * 2 * BLOCK_SIZE + stack_align];
-#endif
-    /* X = r * 2 * BLOCK_SIZE */
-    X = (uint *) (((size_t)stack & ~(stack_align - 1)) + stack_align);
+    uint *Y, *Z, *V;
+
     /* Z is a copy of X for ChaCha */
     Z = &X[32 * r];
     /* Y is an X sized temporal space */
@@ -1943,9 +2352,6 @@ void neoscrypt(const uchar *password, uchar *output) {
     /* V = N * r * 2 * BLOCK_SIZE */
     V = &X[96 * r];
 
-    /* X = KDF(password, salt) */
-    neoscrypt_fastkdf_opt(password, password, (uchar *) X, 0);
-
     /* Process ChaCha 1st, Salsa 2nd and XOR them into FastKDF; otherwise Salsa only */
 
     if(dblmix) {
@@ -1989,11 +2395,733 @@ void neoscrypt(const uchar *password, uchar *output) {
     if(dblmix)
       /* blkxor(X, Z) */
       neoscrypt_blkxor(&X[0], &Z[0], r * 2 * BLOCK_SIZE);
+}
+
+
+/* NeoScrypt(128, 2, 1) mixing with ChaCha20/20 and Salsa20/20 */
+static void neoscrypt_mix(uint *X) {
+
+    neoscrypt_smix(X, 128, 2, 1, 0x14);
+}
+
+/* Scrypt(1024, 1, 1) mixing with Salsa20/8 */
+static void neoscrypt_mix_scrypt(uint *X) {
+
+    neoscrypt_smix(X, 1024, 1, 0, 0x08);
+}
+
+/* Mixing with any other parameters */
+static void neoscrypt_mix_generic(uint *X, uint N, uint r, uint dblmix,
+  uint mixmode) {
+
+    neoscrypt_smix(X, N, r, dblmix, mixmode);
+}
+
+
+/* Scratchpad arena;
+ * 64-byte aligned memory of a thread reused across calls, taken from
+ * the page allocator of the OS and grown on demand, shrunk back to
+ * the NeoScrypt(128, 2, 1) size after a larger neoscrypt_profile() */
+
+struct neoscrypt_ctx_t {
+    uchar *base;
+    size_t size;
+    uint   flags;
+};
+
+/* Granularity of the arena size */
+#define NEOSCRYPT_ARENA_UNIT 0x10000
+#define NEOSCRYPT_HUGE_PAGE  0x200000
+
+/* NeoScrypt(128, 2, 1) scratch: X, Z, Y and V */
+#define NEOSCRYPT_SCRATCH ((128 + 3) * 2 * 2 * BLOCK_SIZE)
+
+#if !defined(_WIN32) && !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static void neoscrypt_arena_release(neoscrypt_ctx *ctx) {
+
+    if(!ctx->base)
+      return;
+
+#if defined(_WIN32)
+    VirtualFree(ctx->base, 0, MEM_RELEASE);
+#else
+    munmap(ctx->base, ctx->size);
+#endif
+
+    ctx->base = NULL;
+    ctx->size = 0;
+}
+
+/* Huge pages are tried first if requested, regular pages otherwise;
+ * Windows grants large pages only with SeLockMemoryPrivilege held */
+static uint neoscrypt_arena_alloc(neoscrypt_ctx *ctx, size_t size) {
+    size_t huge_size;
+    void *base = NULL;
+
+    size = (size + NEOSCRYPT_ARENA_UNIT - 1) & ~((size_t)NEOSCRYPT_ARENA_UNIT - 1);
+
+#if defined(_WIN32)
+    if(ctx->flags & NEOSCRYPT_CTX_HUGEPAGES) {
+        huge_size = GetLargePageMinimum();
+        if(huge_size) {
+            huge_size = (size + huge_size - 1) & ~(huge_size - 1);
+            base = VirtualAlloc(NULL, huge_size,
+              MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if(base)
+              size = huge_size;
+        }
+    }
+    if(!base)
+      base = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    if(ctx->flags & NEOSCRYPT_CTX_HUGEPAGES) {
+        huge_size = (size + NEOSCRYPT_HUGE_PAGE - 1) &
+          ~((size_t)NEOSCRYPT_HUGE_PAGE - 1);
+#if defined(MAP_HUGETLB)
+        base = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base == MAP_FAILED)
+          base = NULL;
+#endif
+        /* Transparent huge pages otherwise */
+        if(!base) {
+            base = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(base == MAP_FAILED)
+              base = NULL;
+#if defined(MADV_HUGEPAGE)
+            if(base)
+              madvise(base, huge_size, MADV_HUGEPAGE);
+#endif
+        }
+        if(base)
+          size = huge_size;
+    }
+    if(!base) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED)
+          base = NULL;
+    }
+#endif
+
+    if(!base)
+      return(0);
+
+    ctx->base = (uchar *) base;
+    ctx->size = size;
+
+    return(1);
+}
+
+/* Returns at least size bytes of the arena or NULL if out of memory;
+ * the contents are not preserved when the arena grows */
+static uchar *neoscrypt_ctx_reserve(neoscrypt_ctx *ctx, size_t size) {
+
+    if(size > ctx->size) {
+        neoscrypt_arena_release(ctx);
+        if(!neoscrypt_arena_alloc(ctx, size))
+          return(NULL);
+    }
+
+    return(ctx->base);
+}
+
+/* Gives back an arena grown past the NeoScrypt(128, 2, 1) size;
+ * left empty if the default size cannot be had, the next reserve retries */
+static void neoscrypt_ctx_shrink(neoscrypt_ctx *ctx) {
+
+    neoscrypt_arena_release(ctx);
+    neoscrypt_arena_alloc(ctx, NEOSCRYPT_SCRATCH);
+}
+
+neoscrypt_ctx *neoscrypt_ctx_new(uint flags) {
+    neoscrypt_ctx *ctx;
+
+    ctx = (neoscrypt_ctx *) calloc(1, sizeof(neoscrypt_ctx));
+    if(ctx)
+      ctx->flags = flags;
+
+    return(ctx);
+}
+
+/* Arenas of threads: the one set by the caller if any,
+ * the one owned by the thread otherwise */
+static pthread_key_t neoscrypt_ctx_key_set;
+static pthread_key_t neoscrypt_ctx_key_own;
+static pthread_once_t neoscrypt_ctx_once = PTHREAD_ONCE_INIT;
+
+static void neoscrypt_ctx_destroy(void *ctx) {
+
+    neoscrypt_ctx_free((neoscrypt_ctx *) ctx);
+}
+
+static void neoscrypt_ctx_keys(void) {
+
+    pthread_key_create(&neoscrypt_ctx_key_set, NULL);
+    pthread_key_create(&neoscrypt_ctx_key_own, neoscrypt_ctx_destroy);
+}
+
+void neoscrypt_ctx_free(neoscrypt_ctx *ctx) {
+
+    if(!ctx)
+      return;
+
+    pthread_once(&neoscrypt_ctx_once, neoscrypt_ctx_keys);
+    if(pthread_getspecific(neoscrypt_ctx_key_set) == ctx)
+      pthread_setspecific(neoscrypt_ctx_key_set, NULL);
+
+    neoscrypt_arena_release(ctx);
+    free(ctx);
+}
+
+/* Makes the calling thread use ctx for scratch, NULL reverts to the arena
+ * owned by the thread; ctx remains owned by the caller */
+void neoscrypt_ctx_set(neoscrypt_ctx *ctx) {
+
+    pthread_once(&neoscrypt_ctx_once, neoscrypt_ctx_keys);
+    pthread_setspecific(neoscrypt_ctx_key_set, ctx);
+}
+
+/* Arena of the calling thread, created on the first use;
+ * NULL if out of memory */
+static neoscrypt_ctx *neoscrypt_ctx_self(void) {
+    neoscrypt_ctx *ctx;
+
+    pthread_once(&neoscrypt_ctx_once, neoscrypt_ctx_keys);
+
+    ctx = (neoscrypt_ctx *) pthread_getspecific(neoscrypt_ctx_key_set);
+    if(ctx)
+      return(ctx);
+
+    ctx = (neoscrypt_ctx *) pthread_getspecific(neoscrypt_ctx_key_own);
+    if(!ctx) {
+        ctx = neoscrypt_ctx_new(0);
+        if(!ctx)
+          return(NULL);
+        pthread_setspecific(neoscrypt_ctx_key_own, ctx);
+    }
+
+    return(ctx);
+}
+
+/* Scratch of the calling thread or NULL if out of memory */
+static uchar *neoscrypt_scratch(size_t size) {
+    neoscrypt_ctx *ctx;
+
+    ctx = neoscrypt_ctx_self();
+    if(!ctx)
+      return(NULL);
+
+    return(neoscrypt_ctx_reserve(ctx, size));
+}
+
+
+/* NeoScrypt(128, 2, 1) with FastKDF, i.e. profile 0 of neoscrypt_profile();
+ * returns 0 on success or -1 if out of memory */
+int neoscrypt(const uchar *password, uchar *output) {
+    uint *X;
+
+    /* X = r * 2 * BLOCK_SIZE */
+    X = (uint *) neoscrypt_scratch(NEOSCRYPT_SCRATCH);
+    if(!X)
+      return(-1);
+
+    /* X = KDF(password, salt) */
+    neoscrypt_fastkdf_opt(password, password, (uchar *) X, 0);
+
+    neoscrypt_mix(X);
 
     /* output = KDF(password, X) */
     neoscrypt_fastkdf_opt(password, (uchar *) X, output, 1);
 
-#ifdef _MSC_VER
-    free(stack);
+    return(0);
+}
+
+/* NeoScrypt core engine:
+ * p = 1, salt = password;
+ * Basic customisation (required):
+ *   profile bit 0:
+ *     0 = NeoScrypt(128, 2, 1) with Salsa20/20 and ChaCha20/20;
+ *     1 = Scrypt(1024, 1, 1) with Salsa20/8;
+ *   profile bits 4 to 1:
+ *     0000 = FastKDF-BLAKE2s;
+ *     0001 = PBKDF2-HMAC-SHA256;
+ *     0010 = PBKDF2-HMAC-BLAKE256;
+ * Extended customisation (optional):
+ *   profile bit 31:
+ *     0 = extended customisation absent;
+ *     1 = extended customisation present;
+ *   profile bits 7 to 5 (rfactor):
+ *     000 = r of 1;
+ *     001 = r of 2;
+ *     010 = r of 4;
+ *     ...
+ *     111 = r of 128;
+ *   profile bits 12 to 8 (Nfactor):
+ *     00000 = N of 2;
+ *     00001 = N of 4;
+ *     00010 = N of 8;
+ *     .....
+ *     00110 = N of 128;
+ *     .....
+ *     01001 = N of 1024;
+ *     .....
+ *     11110 = N of 2147483648;
+ *   profile bits 30 to 13 are reserved;
+ * Returns 0 on success or -1 if the profile is not supported
+ * or out of memory */
+int neoscrypt_profile(const uchar *password, uchar *output, uint profile) {
+    uint N = 128, r = 2, dblmix = 1, mixmode = 0x14;
+    uint kdf, Nfactor, rfactor;
+    neoscrypt_ctx *ctx;
+    ullong size;
+    size_t held;
+    uint *X;
+
+    /* The mining profile has a dedicated path */
+    if(!profile)
+      return(neoscrypt(password, output));
+
+    if(profile & 0x1) {
+        N = 1024;
+        r = 1;
+        dblmix = 0;
+        mixmode = 0x08;
+    }
+
+    if(profile & 0x80000000) {
+        /* N = 2 ^ (Nfactor + 1) */
+        if((Nfactor = (profile >> 8) & 0x1F)) {
+            if(Nfactor > 30)
+              return(-1);
+            N = (1U << (Nfactor + 1));
+        }
+        /* r = 2 ^ rfactor */
+        if((rfactor = (profile >> 5) & 0x7))
+          r = (1 << rfactor);
+    }
+
+    /* PBKDF2-HMAC-BLAKE256 is not implemented;
+     * FastKDF cannot output more than 256 bytes */
+    kdf = (profile >> 1) & 0xF;
+    if((kdf > 1) || (!kdf && (r > 2)))
+      return(-1);
+
+    /* V must be addressable with 32-bit word indices */
+    size = (ullong)(N + 3) * r * 2 * BLOCK_SIZE;
+    if((size >> 34) || (size != (size_t)size))
+      return(-1);
+    ctx = neoscrypt_ctx_self();
+    if(!ctx)
+      return(-1);
+    held = ctx->size;
+    /* X = r * 2 * BLOCK_SIZE */
+    X = (uint *) neoscrypt_ctx_reserve(ctx, (size_t)size);
+    if(!X)
+      return(-1);
+
+    /* X = KDF(password, salt) */
+    if(kdf)
+      neoscrypt_pbkdf2_sha256(password, 80, password, 80, 1,
+        (uchar *) X, r * 2 * BLOCK_SIZE);
+    else
+      neoscrypt_fastkdf_gen(password, 80, password, 80,
+        (uchar *) X, r * 2 * BLOCK_SIZE);
+
+    if((N == 128) && (r == 2) && dblmix && (mixmode == 0x14))
+      neoscrypt_mix(X);
+    else if((N == 1024) && (r == 1) && !dblmix && (mixmode == 0x08))
+      neoscrypt_mix_scrypt(X);
+    else
+      neoscrypt_mix_generic(X, N, r, dblmix, mixmode);
+
+    /* output = KDF(password, X) */
+    if(kdf)
+      neoscrypt_pbkdf2_sha256(password, 80, (uchar *) X, r * 2 * BLOCK_SIZE, 1,
+        output, 32);
+    else
+      neoscrypt_fastkdf_gen(password, 80, (uchar *) X, r * 2 * BLOCK_SIZE,
+        output, 32);
+
+    /* Grown for this profile only, not kept for mining */
+    if((ctx->size > held) && (size > NEOSCRYPT_SCRATCH))
+      neoscrypt_ctx_shrink(ctx);
+
+    return(0);
+}
+
+/* NeoScrypt(128, 2, 1) of the header of ctx with the nonce given;
+ * returns 0 on success or -1 if out of memory */
+int neoscrypt_nonce(const neoscrypt_kdf_ctx *ctx, uint nonce, uchar *output) {
+    uint *X;
+
+    X = (uint *) neoscrypt_scratch(NEOSCRYPT_SCRATCH);
+    if(!X)
+      return(-1);
+
+    neoscrypt_kdf_first(ctx, nonce, (uchar *) X);
+
+    neoscrypt_mix(X);
+
+    neoscrypt_kdf_last(ctx, nonce, (uchar *) X, output);
+
+    return(0);
+}
+
+
+/* Multi-lane NeoScrypt engines;
+ * N lanes of independent NeoScrypt(128, 2, 1) in vector registers,
+ * SSE2 is a baseline, AVX2 and AVX-512 are selected at run time */
+
+#if defined(NEOSCRYPT_X86)
+
+/* Scratch space per lane: T, X, Z and V for mixing, A and B for FastKDF */
+#define NEOSCRYPT_LANE_MIX ((128 + 3) * 2 * 2 * BLOCK_SIZE)
+#define NEOSCRYPT_LANE_SCRATCH (NEOSCRYPT_LANE_MIX + 640)
+
+typedef void (*neoscrypt_lanes_fn)(uchar *scratch);
+typedef void (*neoscrypt_kdf_fn)(uchar *kdf, uint bufptr, uint i,
+  const uint *key_h, uchar *output, uint output_len);
+
+/* SSE2 engine, 4 lanes */
+
+#define NS_LANES 4
+#define NS_V __m128i
+#define NS_I const uint *
+#if defined(__GNUC__)
+#define NS_TARGET __attribute__((target("sse2")))
+#else
+#define NS_TARGET
 #endif
+#define NS_FN(name) name##_sse2
+#define NS_ADD(a, b) _mm_add_epi32(a, b)
+#define NS_XOR(a, b) _mm_xor_si128(a, b)
+#define NS_ROTL(a, b) _mm_or_si128(_mm_slli_epi32(a, b), _mm_srli_epi32(a, 32 - (b)))
+#define NS_ROTL16(a) _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xB1), 0xB1)
+#define NS_ROTL8(a) NS_ROTL(a, 8)
+#define NS_ROTL24(a) NS_ROTL(a, 24)
+#define NS_SET1(x) _mm_set1_epi32((int) (x))
+#define NS_LOAD(src) _mm_loadu_si128((const __m128i *) (src))
+#define NS_STORE(dst, a) _mm_storeu_si128((__m128i *) (dst), a)
+#define NS_IDX(idx) (idx)
+#define NS_GATHER(base, vidx) \
+    _mm_set_epi32((int) (base)[(vidx)[3]], (int) (base)[(vidx)[2]], \
+      (int) (base)[(vidx)[1]], (int) (base)[(vidx)[0]])
+
+#include "neoscrypt_simd.h"
+
+#undef NS_LANES
+#undef NS_V
+#undef NS_I
+#undef NS_TARGET
+#undef NS_FN
+#undef NS_ADD
+#undef NS_XOR
+#undef NS_ROTL
+#undef NS_ROTL16
+#undef NS_ROTL8
+#undef NS_ROTL24
+#undef NS_SET1
+#undef NS_LOAD
+#undef NS_STORE
+#undef NS_IDX
+#undef NS_GATHER
+
+/* AVX2 engine, 8 lanes */
+
+#if !defined(NEOSCRYPT_NO_AVX2)
+
+#define NS_LANES 8
+#define NS_V __m256i
+#define NS_I __m256i
+#if defined(__GNUC__)
+#define NS_TARGET __attribute__((target("avx2")))
+#else
+#define NS_TARGET
+#endif
+#define NS_FN(name) name##_avx2
+#define NS_ADD(a, b) _mm256_add_epi32(a, b)
+#define NS_XOR(a, b) _mm256_xor_si256(a, b)
+#define NS_ROTL(a, b) \
+    _mm256_or_si256(_mm256_slli_epi32(a, b), _mm256_srli_epi32(a, 32 - (b)))
+#define NS_ROTL16(a) _mm256_shuffle_epi8(a, _mm256_set_epi8( \
+    13, 12, 15, 14,  9,  8, 11, 10,  5,  4,  7,  6,  1,  0,  3,  2, \
+    13, 12, 15, 14,  9,  8, 11, 10,  5,  4,  7,  6,  1,  0,  3,  2))
+#define NS_ROTL8(a) _mm256_shuffle_epi8(a, _mm256_set_epi8( \
+    14, 13, 12, 15, 10,  9,  8, 11,  6,  5,  4,  7,  2,  1,  0,  3, \
+    14, 13, 12, 15, 10,  9,  8, 11,  6,  5,  4,  7,  2,  1,  0,  3))
+#define NS_ROTL24(a) _mm256_shuffle_epi8(a, _mm256_set_epi8( \
+    12, 15, 14, 13,  8, 11, 10,  9,  4,  7,  6,  5,  0,  3,  2,  1, \
+    12, 15, 14, 13,  8, 11, 10,  9,  4,  7,  6,  5,  0,  3,  2,  1))
+#define NS_SET1(x) _mm256_set1_epi32((int) (x))
+#define NS_LOAD(src) _mm256_loadu_si256((const __m256i *) (src))
+#define NS_STORE(dst, a) _mm256_storeu_si256((__m256i *) (dst), a)
+#define NS_IDX(idx) _mm256_loadu_si256((const __m256i *) (idx))
+#define NS_GATHER(base, vidx) _mm256_i32gather_epi32((const int *) (base), vidx, 4)
+
+#include "neoscrypt_simd.h"
+
+#undef NS_LANES
+#undef NS_V
+#undef NS_I
+#undef NS_TARGET
+#undef NS_FN
+#undef NS_ADD
+#undef NS_XOR
+#undef NS_ROTL
+#undef NS_ROTL16
+#undef NS_ROTL8
+#undef NS_ROTL24
+#undef NS_SET1
+#undef NS_LOAD
+#undef NS_STORE
+#undef NS_IDX
+#undef NS_GATHER
+
+#endif /* !NEOSCRYPT_NO_AVX2 */
+
+/* AVX-512 engine, 16 lanes */
+
+#if !defined(NEOSCRYPT_NO_AVX512)
+
+#define NS_LANES 16
+#define NS_V __m512i
+#define NS_I __m512i
+#if defined(__GNUC__)
+#define NS_TARGET __attribute__((target("avx512f")))
+#else
+#define NS_TARGET
+#endif
+#define NS_FN(name) name##_avx512
+#define NS_ADD(a, b) _mm512_add_epi32(a, b)
+#define NS_XOR(a, b) _mm512_xor_si512(a, b)
+#define NS_ROTL(a, b) _mm512_rol_epi32(a, b)
+#define NS_ROTL16(a) _mm512_rol_epi32(a, 16)
+#define NS_ROTL8(a) _mm512_rol_epi32(a, 8)
+#define NS_ROTL24(a) _mm512_rol_epi32(a, 24)
+#define NS_SET1(x) _mm512_set1_epi32((int) (x))
+#define NS_LOAD(src) _mm512_loadu_si512((const void *) (src))
+#define NS_STORE(dst, a) _mm512_storeu_si512((void *) (dst), a)
+#define NS_IDX(idx) _mm512_loadu_si512((const void *) (idx))
+#define NS_GATHER(base, vidx) _mm512_i32gather_epi32(vidx, (const void *) (base), 4)
+
+#include "neoscrypt_simd.h"
+
+#undef NS_LANES
+#undef NS_V
+#undef NS_I
+#undef NS_TARGET
+#undef NS_FN
+#undef NS_ADD
+#undef NS_XOR
+#undef NS_ROTL
+#undef NS_ROTL16
+#undef NS_ROTL8
+#undef NS_ROTL24
+#undef NS_SET1
+#undef NS_LOAD
+#undef NS_STORE
+#undef NS_IDX
+#undef NS_GATHER
+
+#endif /* !NEOSCRYPT_NO_AVX512 */
+
+/* Run time engine selection */
+static neoscrypt_lanes_fn neoscrypt_lanes_engine = NULL;
+static neoscrypt_kdf_fn neoscrypt_kdf_engine = NULL;
+static uint neoscrypt_lanes_count = 0;
+
+#if defined(_MSC_VER)
+/* Bits 5 (AVX2) and 16 (AVX512F) of CPUID leaf 7 EBX with the OS
+ * saving YMM, or YMM and ZMM state respectively */
+static int neoscrypt_cpu_has(uint ebx_bit, ullong xcr0_mask) {
+    int info[4];
+
+    __cpuid(info, 0);
+    if(info[0] < 7) return(0);
+    __cpuid(info, 1);
+    /* OSXSAVE */
+    if(!(info[2] & (1 << 27))) return(0);
+    if((_xgetbv(0) & xcr0_mask) != xcr0_mask) return(0);
+    __cpuidex(info, 7, 0);
+    return(!!(info[1] & (1 << ebx_bit)));
+}
+
+/* Bit 19 (SSE4.1) of CPUID leaf 1 ECX */
+static int neoscrypt_cpu_has_sse41(void) {
+    int info[4];
+
+    __cpuid(info, 1);
+    return(!!(info[2] & (1 << 19)));
 }
+#endif
+
+static void neoscrypt_lanes_select(void) {
+    neoscrypt_lanes_fn engine = neoscrypt_lanes_sse2;
+    neoscrypt_kdf_fn kdf = neoscrypt_fastkdf_sse2;
+    uint count = 4;
+
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+#if !defined(NEOSCRYPT_NO_SSE41)
+    if(__builtin_cpu_supports("sse4.1"))
+      blake2s_compress = blake2s_compress_sse41;
+#endif
+#if !defined(NEOSCRYPT_NO_AVX2)
+    if(__builtin_cpu_supports("avx2")) {
+        engine = neoscrypt_lanes_avx2;
+        kdf = neoscrypt_fastkdf_avx2;
+        count = 8;
+    }
+#endif
+#if !defined(NEOSCRYPT_NO_AVX512)
+    if(__builtin_cpu_supports("avx512f")) {
+        engine = neoscrypt_lanes_avx512;
+        kdf = neoscrypt_fastkdf_avx512;
+        count = 16;
+    }
+#endif
+#elif defined(_MSC_VER)
+#if !defined(NEOSCRYPT_NO_SSE41)
+    if(neoscrypt_cpu_has_sse41())
+      blake2s_compress = blake2s_compress_sse41;
+#endif
+#if !defined(NEOSCRYPT_NO_AVX2)
+    if(neoscrypt_cpu_has(5, 0x06)) {
+        engine = neoscrypt_lanes_avx2;
+        kdf = neoscrypt_fastkdf_avx2;
+        count = 8;
+    }
+#endif
+#if !defined(NEOSCRYPT_NO_AVX512)
+    if(neoscrypt_cpu_has(16, 0xE6)) {
+        engine = neoscrypt_lanes_avx512;
+        kdf = neoscrypt_fastkdf_avx512;
+        count = 16;
+    }
+#endif
+#endif
+
+    neoscrypt_lanes_engine = engine;
+    neoscrypt_kdf_engine = kdf;
+    neoscrypt_lanes_count = count;
+}
+
+/* Number of hashes processed at once by the selected engine;
+ * the first call selects the engines and should be made at startup */
+uint neoscrypt_lanes(void) {
+    if(!neoscrypt_lanes_count)
+      neoscrypt_lanes_select();
+    return(neoscrypt_lanes_count);
+}
+
+/* NeoScrypt(128, 2, 1) of count passwords 80 bytes each into
+ * count digests 32 bytes each; full groups of lanes go through the vector
+ * engines, the remainder through neoscrypt();
+ * returns 0 on success or -1 if out of memory */
+int neoscrypt_xN(const uchar *password, uchar *output, uint count) {
+    uint lanes = neoscrypt_lanes();
+    uchar *scratch, *kdf;
+    uint i;
+
+    if(count >= lanes) {
+        scratch = neoscrypt_scratch(lanes * NEOSCRYPT_LANE_SCRATCH);
+        if(scratch) {
+            kdf = &scratch[lanes * NEOSCRYPT_LANE_MIX];
+            for(; count >= lanes; count -= lanes) {
+                for(i = 0; i < lanes; i++)
+                  neoscrypt_fastkdf_setup(&kdf[i * 640], &kdf[i * 640 + 320],
+                    &password[i * 80], &password[i * 80], 0);
+                neoscrypt_kdf_engine(kdf, 0, 0, NULL, scratch, 256);
+                neoscrypt_lanes_engine(scratch);
+                for(i = 0; i < lanes; i++)
+                  neoscrypt_fastkdf_setup(&kdf[i * 640], &kdf[i * 640 + 320],
+                    &password[i * 80], &scratch[i * 256], 1);
+                neoscrypt_kdf_engine(kdf, 0, 0, NULL, output, 32);
+                password += lanes * 80;
+                output   += lanes * 32;
+            }
+        }
+    }
+
+    for(i = 0; i < count; i++) {
+        if(neoscrypt(&password[i * 80], &output[i * 32]))
+          return(-1);
+    }
+
+    return(0);
+}
+
+/* NeoScrypt(128, 2, 1) of the header of ctx with count nonces
+ * starting from the one given; returns 0 on success or -1 if out of memory */
+int neoscrypt_nonce_xN(const neoscrypt_kdf_ctx *ctx, uint nonce,
+  uchar *output, uint count) {
+    uint lanes = neoscrypt_lanes();
+    uchar *scratch, *kdf;
+    uint i;
+
+    if(count >= lanes) {
+        scratch = neoscrypt_scratch(lanes * NEOSCRYPT_LANE_SCRATCH);
+        if(scratch) {
+            kdf = &scratch[lanes * NEOSCRYPT_LANE_MIX];
+            for(; count >= lanes; count -= lanes) {
+                for(i = 0; i < lanes; i++)
+                  neoscrypt_kdf_setup(ctx, nonce + i, (uint *) &kdf[i * 640],
+                    (uint *) &kdf[i * 640 + 320], NULL);
+                neoscrypt_kdf_engine(kdf, ctx->bufptr, ctx->iter,
+                  ctx->key_ready ? ctx->key_h : NULL, scratch, 256);
+                neoscrypt_lanes_engine(scratch);
+                for(i = 0; i < lanes; i++)
+                  neoscrypt_kdf_setup(ctx, nonce + i, (uint *) &kdf[i * 640],
+                    (uint *) &kdf[i * 640 + 320], &scratch[i * 256]);
+                neoscrypt_kdf_engine(kdf, 0, 0, NULL, output, 32);
+                nonce  += lanes;
+                output += lanes * 32;
+            }
+        }
+    }
+
+    for(i = 0; i < count; i++) {
+        if(neoscrypt_nonce(ctx, nonce + i, &output[i * 32]))
+          return(-1);
+    }
+
+    return(0);
+}
+
+#else
+
+/* No vector engines available, fall back to one hash at a time */
+
+uint neoscrypt_lanes(void) {
+    return(1);
+}
+
+int neoscrypt_xN(const uchar *password, uchar *output, uint count) {
+    uint i;
+
+    for(i = 0; i < count; i++) {
+        if(neoscrypt(&password[i * 80], &output[i * 32]))
+          return(-1);
+    }
+
+    return(0);
+}
+
+int neoscrypt_nonce_xN(const neoscrypt_kdf_ctx *ctx, uint nonce,
+  uchar *output, uint count) {
+    uint i;
+
+    for(i = 0; i < count; i++) {
+        if(neoscrypt_nonce(ctx, nonce + i, &output[i * 32]))
+          return(-1);
+    }
+
+    return(0);
+}
+
+#endif
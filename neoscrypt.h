@@ -1,8 +1,43 @@
+#ifndef NEOSCRYPT_H
+#define NEOSCRYPT_H
+
 #if (__cplusplus)
 extern "C" {
 #endif
 
-void neoscrypt(const unsigned char *password, unsigned char *output);
+/* FastKDF context of a block header, see neoscrypt_kdf_prehash() */
+typedef struct neoscrypt_kdf_ctx_t {
+    unsigned int A[80];
+    unsigned int B[72];
+    unsigned int key_h[8];
+    unsigned int key_ready;
+    unsigned int bufptr;
+    unsigned int iter;
+} neoscrypt_kdf_ctx;
+
+/* Scratchpad arena, see neoscrypt_ctx_set() */
+typedef struct neoscrypt_ctx_t neoscrypt_ctx;
+
+/* Back the arena with huge pages if available */
+#define NEOSCRYPT_CTX_HUGEPAGES 0x1
+
+neoscrypt_ctx *neoscrypt_ctx_new(unsigned int flags);
+void neoscrypt_ctx_free(neoscrypt_ctx *ctx);
+void neoscrypt_ctx_set(neoscrypt_ctx *ctx);
+
+int neoscrypt(const unsigned char *password, unsigned char *output);
+int neoscrypt_profile(const unsigned char *password, unsigned char *output,
+  unsigned int profile);
+
+void neoscrypt_kdf_prehash(neoscrypt_kdf_ctx *ctx, const unsigned char *password);
+int neoscrypt_nonce(const neoscrypt_kdf_ctx *ctx, unsigned int nonce,
+  unsigned char *output);
+int neoscrypt_nonce_xN(const neoscrypt_kdf_ctx *ctx, unsigned int nonce,
+  unsigned char *output, unsigned int count);
+
+int neoscrypt_xN(const unsigned char *password, unsigned char *output,
+  unsigned int count);
+unsigned int neoscrypt_lanes(void);
 
 void neoscrypt_blake2s(const void *input, const unsigned int input_size,
   const void *key, const unsigned char key_size,
@@ -55,3 +90,5 @@ typedef uchar hash_digest[DIGEST_SIZE];
 #define U64TO8_BE(p, v) \
     U32TO8_BE((p),     (uint)((v) >> 32)); \
     U32TO8_BE((p) + 4, (uint)((v)      ));
+
+#endif /* NEOSCRYPT_H */
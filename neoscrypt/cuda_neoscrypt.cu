@@ -12,6 +12,8 @@
 #define MAX_GPUS 32
 #endif
 
+#include "neoscrypt_results.h"
+
 #ifdef _MSC_VER
 typedef unsigned int uint;
 typedef unsigned long long ulong;
@@ -107,7 +109,19 @@ __device__ uint8 *Tr;
 __device__ uint8 *Tr2;
 __device__ uint8 *Input;
 
-static uint *Nonce[MAX_GPUS];
+/* Batches in flight per GPU at most; they execute in stream order
+ * and share the working sets, only the results are per slot */
+#define HASH_SLOTS 2
+
+static uint *Nonce[MAX_GPUS][HASH_SLOTS];
+
+/* Per GPU launch state created once by neoscrypt_init() */
+static cudaStream_t hash_stream[MAX_GPUS][2];
+static cudaEvent_t hash_ev_start[MAX_GPUS];
+static cudaEvent_t hash_ev_mix[MAX_GPUS];
+static cudaEvent_t hash_ev_done[MAX_GPUS][HASH_SLOTS];
+/* Pinned host copies of the result buffers */
+static uint *hash_results[MAX_GPUS][HASH_SLOTS];
 
 __constant__ uint hash_target;
 __constant__ __align__(16) uint key_init[16]; 
@@ -3692,7 +3706,7 @@ void neoscrypt_gpu_hash_start(uint startNonce) {
 }
 
 __global__ __launch_bounds__(TPB, 1)
-void neoscrypt_gpu_hash_end(uint startNonce, uint *nonceVector) {
+void neoscrypt_gpu_hash_end(uint startNonce, uint *results) {
     const uint thrid = blockDim.x * blockIdx.x + threadIdx.x;
     const uint shiftTr = thrid * 8;
     const uint nonce = thrid + startNonce;
@@ -4042,7 +4056,7 @@ void neoscrypt_gpu_hash_end(uint startNonce, uint *nonceVector) {
     asm("xor.b32 %0, %0, %1;" : "+r"(i) : "r"(data7));
 
     if(i <= hash_target)
-    asm("st.b32 [%1], %0;" : : "r"(nonce), __MEM_PTR(&nonceVector[0]));
+      neoscrypt_result_put(results, nonce);
 }
 
 
@@ -5155,11 +5169,13 @@ void neoscrypt_gpu_hash_chacha_mode3() {
 }
 
 
-__host__ uint neoscrypt_hash(uint thr_id, uint throughput, uint startNonce,
-  uint hash_mode) {
-    uint result[MAX_GPUS] = { 0xFFFFFFFF };
+/* Issues a batch into a result slot asynchronously, see neoscrypt_hash_wait();
+ * it starts once the batches issued before are complete */
+__host__ void neoscrypt_hash_issue(uint thr_id, uint slot, uint throughput,
+  uint startNonce, uint hash_mode) {
+    cudaStream_t *stream = hash_stream[thr_id];
 
-    cudaMemset(Nonce[thr_id], 0xFF, 4);
+    cudaMemsetAsync(Nonce[thr_id][slot], 0, sizeof(uint), stream[0]);
 
     dim3 grid(throughput / TPB, 1, 1);
     dim3 block(TPB, 1, 1);
@@ -5173,11 +5189,11 @@ __host__ uint neoscrypt_hash(uint thr_id, uint throughput, uint startNonce,
     dim3 grid_mix3((throughput * 4) / TPB_MIX_MODE3);
     dim3 block_mix3(4, TPB_MIX_MODE3 / 4);
 
-    cudaStream_t stream[2];
-    cudaStreamCreate(&stream[0]);
-    cudaStreamCreate(&stream[1]);
+    neoscrypt_gpu_hash_start <<<grid, block, 0, stream[0]>>> (startNonce);
 
-    neoscrypt_gpu_hash_start <<<grid, block>>> (startNonce);
+    /* Salsa and ChaCha run concurrently on both streams */
+    cudaEventRecord(hash_ev_start[thr_id], stream[0]);
+    cudaStreamWaitEvent(stream[1], hash_ev_start[thr_id], 0);
 
     switch(hash_mode) {
 
@@ -5199,16 +5215,25 @@ __host__ uint neoscrypt_hash(uint thr_id, uint throughput, uint startNonce,
 
     }
 
-    cudaDeviceSynchronize();
+    cudaEventRecord(hash_ev_mix[thr_id], stream[1]);
+    cudaStreamWaitEvent(stream[0], hash_ev_mix[thr_id], 0);
 
-    neoscrypt_gpu_hash_end <<<grid, block>>> (startNonce, Nonce[thr_id]);
+    neoscrypt_gpu_hash_end <<<grid, block, 0, stream[0]>>> (startNonce,
+      Nonce[thr_id][slot]);
 
-    cudaMemcpy(&result[thr_id], Nonce[thr_id], sizeof(uint), cudaMemcpyDeviceToHost);
+    cudaMemcpyAsync(hash_results[thr_id][slot], Nonce[thr_id][slot],
+      NEOSCRYPT_RESULT_WORDS * sizeof(uint), cudaMemcpyDeviceToHost, stream[0]);
 
-    cudaStreamDestroy(stream[0]);
-    cudaStreamDestroy(stream[1]);
+    cudaEventRecord(hash_ev_done[thr_id][slot], stream[0]);
+}
 
-    return(result[thr_id]);
+/* Waits for the batch of a result slot; returns the number of nonces found,
+ * up to MAX_NONCES of them are stored into nonces in ascending order */
+__host__ uint neoscrypt_hash_wait(uint thr_id, uint slot, uint *nonces) {
+
+    cudaEventSynchronize(hash_ev_done[thr_id][slot]);
+
+    return(neoscrypt_result_collect(hash_results[thr_id][slot], nonces));
 }
 
 __host__ void neoscrypt_init(uint thr_id, uint *gmem, uint *hash0, uint *hash1, uint *hash2) {
@@ -5216,7 +5241,21 @@ __host__ void neoscrypt_init(uint thr_id, uint *gmem, uint *hash0, uint *hash1,
     cudaMemcpyToSymbolAsync(Tr, &hash0, sizeof(hash0), 0, cudaMemcpyHostToDevice);
     cudaMemcpyToSymbolAsync(Tr2, &hash1, sizeof(hash1), 0, cudaMemcpyHostToDevice);
     cudaMemcpyToSymbolAsync(Input, &hash2, sizeof(hash2), 0, cudaMemcpyHostToDevice);
-    cudaMalloc(&Nonce[thr_id], 4);
+    uint slot;
+
+    cudaStreamCreate(&hash_stream[thr_id][0]);
+    cudaStreamCreate(&hash_stream[thr_id][1]);
+    cudaEventCreateWithFlags(&hash_ev_start[thr_id], cudaEventDisableTiming);
+    cudaEventCreateWithFlags(&hash_ev_mix[thr_id], cudaEventDisableTiming);
+
+    for(slot = 0; slot < HASH_SLOTS; slot++) {
+        cudaMalloc(&Nonce[thr_id][slot], NEOSCRYPT_RESULT_WORDS * sizeof(uint));
+        /* The host thread sleeps rather than spins while waiting */
+        cudaEventCreateWithFlags(&hash_ev_done[thr_id][slot],
+          cudaEventDisableTiming | cudaEventBlockingSync);
+        cudaHostAlloc((void **) &hash_results[thr_id][slot],
+          NEOSCRYPT_RESULT_WORDS * sizeof(uint), cudaHostAllocDefault);
+    }
 }
 
 __host__ void neoscrypt_prehash(uint *pdata, const uint *ptarget) {
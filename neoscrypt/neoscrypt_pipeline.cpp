@@ -0,0 +1,114 @@
+#include <string.h>
+
+#include "../neoscrypt.h"
+
+#include "miner.h"
+#include "log.h"
+
+#include "neoscrypt_pipeline.h"
+
+static double neoscrypt_time(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return((double)tv.tv_sec + 1e-6 * tv.tv_usec);
+}
+
+/* Scans nonces from pdata[19] to max_nonce inclusive keeping the device busy:
+ * batch k + 1 is in flight while the results of batch k are collected;
+ * a last batch short of max_nonce is moved back to end at it, the nonces
+ * it hashes twice or past max_nonce are ignored. Returns the number of nonces found, stored
+ * into nonces in ascending order with pdata[19] set to the first of them;
+ * the batches in flight when a nonce is found complete and add their nonces
+ * too, those in flight on a work restart complete and are discarded,
+ * not counted into hashes_done;
+ * a batch runs from its issue or the end of the previous one, whichever
+ * is later, to its end, its time goes to the batch time histogram and
+ * the percentiles of the stats;
+ * a failed batch stops the scan like a restart, -1 is returned then
+ * unless nonces have been found already */
+int neoscrypt_pipeline_scan(neoscrypt_device *dev, uint *pdata, uint max_nonce,
+  uint64_t *hashes_done, uint *nonces) {
+    const uint first_nonce = pdata[19];
+    const uint throughput = dev->throughput;
+    const ullong end = (ullong)max_nonce + 1;
+    ullong start[NEOSCRYPT_PIPELINE_DEPTH];
+    double issued[NEOSCRYPT_PIPELINE_DEPTH], prev = 0.0, now, elapsed;
+    ullong next = pdata[19], done = pdata[19], first;
+    uint batch[MAX_NONCES];
+    uint head = 0, inflight = 0, found = 0, lost = 0;
+    uint slot, count, i;
+    bool restarted = false, failed = false;
+
+    while(1) {
+
+        /* Keep the pipeline full unless done */
+        while((inflight < NEOSCRYPT_PIPELINE_DEPTH) && !found && !failed &&
+          !work_restart[dev->thr_id].restart &&
+          (next < end)) {
+            slot = (head + inflight) % NEOSCRYPT_PIPELINE_DEPTH;
+            if((next + throughput > end) && (end >= throughput))
+              start[slot] = end - throughput;
+            else
+              start[slot] = next;
+            issued[slot] = neoscrypt_time();
+            dev->issue(dev, slot, (uint)start[slot]);
+            next = start[slot] + throughput;
+            inflight++;
+        }
+
+        if(!inflight)
+          break;
+
+        count = dev->wait(dev, head, batch);
+        now = neoscrypt_time();
+        elapsed = now - MAX(issued[head], prev);
+        /* Not exported for the CPU threads */
+        if(!is_cpu_thread(dev->thr_id))
+          metrics_observe_own(&thr_info[dev->thr_id].gpu.batch_time, elapsed);
+        stats_remember_batch(dev->thr_id, elapsed);
+        prev = now;
+        slot = head;
+        head = (head + 1) % NEOSCRYPT_PIPELINE_DEPTH;
+        inflight--;
+
+        if(count == NEOSCRYPT_PIPELINE_FAILED)
+          failed = true;
+
+        /* Discarded from the restart on, the nonces done stop there */
+        if(restarted || failed || work_restart[dev->thr_id].restart) {
+            restarted = true;
+            continue;
+        }
+        first = done;
+        done = start[slot] + throughput;
+
+        if(!count)
+          continue;
+
+        /* Batches complete in order, so do their nonces */
+        for(i = 0; i < MIN(count, MAX_NONCES); i++) {
+            if((batch[i] < first) || (batch[i] > max_nonce))
+              continue;
+            if(found < MAX_NONCES)
+              nonces[found++] = batch[i];
+            else
+              lost++;
+        }
+        if(count > MAX_NONCES)
+          lost += count - MAX_NONCES;
+    }
+
+    if(lost)
+      gpulog(LOG_WARNING, dev->thr_id, "%u nonces found, %u of them lost",
+        found + lost, lost);
+
+    done = MIN(done, end);
+    *hashes_done = done - first_nonce;
+    pdata[19] = found ? nonces[0] : (uint)done;
+
+    if(failed && !found)
+      return(-1);
+
+    return((int)found);
+}
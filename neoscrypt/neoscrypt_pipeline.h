@@ -0,0 +1,28 @@
+#ifndef NEOSCRYPT_PIPELINE_H
+#define NEOSCRYPT_PIPELINE_H
+
+/* Batches in flight at most */
+#define NEOSCRYPT_PIPELINE_DEPTH 2
+
+/* Returned by wait for a batch which could not be hashed */
+#define NEOSCRYPT_PIPELINE_FAILED 0xFFFFFFFF
+
+/* Batch hashing device driven by neoscrypt_pipeline_scan();
+ * a batch hashes throughput nonces starting from the one given
+ * and reports those meeting the target */
+typedef struct neoscrypt_device_t {
+    int   thr_id;
+    uint  throughput;
+    void *ctx;
+    /* Issues a batch into a slot without waiting for it to complete */
+    void (*issue)(struct neoscrypt_device_t *dev, uint slot, uint start_nonce);
+    /* Waits for the batch of a slot; returns the number of nonces found,
+     * up to MAX_NONCES of them are stored into nonces in ascending order,
+     * or NEOSCRYPT_PIPELINE_FAILED */
+    uint (*wait)(struct neoscrypt_device_t *dev, uint slot, uint *nonces);
+} neoscrypt_device;
+
+int neoscrypt_pipeline_scan(neoscrypt_device *dev, uint *pdata, uint max_nonce,
+  uint64_t *hashes_done, uint *nonces);
+
+#endif /* NEOSCRYPT_PIPELINE_H */
@@ -0,0 +1,67 @@
+#ifndef NEOSCRYPT_RESULTS_H
+#define NEOSCRYPT_RESULTS_H
+
+/* Result buffer of a kernel launch:
+ * word 0 counts the nonces found, up to MAX_NONCES of them follow;
+ * the count may exceed the capacity, the excess nonces are lost then.
+ * The same code runs on the host to emulate a launch without a GPU */
+
+#ifndef MAX_NONCES
+#define MAX_NONCES 8
+#endif
+
+#define NEOSCRYPT_RESULT_WORDS (MAX_NONCES + 1)
+
+#if defined(__CUDACC__)
+#define NEOSCRYPT_RESULT_FN static __host__ __device__ __forceinline__
+#else
+#define NEOSCRYPT_RESULT_FN static __inline
+#endif
+
+#if defined(_MSC_VER) && !defined(__CUDA_ARCH__)
+#include <intrin.h>
+#endif
+
+/* Empties the buffer before a launch */
+NEOSCRYPT_RESULT_FN void neoscrypt_result_reset(unsigned int *results) {
+
+    results[0] = 0;
+}
+
+/* Stores a nonce found; safe to call from any number of threads */
+NEOSCRYPT_RESULT_FN void neoscrypt_result_put(unsigned int *results,
+  unsigned int nonce) {
+    unsigned int slot;
+
+#if defined(__CUDA_ARCH__)
+    slot = atomicAdd(&results[0], 1);
+#elif defined(_MSC_VER)
+    slot = (unsigned int) _InterlockedIncrement((volatile long *) &results[0]) - 1;
+#else
+    slot = __sync_fetch_and_add(&results[0], 1);
+#endif
+
+    if(slot < MAX_NONCES)
+      results[slot + 1] = nonce;
+}
+
+/* Copies the nonces stored into nonces in ascending order;
+ * returns the number found, which may exceed the number stored */
+NEOSCRYPT_RESULT_FN unsigned int neoscrypt_result_collect(
+  const unsigned int *results, unsigned int *nonces) {
+    unsigned int count, stored, i, j, t;
+
+    count = results[0];
+    stored = (count < MAX_NONCES) ? count : MAX_NONCES;
+
+    for(i = 0; i < stored; i++) {
+        t = results[i + 1];
+        for(j = i; j && (nonces[j - 1] > t); j--)
+          nonces[j] = nonces[j - 1];
+        nonces[j] = t;
+    }
+
+    return(count);
+}
+
+#endif /* NEOSCRYPT_RESULTS_H */
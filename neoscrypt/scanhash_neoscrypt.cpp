@@ -8,6 +8,8 @@
 #include "miner.h"
 #include "log.h"
 
+#include "neoscrypt_pipeline.h"
+
 #ifdef _MSC_VER
 #define __func__ __FUNCTION__
 #include <stdio.h>
@@ -18,129 +20,168 @@ static uint *hash0[MAX_GPUS];
 static uint *hash1[MAX_GPUS];
 static uint *hash2[MAX_GPUS];
 
+/* CUDA threads and hashing mode of the devices */
+static uint dev_threads[MAX_GPUS];
+static uint dev_mode[MAX_GPUS];
+
+/* Devices being tuned, see tune.cpp */
+static struct tune_state *tuner[MAX_GPUS];
+static char tune_key[MAX_GPUS][256];
+
+/* Device memory per CUDA thread, see the allocations below */
+#define NEOSCRYPT_THREAD_MEM (32768 + 3 * 128)
+
+/* Batches per scan while tuning, a setting is measured in a few scans */
+#define NEOSCRYPT_TUNE_BATCHES 16
+
 extern void neoscrypt_init(uint thr_id, uint *gmem,
   uint *hash0, uint *hash1, uint *hash2);
 extern void neoscrypt_prehash(uint *data, const uint *ptarget);
-extern uint neoscrypt_hash(uint thr_id, uint throughput, uint startNonce, uint hash_mode);
+extern void neoscrypt_hash_issue(uint thr_id, uint slot, uint throughput,
+  uint startNonce, uint hash_mode);
+extern uint neoscrypt_hash_wait(uint thr_id, uint slot, uint *nonces);
 
-extern "C" int scanhash_neoscrypt(int thr_id, uint *pdata, const uint *ptarget,
-  uint max_nonce, uint64_t *hashes_done, uint hash_mode) {
-    const uint first_nonce = pdata[19];
-    uint foundNonce;
+/* GPU implementation of the pipeline device, ctx points to the hash mode */
+static void neoscrypt_gpu_issue(neoscrypt_device *dev, uint slot,
+  uint start_nonce) {
 
-    if(opt_benchmark)
-      ((uint *) ptarget)[7] = 0x01FF;
+    neoscrypt_hash_issue(dev->thr_id, slot, dev->throughput, start_nonce,
+      *(uint *) dev->ctx);
+}
+
+static uint neoscrypt_gpu_wait(neoscrypt_device *dev, uint slot, uint *nonces) {
+    uint count, i;
+
+    count = neoscrypt_hash_wait(dev->thr_id, slot, nonces);
+
+    for(i = 0; opt_benchmark && (i < MIN(count, MAX_NONCES)); i++)
+      gpulog(LOG_INFO, dev->thr_id, "nonce 0x%08X found", nonces[i]);
 
-    uint intensity = 1, throughput = 0;
+    return(count);
+}
+
+/* Chooses the settings of a device: those given on the command line,
+ * those tuned before or else tunes them on live work;
+ * returns the CUDA threads to allocate memory for */
+static uint neoscrypt_setup(int thr_id, uint hash_mode) {
     cudaDeviceProp props;
-    cudaGetDeviceProperties(&props, device_map[thr_id]);
-    if(strstr(props.name, "TITAN Xp")) {
-        throughput = 30 * 128 * 32;
-        if(!hash_mode) hash_mode = 3;
-    }
-    else if(strstr(props.name, "1080 Ti")) {
-        throughput = 28 * 128 * 32;
-        if(!hash_mode) hash_mode = 3;
-    }
-    else if(strstr(props.name, "1080")) {
-        throughput = 20 * 128 * 32;
-        if(!hash_mode) hash_mode = 3;
-    }
-    else if(strstr(props.name, "1070 Ti")) {
-        throughput = 19 * 128 * 32;
-        if(!hash_mode) hash_mode = 3;
-    }
-    else if(strstr(props.name, "1070")) {
-        throughput = 15 * 128 * 64;
-        if(!hash_mode) hash_mode = 2;
-    }
-    else if(strstr(props.name, "1060 6GB")) {
-        throughput = 10 * 128 * 64;
-        if(!hash_mode) hash_mode = 2;
-    }
-    else if(strstr(props.name, "1060 3GB")) {
-        throughput = 9 * 128 * 32;
-        if(!hash_mode) hash_mode = 2;
-    }
-    else if(strstr(props.name, "TITAN X")) {
-        throughput = 24 * 128 * 32;
-        if(!hash_mode) hash_mode = 3;
-    }
-    else if(strstr(props.name, "980 Ti")) {
-        throughput = 22 * 128 * 32;
-        if(!hash_mode) hash_mode = 3;
-    }
-    else if(strstr(props.name, "980")) {
-        throughput = 16 * 128 * 32;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "970")) {
-        throughput = 13 * 128 * 32;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "960")) {
-        throughput = 8 * 128 * 32;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "950")) {
-        throughput = 6 * 128 * 64;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "750 Ti")) {
-        throughput = 5 * 128 * 64;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "750")) {
-        throughput = 4 * 128 * 64;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "TITAN Z")) {
-        throughput = 15 * 192 * 32;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "TITAN Black")) {
-        throughput = 15 * 192 * 32;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "TITAN")) {
-        throughput = 14 * 192 * 32;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "780 Ti")) {
-        throughput = 15 * 192 * 16;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else if(strstr(props.name, "780")) {
-        throughput = 12 * 192 * 16;
-        if(!hash_mode) hash_mode = 1;
-    }
-    else
-      intensity = 14;
+    const uint fixed_threads = gpus_intensity[device_map[thr_id]];
+    uint unit, max_threads, threads = 0, mode = 0;
+    int i;
 
-    if(!throughput) throughput = 1U << intensity;
+    memset(&props, 0, sizeof(props));
+    cudaGetDeviceProperties(&props, device_map[thr_id]);
+    cuda_tune_key(device_map[thr_id], tune_key[thr_id], sizeof(tune_key[thr_id]));
 
+    /* Batches of 128 CUDA threads per multiprocessor at a time
+     * using up to 80% of the device memory */
+    unit = MAX(props.multiProcessorCount, 1) * 128;
+    max_threads = (uint) MIN((ullong)props.totalGlobalMem / 10 * 8 /
+      NEOSCRYPT_THREAD_MEM, 0x40000000ULL) & ~1023U;
 #if defined(_WIN32) && !defined(_WIN64)
-    if(throughput > 49152) throughput = 49152;
+    max_threads = MIN(max_threads, 49152);
 #endif
+    if(max_threads < unit * 8)
+      max_threads = unit * 8;
+
+    if(fixed_threads && hash_mode) {
+        threads = fixed_threads;
+        mode = hash_mode;
+    } else if(tune_cache_get(tune_key[thr_id], &threads, &mode)) {
+        if(fixed_threads) threads = fixed_threads;
+        if(hash_mode) mode = hash_mode;
+        gpulog(LOG_INFO, thr_id, "Using the settings tuned for %s", tune_key[thr_id]);
+    } else if(opt_autotune) {
+        tuner[thr_id] = (struct tune_state *) malloc(sizeof(struct tune_state));
+        tune_init(tuner[thr_id], unit, max_threads, fixed_threads, hash_mode);
+        for(i = 0; i < tuner[thr_id]->count; i++)
+          threads = MAX(threads, tuner[thr_id]->cand[i].throughput);
+        mode = tuner[thr_id]->cand[0].mode;
+        gpulog(LOG_INFO, thr_id, "Tuning the intensity and mode, %d settings to try",
+          tuner[thr_id]->count);
+    } else {
+        /* Mode 3 suits Pascal best, 1 the earlier GPUs */
+        threads = fixed_threads ? fixed_threads : unit * 32;
+        mode = hash_mode ? hash_mode : ((props.major >= 6) ? 3 : 1);
+    }
+
+    dev_threads[thr_id] = tuner[thr_id] ? tune_current(tuner[thr_id])->throughput : threads;
+    dev_mode[thr_id] = mode;
+
+    return(threads);
+}
+
+/* Accounts a scan to the tuning of a device, uses the best settings once done */
+static void neoscrypt_tune(int thr_id, uint throughput, uint64_t hashes_done,
+  const struct timeval *tv_start) {
+    struct tune_candidate c;
+    struct timeval tv_end, diff;
+    char s[32];
+
+    /* Scans cut short by a new job have batches discarded */
+    if(work_restart[thr_id].restart)
+      return;
+
+    gettimeofday(&tv_end, NULL);
+    timeval_subtract(&diff, &tv_end, (struct timeval *) tv_start);
+
+    if(tune_step(&tuner[thr_id], hashes_done,
+      (uint)((hashes_done + throughput - 1) / throughput),
+      (double) diff.tv_sec + 1e-6 * diff.tv_usec, &c)) {
+        format_hashrate(c.hashrate, s);
+        gpulog(LOG_INFO, thr_id, "Tuned to intensity %g, %u CUDA threads, mode %u, %s",
+          throughput2intensity(c.throughput), c.throughput, c.mode, s);
+        tune_cache_put(tune_key[thr_id], c.throughput, c.mode, c.hashrate);
+    }
+
+    dev_threads[thr_id] = c.throughput;
+    dev_mode[thr_id] = c.mode;
+}
+
+/* Stores the speed measured with the settings of a device
+ * into the tuning cache, once they are tuned */
+extern "C" void neoscrypt_tune_update(int thr_id, double hashrate) {
+
+    if(tuner[thr_id] || !dev_threads[thr_id] || (hashrate <= 0.0))
+      return;
 
-    throughput = device_intensity(device_map[thr_id], __func__, throughput) / 2;
+    tune_cache_update(tune_key[thr_id], dev_threads[thr_id], dev_mode[thr_id],
+      hashrate);
+}
+
+/* Returns the number of nonces found, stored into nonces in ascending order;
+ * pdata[19] is set to the first of them */
+extern "C" int scanhash_neoscrypt(int thr_id, uint *pdata, const uint *ptarget,
+  uint max_nonce, uint64_t *hashes_done, uint *nonces, uint hash_mode) {
+    neoscrypt_device dev;
+    struct timeval tv_start;
+    uint throughput;
+    int rc;
+
+    if(opt_benchmark)
+      ((uint *) ptarget)[7] = 0x01FF;
 
     static bool init[MAX_GPUS] = { 0 };
 
     if(!init[thr_id]) {
+        uint threads = neoscrypt_setup(thr_id, hash_mode);
+
         cudaSetDevice(device_map[thr_id]);
         cudaDeviceReset();
         cudaSetDeviceFlags(cudaDeviceScheduleBlockingSync);
         cudaDeviceSetCacheConfig(cudaFuncCachePreferL1);
         cudaGetLastError();
 
-        gpulog(LOG_INFO, thr_id, "Intensity set to %g, %u CUDA threads",
-          throughput2intensity(throughput * 2), throughput * 2);
+        if(!tuner[thr_id])
+          gpulog(LOG_INFO, thr_id, "Intensity set to %g, %u CUDA threads, mode %u",
+            throughput2intensity(threads), threads, dev_mode[thr_id]);
 
-        cudaMalloc(&gmem[thr_id], 2 * 32768 * throughput);
-        cudaMalloc(&hash0[thr_id], 256 * throughput);
-        cudaMalloc(&hash1[thr_id], 256 * throughput);
-        cudaMalloc(&hash2[thr_id], 256 * throughput);
+        /* Sized for the largest batch, smaller ones use a part of it */
+        threads /= 2;
+        cudaMalloc(&gmem[thr_id], 2 * 32768 * threads);
+        cudaMalloc(&hash0[thr_id], 256 * threads);
+        cudaMalloc(&hash1[thr_id], 256 * threads);
+        cudaMalloc(&hash2[thr_id], 256 * threads);
 
         neoscrypt_init(thr_id, gmem[thr_id],
           hash0[thr_id], hash1[thr_id], hash2[thr_id]);
@@ -148,6 +189,13 @@ extern "C" int scanhash_neoscrypt(int thr_id, uint *pdata, const uint *ptarget,
         init[thr_id] = true;
     }
 
+    throughput = device_intensity(device_map[thr_id], __func__,
+      dev_threads[thr_id]) / 2;
+
+    if(tuner[thr_id])
+      max_nonce = (uint) MIN((ullong)max_nonce,
+        (ullong)pdata[19] + NEOSCRYPT_TUNE_BATCHES * throughput - 1);
+
     /* Input data must be little endian already */
 
     uint data[20];
@@ -158,36 +206,19 @@ extern "C" int scanhash_neoscrypt(int thr_id, uint *pdata, const uint *ptarget,
 
     neoscrypt_prehash(data, ptarget);
 
-    while(!work_restart[thr_id].restart &&
-     ((ullong)max_nonce > ((ullong)(pdata[19]) + (ullong)throughput))) {
-
-        foundNonce = neoscrypt_hash(thr_id, throughput, pdata[19], hash_mode);
-
-        if(foundNonce != 0xFFFFFFFF) {
-
-            if(opt_benchmark)
-              gpulog(LOG_INFO, thr_id, "nonce 0x%08X found", foundNonce);
-
-            uint vhash64[8];
-            data[19] = foundNonce;
-
-            neoscrypt((uchar *) data, (uchar *) vhash64);
-
-            if(vhash64[7] <= ptarget[7]) {
-                pdata[19] = foundNonce;
-                *hashes_done = foundNonce - first_nonce + 1;
-                return(1);
-            } else {
-                *hashes_done = foundNonce - first_nonce + 1;
-                gpulog(LOG_INFO, thr_id, "nonce 0x%08X fails CPU verification!", foundNonce);
-            }
+    dev.thr_id = thr_id;
+    dev.throughput = throughput;
+    dev.ctx = &dev_mode[thr_id];
+    dev.issue = neoscrypt_gpu_issue;
+    dev.wait = neoscrypt_gpu_wait;
 
-        }
+    gettimeofday(&tv_start, NULL);
 
-        pdata[19] += throughput;
+    /* Nonces found are verified on the CPU asynchronously, see verify.cpp */
+    rc = neoscrypt_pipeline_scan(&dev, pdata, max_nonce, hashes_done, nonces);
 
-    } 
+    if(tuner[thr_id])
+      neoscrypt_tune(thr_id, throughput, *hashes_done, &tv_start);
 
-    *hashes_done = pdata[19] - first_nonce + 1;
-    return(0);
+    return(rc);
 }
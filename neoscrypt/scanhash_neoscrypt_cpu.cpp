@@ -0,0 +1,74 @@
+#include <string.h>
+
+#include "../neoscrypt.h"
+
+#include "miner.h"
+#include "log.h"
+
+#include "neoscrypt_pipeline.h"
+
+/* Widest vector engine available */
+#define NEOSCRYPT_MAX_LANES 16
+
+/* CPU implementation of the pipeline device;
+ * a batch is hashed when issued, waiting only checks it */
+typedef struct neoscrypt_cpu_t {
+    neoscrypt_kdf_ctx kdf;
+    const uint *ptarget;
+    uint start[NEOSCRYPT_PIPELINE_DEPTH];
+    uint failed[NEOSCRYPT_PIPELINE_DEPTH];
+    uint hash[NEOSCRYPT_PIPELINE_DEPTH][NEOSCRYPT_MAX_LANES * 8];
+} neoscrypt_cpu;
+
+static void neoscrypt_cpu_issue(neoscrypt_device *dev, uint slot,
+  uint start_nonce) {
+    neoscrypt_cpu *cpu = (neoscrypt_cpu *) dev->ctx;
+
+    cpu->start[slot] = start_nonce;
+    cpu->failed[slot] = neoscrypt_nonce_xN(&cpu->kdf, start_nonce,
+      (uchar *) cpu->hash[slot], dev->throughput) != 0;
+}
+
+static uint neoscrypt_cpu_wait(neoscrypt_device *dev, uint slot, uint *nonces) {
+    neoscrypt_cpu *cpu = (neoscrypt_cpu *) dev->ctx;
+    uint count, i;
+
+    /* No scratchpad to hash with */
+    if(cpu->failed[slot])
+      return(NEOSCRYPT_PIPELINE_FAILED);
+
+    for(i = 0, count = 0; i < dev->throughput; i++) {
+        if(cpu->hash[slot][i * 8 + 7] <= cpu->ptarget[7]) {
+            if(count < MAX_NONCES)
+              nonces[count] = cpu->start[slot] + i;
+            count++;
+        }
+    }
+
+    return(count);
+}
+
+/* CPU miner backend, same interface as scanhash_neoscrypt();
+ * hashes neoscrypt_lanes() nonces at once through the vector engine,
+ * returns -1 if out of memory for the scratchpad */
+extern "C" int scanhash_neoscrypt_cpu(int thr_id, uint *pdata, const uint *ptarget,
+  uint max_nonce, uint64_t *hashes_done, uint *nonces, uint hash_mode) {
+    neoscrypt_device dev;
+    neoscrypt_cpu cpu;
+
+    if(opt_benchmark)
+      ((uint *) ptarget)[7] = 0x01FF;
+
+    /* Input data must be little endian already */
+
+    neoscrypt_kdf_prehash(&cpu.kdf, (uchar *) pdata);
+    cpu.ptarget = ptarget;
+
+    dev.thr_id = thr_id;
+    dev.throughput = MIN(neoscrypt_lanes(), NEOSCRYPT_MAX_LANES);
+    dev.ctx = &cpu;
+    dev.issue = neoscrypt_cpu_issue;
+    dev.wait = neoscrypt_cpu_wait;
+
+    return(neoscrypt_pipeline_scan(&dev, pdata, max_nonce, hashes_done, nonces));
+}
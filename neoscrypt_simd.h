@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2014-2016 John Doering <ghostlander@phoenixcoin.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Multi-lane NeoScrypt engine template;
+ * included by neoscrypt.c once per instruction set with the following defined:
+ *   NS_LANES       number of 32-bit lanes in a vector register;
+ *   NS_V           vector register type;
+ *   NS_I           prepared gather index type;
+ *   NS_TARGET      function attribute enabling the instruction set;
+ *   NS_FN(name)    instruction set specific function name;
+ *   NS_ADD(a, b), NS_XOR(a, b), NS_ROTL(a, b), NS_ROTL16(a), NS_ROTL8(a),
+ *   NS_ROTL24(a), NS_SET1(x), NS_LOAD(src), NS_STORE(dst, a),
+ *   NS_IDX(idx), NS_GATHER(base, vidx);
+ * every vector holds the same 32-bit word of NS_LANES independent hashes */
+
+
+/* Salsa20 of interleaved blocks, rounds must be a multiple of 2 */
+static NS_TARGET void NS_FN(neoscrypt_salsa)(NS_V *X, uint rounds) {
+    NS_V x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15, t;
+
+    x0 = X[0];   x1 = X[1];   x2 = X[2];   x3 = X[3];
+    x4 = X[4];   x5 = X[5];   x6 = X[6];   x7 = X[7];
+    x8 = X[8];   x9 = X[9];  x10 = X[10]; x11 = X[11];
+   x12 = X[12]; x13 = X[13]; x14 = X[14]; x15 = X[15];
+
+#define quarter(a, b, c, d) \
+    t = NS_ADD(a, d); t = NS_ROTL(t,  7); b = NS_XOR(b, t); \
+    t = NS_ADD(b, a); t = NS_ROTL(t,  9); c = NS_XOR(c, t); \
+    t = NS_ADD(c, b); t = NS_ROTL(t, 13); d = NS_XOR(d, t); \
+    t = NS_ADD(d, c); t = NS_ROTL(t, 18); a = NS_XOR(a, t);
+
+    for(; rounds; rounds -= 2) {
+        quarter( x0,  x4,  x8, x12);
+        quarter( x5,  x9, x13,  x1);
+        quarter(x10, x14,  x2,  x6);
+        quarter(x15,  x3,  x7, x11);
+        quarter( x0,  x1,  x2,  x3);
+        quarter( x5,  x6,  x7,  x4);
+        quarter(x10, x11,  x8,  x9);
+        quarter(x15, x12, x13, x14);
+    }
+
+    X[0]  = NS_ADD(X[0],  x0);  X[1]  = NS_ADD(X[1],  x1);
+    X[2]  = NS_ADD(X[2],  x2);  X[3]  = NS_ADD(X[3],  x3);
+    X[4]  = NS_ADD(X[4],  x4);  X[5]  = NS_ADD(X[5],  x5);
+    X[6]  = NS_ADD(X[6],  x6);  X[7]  = NS_ADD(X[7],  x7);
+    X[8]  = NS_ADD(X[8],  x8);  X[9]  = NS_ADD(X[9],  x9);
+    X[10] = NS_ADD(X[10], x10); X[11] = NS_ADD(X[11], x11);
+    X[12] = NS_ADD(X[12], x12); X[13] = NS_ADD(X[13], x13);
+    X[14] = NS_ADD(X[14], x14); X[15] = NS_ADD(X[15], x15);
+
+#undef quarter
+}
+
+/* ChaCha20 of interleaved blocks, rounds must be a multiple of 2 */
+static NS_TARGET void NS_FN(neoscrypt_chacha)(NS_V *X, uint rounds) {
+    NS_V x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15, t;
+
+    x0 = X[0];   x1 = X[1];   x2 = X[2];   x3 = X[3];
+    x4 = X[4];   x5 = X[5];   x6 = X[6];   x7 = X[7];
+    x8 = X[8];   x9 = X[9];  x10 = X[10]; x11 = X[11];
+   x12 = X[12]; x13 = X[13]; x14 = X[14]; x15 = X[15];
+
+#define quarter(a, b, c, d) \
+    a = NS_ADD(a, b); t = NS_XOR(d, a); d = NS_ROTL16(t); \
+    c = NS_ADD(c, d); t = NS_XOR(b, c); b = NS_ROTL(t, 12); \
+    a = NS_ADD(a, b); t = NS_XOR(d, a); d = NS_ROTL8(t); \
+    c = NS_ADD(c, d); t = NS_XOR(b, c); b = NS_ROTL(t,  7);
+
+    for(; rounds; rounds -= 2) {
+        quarter( x0,  x4,  x8, x12);
+        quarter( x1,  x5,  x9, x13);
+        quarter( x2,  x6, x10, x14);
+        quarter( x3,  x7, x11, x15);
+        quarter( x0,  x5, x10, x15);
+        quarter( x1,  x6, x11, x12);
+        quarter( x2,  x7,  x8, x13);
+        quarter( x3,  x4,  x9, x14);
+    }
+
+    X[0]  = NS_ADD(X[0],  x0);  X[1]  = NS_ADD(X[1],  x1);
+    X[2]  = NS_ADD(X[2],  x2);  X[3]  = NS_ADD(X[3],  x3);
+    X[4]  = NS_ADD(X[4],  x4);  X[5]  = NS_ADD(X[5],  x5);
+    X[6]  = NS_ADD(X[6],  x6);  X[7]  = NS_ADD(X[7],  x7);
+    X[8]  = NS_ADD(X[8],  x8);  X[9]  = NS_ADD(X[9],  x9);
+    X[10] = NS_ADD(X[10], x10); X[11] = NS_ADD(X[11], x11);
+    X[12] = NS_ADD(X[12], x12); X[13] = NS_ADD(X[13], x13);
+    X[14] = NS_ADD(X[14], x14); X[15] = NS_ADD(X[15], x15);
+
+#undef quarter
+}
+
+/* Interleaved block mixer, r = 2 only */
+static NS_TARGET void NS_FN(neoscrypt_blkmix)(NS_V *X, uint mixmode) {
+    uint mixer = mixmode >> 8, rounds = mixmode & 0xFF;
+    uint i;
+    NS_V t;
+
+    /* Xa ^= Xd; M(Xa'); Xb ^= Xa"; M(Xb'); Xc ^= Xb"; M(Xc'); Xd ^= Xc"; M(Xd');
+     * Xb" <-> Xc" */
+
+    for(i = 0; i < 16; i++)
+      X[i] = NS_XOR(X[i], X[i + 48]);
+    if(mixer) NS_FN(neoscrypt_chacha)(&X[0], rounds);
+    else      NS_FN(neoscrypt_salsa)(&X[0], rounds);
+
+    for(i = 16; i < 64; i += 16) {
+        uint j;
+
+        for(j = i; j < i + 16; j++)
+          X[j] = NS_XOR(X[j], X[j - 16]);
+        if(mixer) NS_FN(neoscrypt_chacha)(&X[i], rounds);
+        else      NS_FN(neoscrypt_salsa)(&X[i], rounds);
+    }
+
+    for(i = 16; i < 32; i++) {
+        t         = X[i];
+        X[i]      = X[i + 16];
+        X[i + 16] = t;
+    }
+}
+
+/* Interleaved SMix, r = 2 only;
+ * V = N * 64 vectors, memory-hard part with a per lane gather */
+static NS_TARGET void NS_FN(neoscrypt_smix)(NS_V *X, NS_V *V, uint N,
+  uint mixmode) {
+    uint i, j, l;
+    uint idx[NS_LANES];
+    NS_I vidx;
+
+    for(i = 0; i < N; i++) {
+        /* blkcpy(V, X) */
+        for(j = 0; j < 64; j++)
+          V[i * 64 + j] = X[j];
+        /* blkmix(X) */
+        NS_FN(neoscrypt_blkmix)(X, mixmode);
+    }
+
+    for(i = 0; i < N; i++) {
+        /* integerify(X) mod N of every lane turned into a word offset
+         * relative to V[0][w] */
+        NS_STORE(idx, X[48]);
+        for(l = 0; l < NS_LANES; l++)
+          idx[l] = (idx[l] & (N - 1)) * 64 * NS_LANES + l;
+        vidx = NS_IDX(idx);
+        /* blkxor(X, V) */
+        for(j = 0; j < 64; j++)
+          X[j] = NS_XOR(X[j], NS_GATHER((const uint *) &V[j], vidx));
+        /* blkmix(X) */
+        NS_FN(neoscrypt_blkmix)(X, mixmode);
+    }
+}
+
+/* NeoScrypt(128, 2, 1) mixing of NS_LANES FastKDF outputs at once;
+ * scratch must be 64-byte aligned and NS_LANES * NEOSCRYPT_LANE_SCRATCH bytes
+ * long, starts with the FastKDF outputs of 256 bytes each and gets
+ * the results in their place */
+static NS_TARGET void NS_FN(neoscrypt_lanes)(uchar *scratch) {
+    const uint N = 128, mixmode = 0x14;
+    uint *T, *x, i, l;
+    NS_V *X, *Z, *V;
+
+    /* T = NS_LANES * 64 words in plain order */
+    T = (uint *) scratch;
+    /* X and Z = 64 vectors each, interleaved */
+    X = (NS_V *) &T[NS_LANES * 64];
+    Z = &X[64];
+    /* V = N * 64 vectors */
+    V = &Z[64];
+    x = (uint *) X;
+
+    /* X = interleave(T) */
+    for(i = 0; i < 64; i++)
+      for(l = 0; l < NS_LANES; l++)
+        x[i * NS_LANES + l] = T[l * 64 + i];
+
+    /* Z = SMix(X) with ChaCha, X = SMix(X) with Salsa */
+    for(i = 0; i < 64; i++)
+      Z[i] = X[i];
+    NS_FN(neoscrypt_smix)(Z, V, N, mixmode | 0x0100);
+    NS_FN(neoscrypt_smix)(X, V, N, mixmode);
+
+    /* T = deinterleave(X ^ Z) */
+    for(i = 0; i < 64; i++)
+      X[i] = NS_XOR(X[i], Z[i]);
+    for(i = 0; i < 64; i++)
+      for(l = 0; l < NS_LANES; l++)
+        T[l * 64 + i] = x[i * NS_LANES + l];
+}
+
+/* BLAKE2s compression of NS_LANES independent states at once;
+ * t[1] and f[1] are zero, t[0] and f[0] are the same for every lane */
+static NS_TARGET void NS_FN(blake2s_compress)(NS_V *h, const NS_V *m,
+  uint t0, uint f0) {
+    NS_V v[16];
+    const uchar *s;
+    uint i;
+
+    for(i = 0; i < 8; i++)
+      v[i] = h[i];
+    for(i = 0; i < 4; i++)
+      v[i + 8] = NS_SET1(blake2s_IV[i]);
+    v[12] = NS_SET1(blake2s_IV[4] ^ t0);
+    v[13] = NS_SET1(blake2s_IV[5]);
+    v[14] = NS_SET1(blake2s_IV[6] ^ f0);
+    v[15] = NS_SET1(blake2s_IV[7]);
+
+/* Right rotations by 16, 12, 8 and 7 */
+#define G(a, b, c, d, x, y) \
+    a = NS_ADD(NS_ADD(a, b), x); d = NS_ROTL16(NS_XOR(d, a)); \
+    c = NS_ADD(c, d);            b = NS_ROTL(NS_XOR(b, c), 20); \
+    a = NS_ADD(NS_ADD(a, b), y); d = NS_ROTL24(NS_XOR(d, a)); \
+    c = NS_ADD(c, d);            b = NS_ROTL(NS_XOR(b, c), 25);
+
+    for(i = 0; i < 10; i++) {
+        s = blake2s_sigma[i];
+        G(v[0], v[4],  v[8], v[12], m[s[0]],  m[s[1]]);
+        G(v[1], v[5],  v[9], v[13], m[s[2]],  m[s[3]]);
+        G(v[2], v[6], v[10], v[14], m[s[4]],  m[s[5]]);
+        G(v[3], v[7], v[11], v[15], m[s[6]],  m[s[7]]);
+        G(v[0], v[5], v[10], v[15], m[s[8]],  m[s[9]]);
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G(v[2], v[7],  v[8], v[13], m[s[12]], m[s[13]]);
+        G(v[3], v[4],  v[9], v[14], m[s[14]], m[s[15]]);
+    }
+
+#undef G
+
+    for(i = 0; i < 8; i++)
+      h[i] = NS_XOR(h[i], NS_XOR(v[i], v[i + 8]));
+}
+
+/* FastKDF of NS_LANES buffer pairs at once from iteration i on;
+ * A and B of lane l are at l * 640 and l * 640 + 320 of kdf, every lane
+ * starts at the same bufptr and key_h as in neoscrypt_fastkdf_core(),
+ * output of lane l is at l * output_len */
+static NS_TARGET void NS_FN(neoscrypt_fastkdf)(uchar *kdf, uint bufptr,
+  uint i, const uint *key_h, uchar *output, uint output_len) {
+    uint ptr[NS_LANES], w[16 * NS_LANES], S[8];
+    const uint *src;
+    NS_V h[8], m[16];
+    uint k, l;
+
+    for(l = 0; l < NS_LANES; l++)
+      ptr[l] = bufptr;
+
+    for(; i < 32; i++) {
+
+        if(key_h) {
+            /* BLAKE2s: key compression done in advance */
+            for(k = 0; k < 8; k++)
+              h[k] = NS_SET1(key_h[k]);
+            key_h = NULL;
+        } else {
+            /* BLAKE2s: initialise and compress IV using key */
+            for(k = 0; k < 8; k++)
+              h[k] = NS_SET1(blake2s_IV_P_XOR[k]);
+            for(l = 0; l < NS_LANES; l++) {
+                src = (const uint *) &kdf[l * 640 + 320 + ptr[l]];
+                for(k = 0; k < 8; k++)
+                  w[k * NS_LANES + l] = src[k];
+            }
+            for(k = 0; k < 8; k++)
+              m[k] = NS_LOAD(&w[k * NS_LANES]);
+            for(k = 8; k < 16; k++)
+              m[k] = NS_SET1(0);
+            NS_FN(blake2s_compress)(h, m, 64, 0);
+        }
+
+        /* BLAKE2s: compress again using input */
+        for(l = 0; l < NS_LANES; l++) {
+            src = (const uint *) &kdf[l * 640 + ptr[l]];
+            for(k = 0; k < 16; k++)
+              w[k * NS_LANES + l] = src[k];
+        }
+        for(k = 0; k < 16; k++)
+          m[k] = NS_LOAD(&w[k * NS_LANES]);
+        NS_FN(blake2s_compress)(h, m, 128, ~0U);
+
+        for(k = 0; k < 8; k++)
+          NS_STORE(&w[k * NS_LANES], h[k]);
+        for(l = 0; l < NS_LANES; l++) {
+            for(k = 0; k < 8; k++)
+              S[k] = w[k * NS_LANES + l];
+            ptr[l] = neoscrypt_fastkdf_step(&kdf[l * 640 + 320], S);
+        }
+
+    }
+
+    for(l = 0; l < NS_LANES; l++)
+      neoscrypt_fastkdf_tail(&kdf[l * 640], &kdf[l * 640 + 320], ptr[l],
+        &output[l * output_len], output_len);
+}
@@ -0,0 +1,97 @@
+/**
+ * Stratum pool list
+ *
+ * Every pool given with -o is kept connected with a current job, so the
+ * pool mined can change at once: the first pool alive (failover), the
+ * next pool alive every few minutes (round-robin) or the pool furthest
+ * behind its quota of accepted shares (quota).
+ *
+ * The choice only sees the state of the pools, the miner applies it to
+ * the work (see pool_select), a test can drive it with local pools
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miner.h"
+#include "log.h"
+
+struct stratum_ctx pools[MAX_POOLS] = { 0 };
+int num_pools = 0;
+
+/**
+ * Add a pool to the list, backup pools must be stratum pools as the first
+ * @param quota int accepted shares of this pool for each share of a pool of quota 1
+ * @return bool false if the pool is ignored
+ */
+bool pool_add(const char *url, const char *user, const char *pass, int quota)
+{
+	struct stratum_ctx *pool;
+
+	if (num_pools == MAX_POOLS) {
+		applog(LOG_WARNING, "Too many pools, %s ignored", url);
+		return false;
+	}
+	if (num_pools && (strncasecmp(pools[0].url, "stratum", 7) ||
+	    strncasecmp(url, "stratum", 7))) {
+		applog(LOG_WARNING, "Backup pools must be stratum pools, %s ignored", url);
+		return false;
+	}
+
+	pool = &pools[num_pools];
+	pool->pooln = num_pools++;
+	pool->url = strdup(url);
+	pool->user = strdup(user);
+	pool->pass = strdup(pass);
+	pool->quota = quota;
+	return true;
+}
+
+/* Connected with a job to mine */
+bool pool_ready(struct stratum_ctx *pool)
+{
+	return stratum_is_online(pool) && pool->job.job_id;
+}
+
+/**
+ * Choose the pool to mine according to the strategy
+ * @param current struct stratum_ctx* pool mined until now
+ * @param rotate bool move on from the current pool (round-robin)
+ * @return struct stratum_ctx* NULL if no pool is ready
+ */
+struct stratum_ctx *pool_choose(struct stratum_ctx *current, int strategy, bool rotate)
+{
+	struct stratum_ctx *best = NULL, *pool;
+	int i;
+
+	switch (strategy) {
+	case POOL_ROUNDROBIN:
+		if (!rotate && pool_ready(current))
+			return current;
+		for (i = 1; i <= num_pools && !best; i++) {
+			pool = &pools[(current->pooln + i) % num_pools];
+			if (pool_ready(pool))
+				best = pool;
+		}
+		break;
+	case POOL_QUOTA:
+		/* the pool furthest behind its quota of accepted shares */
+		if (pool_ready(current))
+			best = current;
+		for (i = 0; i < num_pools; i++) {
+			pool = &pools[i];
+			if (pool_ready(pool) && (!best ||
+			    (uint64_t) pool->accepted * best->quota < (uint64_t) best->accepted * pool->quota))
+				best = pool;
+		}
+		break;
+	default:
+		/* the first pool alive */
+		for (i = 0; i < num_pools && !best; i++) {
+			if (pool_ready(&pools[i]))
+				best = &pools[i];
+		}
+		break;
+	}
+	return best;
+}
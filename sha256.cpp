@@ -170,13 +170,37 @@ static const uint32_t sha256d_hash1[16] = {
 	0x00000000, 0x00000000, 0x00000000, 0x00000100
 };
 
-void sha256d(unsigned char *hash, const unsigned char *data, int len)
+/*
+ * SHA-256 state after the whole 64 byte blocks of data;
+ * returns the number of bytes hashed
+ */
+int sha256_midstate(uint32_t *state, const unsigned char *data, int len)
+{
+	uint32_t T[16];
+	int i, off;
+
+	sha256_init(state);
+	for (off = 0; off + 64 <= len; off += 64) {
+		memcpy(T, data + off, 64);
+		for (i = 0; i < 16; i++)
+			T[i] = be32dec(T + i);
+		sha256_transform(state, T, 0);
+	}
+	return off;
+}
+
+/*
+ * Double SHA-256 of data resumed from the midstate of its first
+ * off bytes, see sha256_midstate()
+ */
+void sha256d_from(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int off, int len)
 {
 	uint32_t S[16], T[16];
 	int i, r;
 
-	sha256_init(S);
-	for (r = len; r > -9; r -= 64) {
+	memcpy(S, midstate, 32);
+	for (r = len - off; r > -9; r -= 64) {
 		if (r < 64)
 			memset(T, 0, 64);
 		memcpy(T, data + len - r, r > 64 ? 64 : (r < 0 ? 0 : r));
@@ -194,3 +218,11 @@ void sha256d(unsigned char *hash, const unsigned char *data, int len)
 	for (i = 0; i < 8; i++)
 		be32enc((uint32_t *)hash + i, T[i]);
 }
+
+void sha256d(unsigned char *hash, const unsigned char *data, int len)
+{
+	uint32_t S[8];
+
+	sha256_init(S);
+	sha256d_from(hash, S, data, 0, len);
+}
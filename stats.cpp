@@ -1,55 +1,187 @@
 /**
  * Stats place holder
  *
- * Note: this source is C++ (requires std::map)
+ * Each miner thread writes the stats of its scans into a ring of its own,
+ * the only writer of it: the average speed over the last opt_statsavg scans
+ * is kept up to date on each write and published as a single 64-bit word,
+ * so the readers (other miner threads, API) get it at once without a lock.
+ * The history is copied out of the rings, the records overwritten meanwhile
+ * are dropped
+ *
+ * Estimators on top: averages of the speed weighted by the time of the
+ * scans over 1, 5 and 15 minutes, percentiles of the last GPU batch times
+ * and the effective hashrate, from the targets of the accepted shares
  *
  * tpruvot@github 2014
  */
 #include <stdlib.h>
 #include <memory.h>
-#include <map>
+#include <math.h>
+#include <pthread.h>
 
 #include "miner.h"
 #include "log.h"
 
-static std::map<uint64_t, stats_data> tlastscans;
-static uint64_t uid = 0;
+/* scans remembered per thread, also the longest average */
+#define STATS_RING_SIZE 512
+/* GPU batch times the percentiles are taken from */
+#define STATS_BATCHES 128
+/* hashes of the accepted shares are kept per minute */
+#define STATS_SHARE_MINUTES 15
+
+const int stats_horizons[STATS_HORIZONS] = { 60, 300, 900 };
 
-#define STATS_PURGE_TIMEOUT 120*60
+struct stats_ring {
+    struct stats_data rec[STATS_RING_SIZE];
+    /* records written, published once the record is */
+    uint64_t head;
+    /* bits of the average speed, 0 without records */
+    uint64_t speed;
+    /* hash rates of the window, writer only */
+    double sum;
+    /* bits of the time weighted averages */
+    uint64_t ewma[STATS_HORIZONS];
+    /* the same from zero and the time they cover, writer only */
+    double ewma_zero[STATS_HORIZONS];
+    double scan_time;
+    float batch[STATS_BATCHES];
+    uint64_t batches;
+    /* under share_lock, the shares are accepted on the pool threads */
+    double share_hashes[STATS_SHARE_MINUTES];
+    uint32_t share_minute[STATS_SHARE_MINUTES];
+};
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ring_load(p) ((uint64_t) _InterlockedOr64((volatile __int64 *) (p), 0))
+#define ring_store(p, v) _InterlockedExchange64((volatile __int64 *) (p), (__int64) (v))
+#define ring_add(p, v) ((uint64_t) _InterlockedExchangeAdd64((volatile __int64 *) (p), (__int64) (v)))
+#define ring_fence() _ReadWriteBarrier()
+#else
+#define ring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v) __atomic_store_n((p), (uint64_t) (v), __ATOMIC_RELEASE)
+#define ring_add(p, v) __atomic_fetch_add((p), (uint64_t) (v), __ATOMIC_SEQ_CST)
+#define ring_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+static struct stats_ring *rings = NULL;
+static int nrings = 0;
+static uint64_t uid = 0;
+static time_t tm_start = 0;
+static pthread_mutex_t share_lock = PTHREAD_MUTEX_INITIALIZER;
 
 extern uint64_t global_hashrate;
 extern uint32_t opt_statsavg;
 
+static uint window(void) {
+    return(min(opt_statsavg, (uint32_t) STATS_RING_SIZE));
+}
+
 /**
- * Store speed per thread
+ * A double published by one thread, read by the others without a lock
+ * @param p uint64_t * holding its bits
+ */
+double stats_load_double(uint64_t *p) {
+    uint64_t bits = ring_load(p);
+    double v;
+
+    memcpy(&v, &bits, sizeof(v));
+    return(v);
+}
+
+void stats_store_double(uint64_t *p, double v) {
+    uint64_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+    ring_store(p, bits);
+}
+
+/**
+ * Allocate the rings, before the miner threads start
+ * @param threads int number of miner threads
+ */
+bool stats_init(int threads) {
+    rings = (struct stats_ring *) calloc(threads, sizeof(struct stats_ring));
+    if(!rings)
+      return(false);
+    nrings = threads;
+    tm_start = time(NULL);
+    return(true);
+}
+
+/**
+ * Store speed per thread, from the thread itself
  */
 void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate,
   uint8_t found, uint32_t height) {
-    const uint64_t key = uid++;
-    stats_data data;
+    struct stats_ring *ring;
+    struct stats_data *data;
+    uint64_t head, n, i;
+    uint w = window();
 
     if((hashcount < 1000) || (hashrate < 0.01))
       return;
 
-    memset(&data, 0, sizeof(data));
-    data.uid = (uint32_t) uid;
-    data.gpu_id = (uint8_t) device_map[thr_id];
-    data.thr_id = (uint8_t)thr_id;
-    data.tm_stat = (uint32_t) time(NULL);
-    data.height = height;
-    data.hashcount = hashcount;
-    data.hashfound = found;
-    data.hashrate = hashrate;
-    data.difficulty = global_diff;
-
-    if((opt_n_threads == 1) && (global_hashrate && uid > 10)) {
-        // prevent stats on too high vardiff (erroneous rates)
+    if(thr_id < 0 || thr_id >= nrings)
+      return;
+
+    n = ring_add(&uid, 1) + 1;
+    ring = &rings[thr_id];
+
+    /* every scan counts for its time, the short ones cut by a share
+     * and their erroneous rates hardly move the averages; started from
+     * zero, they are scaled up by the weight of the time covered so far */
+    ring->scan_time += (double) hashcount / hashrate;
+    for(i = 0; i < STATS_HORIZONS; i++) {
+        double a = 1.0 - exp(-((double) hashcount / hashrate) / stats_horizons[i]);
+        ring->ewma_zero[i] += a * (hashrate - ring->ewma_zero[i]);
+        stats_store_double(&ring->ewma[i], ring->ewma_zero[i] /
+          (1.0 - exp(-ring->scan_time / stats_horizons[i])));
+    }
+
+    // prevent stats on too high vardiff (erroneous rates)
+    if((opt_n_threads == 1) && (global_hashrate && n > 10)) {
         double ratio = (hashrate / (1.0 * global_hashrate));
         if((ratio < 0.4) || (ratio > 1.6))
-          data.ignored = 1;
+          return;
+    }
+
+    head = ring->head;
+    data = &ring->rec[head % STATS_RING_SIZE];
+
+    /* the record leaving the window, still in the ring */
+    if(w && head >= w)
+      ring->sum -= ring->rec[(head - w) % STATS_RING_SIZE].hashrate;
+
+    memset(data, 0, sizeof(*data));
+    data->uid = (uint32_t) n;
+    data->gpu_id = (uint8_t) device_map[thr_id];
+    data->thr_id = (uint8_t) thr_id;
+    data->tm_stat = (uint32_t) time(NULL);
+    data->height = height;
+    data->hashcount = hashcount;
+    data->hashfound = found;
+    data->hashrate = hashrate;
+    data->ewma = stats_load_double(&ring->ewma[0]);
+    data->difficulty = global_diff;
+    head++;
+
+    if(w) {
+        ring->sum += hashrate;
+        /* rounding errors of the running sum cleared once per ring */
+        if(!(head % STATS_RING_SIZE)) {
+            ring->sum = 0.0;
+            for(i = head - min(head, (uint64_t) w); i < head; i++)
+              ring->sum += ring->rec[i % STATS_RING_SIZE].hashrate;
+        }
+        stats_store_double(&ring->speed, ring->sum / (double) min(head, (uint64_t) w));
     }
 
-    tlastscans[key] = data;
+    ring_store(&ring->head, head);
+}
+
+static double ring_speed(int thr_id) {
+    return(stats_load_double(&rings[thr_id].speed));
 }
 
 /**
@@ -58,74 +190,226 @@ void stats_remember_speed(int thr_id, uint32_t hashcount, double hashrate,
  */
 double stats_get_speed(int thr_id, double def_speed) {
     double speed = 0.0;
-    uint records = 0;
-
-    std::map<uint64_t, stats_data>::reverse_iterator i = tlastscans.rbegin();
-    while((i != tlastscans.rend()) && (records < opt_statsavg)) {
-        if(!i->second.ignored && (thr_id == -1 || (i->second.thr_id == thr_id))) {
-            if(i->second.hashcount > 1000) {
-                speed += i->second.hashrate;
-                records++;
-            }
-        }
-        ++i;
-    }
+    int i;
 
-    if(records)
-      speed /= (double)(records);
-    else
-      speed = def_speed;
+    if(thr_id >= nrings)
+      return(def_speed);
+
+    if(thr_id >= 0)
+      speed = ring_speed(thr_id);
+    else for(i = 0; i < nrings; i++)
+      speed += ring_speed(i);
 
-    if(thr_id == -1)
-      speed *= (double)(opt_n_threads);
+    if(speed <= 0.0)
+      speed = def_speed;
 
     return(speed);
 }
 
+/* Copies the last records of a thread, newest first, returns their number */
+static int ring_copy(int thr_id, struct stats_data *data, int max_records) {
+    struct stats_ring *ring = &rings[thr_id];
+    const uint64_t last = ring_load(&ring->head);
+    uint64_t head;
+    int records = 0;
+
+    while(records < max_records && records < STATS_RING_SIZE && (uint64_t) records < last) {
+        memcpy(&data[records], &ring->rec[(last - records - 1) % STATS_RING_SIZE], sizeof(*data));
+        records++;
+    }
+
+    /* the writer may have gone over the oldest ones meanwhile */
+    ring_fence();
+    head = ring_load(&ring->head);
+    while(records && head - (last - records) >= STATS_RING_SIZE)
+      records--;
+
+    return(records);
+}
+
 /**
  * Export data for api calls
  */
 int stats_get_history(int thr_id, struct stats_data *data, int max_records) {
-    int records = 0;
+    struct stats_data *all;
+    int *count, *pos;
+    int records = 0, i, best;
+
+    if(thr_id >= nrings || max_records <= 0)
+      return(0);
+
+    if(thr_id >= 0)
+      return(ring_copy(thr_id, data, max_records));
+
+    /* all threads, merged by age */
+    all = (struct stats_data *) malloc(nrings * max_records * sizeof(*all));
+    count = (int *) calloc(2 * nrings, sizeof(int));
+    if(!all || !count) {
+        free(all);
+        free(count);
+        return(0);
+    }
+    pos = &count[nrings];
+
+    for(i = 0; i < nrings; i++)
+      count[i] = ring_copy(i, &all[i * max_records], max_records);
 
-    std::map<uint64_t, stats_data>::reverse_iterator i = tlastscans.rbegin();
-    while((i != tlastscans.rend()) && (records < max_records)) {
-        if((!i->second.ignored) && (thr_id == -1 || (i->second.thr_id == thr_id))) {
-            memcpy(&data[records], &(i->second), sizeof(struct stats_data));
-            records++;
+    while(records < max_records) {
+        best = -1;
+        for(i = 0; i < nrings; i++) {
+            if(pos[i] < count[i] && (best < 0 ||
+              all[i * max_records + pos[i]].uid > all[best * max_records + pos[best]].uid))
+              best = i;
         }
-        ++i;
+        if(best < 0)
+          break;
+        memcpy(&data[records++], &all[best * max_records + pos[best]++], sizeof(*data));
     }
 
+    free(all);
+    free(count);
     return(records);
 }
 
 /**
- * Remove old entries to reduce memory usage
+ * Store the time of a GPU batch, from the thread itself
  */
-void stats_purge_old(void) {
-    int deleted = 0;
-    uint32_t now = (uint32_t) time(NULL);
-    uint sz = (uint)tlastscans.size();
-
-    std::map<uint64_t, stats_data>::iterator i = tlastscans.begin();
-    while(i != tlastscans.end()) {
-        if(i->second.ignored || (now - i->second.tm_stat) > STATS_PURGE_TIMEOUT) {
-            deleted++;
-            tlastscans.erase(i++);
-        } else ++i;
+void stats_remember_batch(int thr_id, double seconds) {
+    struct stats_ring *ring;
+
+    if(thr_id < 0 || thr_id >= nrings)
+      return;
+
+    ring = &rings[thr_id];
+    ring->batch[ring->batches % STATS_BATCHES] = (float) seconds;
+    ring_store(&ring->batches, ring->batches + 1);
+}
+
+/**
+ * Store an accepted share
+ * @param thr_id int of the thread which found it
+ * @param hashes double expected for its target, see target_to_hashes
+ */
+void stats_remember_share(int thr_id, double hashes) {
+    uint32_t minute = (uint32_t) (time(NULL) / 60);
+    struct stats_ring *ring;
+    int i = minute % STATS_SHARE_MINUTES;
+
+    if(thr_id < 0 || thr_id >= nrings)
+      return;
+
+    ring = &rings[thr_id];
+    pthread_mutex_lock(&share_lock);
+    if(ring->share_minute[i] != minute) {
+        ring->share_minute[i] = minute;
+        ring->share_hashes[i] = 0.0;
     }
+    ring->share_hashes[i] += hashes;
+    pthread_mutex_unlock(&share_lock);
+}
+
+/* Hashes per second the accepted shares stand for */
+static double ring_effective(struct stats_ring *ring, int horizon, time_t now) {
+    const uint32_t minute = (uint32_t) (now / 60);
+    const uint32_t minutes = horizon / 60;
+    double hashes = 0.0, span;
+    int i;
 
-    if(opt_debug && deleted)
-      applog(LOG_DEBUG, "stats: %d/%d records purged", deleted, sz);
+    pthread_mutex_lock(&share_lock);
+    for(i = 0; i < STATS_SHARE_MINUTES; i++) {
+        if(ring->share_minute[i] <= minute && minute - ring->share_minute[i] < minutes)
+          hashes += ring->share_hashes[i];
+    }
+    pthread_mutex_unlock(&share_lock);
+
+    /* the minutes before and the current one so far, since the start */
+    span = (double) ((minutes - 1) * 60 + now % 60 + 1);
+    span = min(span, (double) (now - tm_start + 1));
+
+    return(hashes / span);
+}
+
+static int cmp_float(const void *a, const void *b) {
+    const float x = *(const float *) a, y = *(const float *) b;
+
+    return((x > y) - (x < y));
+}
+
+/* Nearest rank percentile of sorted values */
+static double percentile(const float *v, int n, double p) {
+    int i = (int) ceil(p * n) - 1;
+
+    if(!n)
+      return(0.0);
+
+    return(v[max(i, 0)]);
+}
+
+/**
+ * Get the estimators of a thread
+ * @param thr_id int (-1 for all threads, the rates added up)
+ * @return bool false for an unknown thread
+ */
+bool stats_get_estimate(int thr_id, struct stats_estimate *est) {
+    const time_t now = time(NULL);
+    int first = thr_id, last = thr_id, t, h, n = 0;
+    float *batch;
+
+    memset(est, 0, sizeof(*est));
+    if(thr_id >= nrings || thr_id < -1)
+      return(false);
+
+    if(thr_id < 0) {
+        first = 0;
+        last = nrings - 1;
+    }
+
+    batch = (float *) malloc((last - first + 1) * STATS_BATCHES * sizeof(float));
+    for(t = first; t <= last; t++) {
+        struct stats_ring *ring = &rings[t];
+        uint64_t count = min(ring_load(&ring->batches), (uint64_t) STATS_BATCHES);
+
+        for(h = 0; h < STATS_HORIZONS; h++) {
+            est->ewma[h] += stats_load_double(&ring->ewma[h]);
+            est->effective[h] += ring_effective(ring, stats_horizons[h], now);
+        }
+        if(batch) {
+            memcpy(&batch[n], ring->batch, count * sizeof(float));
+            n += (int) count;
+        }
+    }
+
+    if(batch) {
+        qsort(batch, n, sizeof(float), cmp_float);
+        est->batch_p50 = percentile(batch, n, 0.50);
+        est->batch_p95 = percentile(batch, n, 0.95);
+        free(batch);
+    }
+
+    return(true);
 }
 
 /**
- * Reset the cache
+ * Reset the cache, the miner threads stopped
  */
 void stats_purge_all(void)
 {
-	tlastscans.clear();
+	int i;
+
+	for (i = 0; i < nrings; i++) {
+		ring_store(&rings[i].head, 0);
+		ring_store(&rings[i].speed, 0);
+		rings[i].sum = 0.0;
+		for (int h = 0; h < STATS_HORIZONS; h++) {
+			ring_store(&rings[i].ewma[h], 0);
+			rings[i].ewma_zero[h] = 0.0;
+		}
+		rings[i].scan_time = 0.0;
+		ring_store(&rings[i].batches, 0);
+		pthread_mutex_lock(&share_lock);
+		memset(rings[i].share_hashes, 0, sizeof(rings[i].share_hashes));
+		pthread_mutex_unlock(&share_lock);
+	}
 }
 
 /**
@@ -133,6 +417,10 @@ void stats_purge_all(void)
  */
 void stats_getmeminfo(uint64_t *mem, uint32_t *records)
 {
-	(*records) = (uint)tlastscans.size();
-	(*mem) = (*records) * sizeof(stats_data);
+	int i;
+
+	(*records) = 0;
+	for (i = 0; i < nrings; i++)
+		(*records) += (uint32_t) min(ring_load(&rings[i].head), (uint64_t) STATS_RING_SIZE);
+	(*mem) = (uint64_t) nrings * sizeof(struct stats_ring);
 }
@@ -0,0 +1,242 @@
+/*
+ * Checks the NeoScrypt engines against each other:
+ * neoscrypt() against known answers, the first one being the test vector
+ * of the reference implementation,
+ * the multi-lane neoscrypt_xN() and neoscrypt_nonce_xN() against neoscrypt()
+ * for a corpus of headers and batch sizes around the lane count;
+ * on Linux, the scratchpad arena given back after a large profile
+ * and errors returned when out of address space
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+#include "neoscrypt.h"
+
+/* NeoScrypt(128, 2, 1) of the headers made by kat_header() */
+static const uchar kat_digest[4][32] = {
+    {
+      0x72, 0x58, 0x96, 0x1A, 0xFB, 0x33, 0xFD, 0x12,
+      0xD0, 0x0C, 0xAC, 0xB8, 0xD6, 0x3F, 0x4F, 0x4F,
+      0x52, 0xBB, 0x69, 0x17, 0x04, 0x38, 0x65, 0xDD,
+      0x24, 0xA0, 0x8F, 0x57, 0x88, 0x53, 0x12, 0x2D,
+    },
+    {
+      0x3A, 0xD3, 0xD0, 0x2E, 0x81, 0x7D, 0x78, 0x3A,
+      0xD2, 0xA3, 0xF1, 0x37, 0x9B, 0x52, 0x1E, 0x15,
+      0xEA, 0x4B, 0x35, 0x67, 0x4B, 0xA0, 0x8D, 0x4C,
+      0x03, 0xC1, 0x33, 0x4A, 0xDA, 0x65, 0xCE, 0xCD,
+    },
+    {
+      0x7A, 0x8D, 0x4C, 0xF3, 0xE1, 0x6E, 0xC9, 0x8B,
+      0x73, 0xE7, 0x01, 0xA2, 0xCA, 0x9D, 0x0A, 0x3C,
+      0x23, 0xAC, 0x04, 0x9B, 0x88, 0x6A, 0x70, 0xA9,
+      0xAC, 0x65, 0x7C, 0x75, 0x85, 0xAB, 0xCC, 0x81,
+    },
+    {
+      0x49, 0x67, 0x12, 0x1D, 0x00, 0x9C, 0x05, 0x80,
+      0x78, 0x11, 0xA3, 0x36, 0x90, 0xDA, 0x50, 0xA9,
+      0x37, 0x22, 0xDE, 0xDB, 0x44, 0x0F, 0x58, 0xC1,
+      0xD6, 0x00, 0x93, 0x3E, 0xDE, 0x91, 0x33, 0xC6,
+    },
+};
+
+/* Headers of the corpus, at most 4 groups of 16 lanes and a remainder */
+#define CORPUS_SIZE 67
+
+static uchar corpus[CORPUS_SIZE * 80];
+static uchar expected[CORPUS_SIZE * 32];
+static uchar output[CORPUS_SIZE * 32];
+
+static uint failures = 0;
+
+static uint corpus_seed = 0x4E656F53;
+
+static uint corpus_rand(void) {
+
+    corpus_seed ^= corpus_seed << 13;
+    corpus_seed ^= corpus_seed >> 17;
+    corpus_seed ^= corpus_seed << 5;
+
+    return(corpus_seed);
+}
+
+static void kat_header(uint k, uchar *header) {
+    uint i;
+
+    for(i = 0; i < 80; i++)
+      header[i] = (uchar)(i * (2 * k + 1) + k);
+}
+
+static void check(const char *what, uint count, uint index,
+  const uchar *digest, const uchar *ref) {
+
+    if(!memcmp(digest, ref, 32))
+      return;
+
+    printf("FAIL: %s, batch of %u, hash %u\n", what, count, index);
+    failures++;
+}
+
+static void test_kat(void) {
+    uchar header[80], digest[32];
+    uint k;
+
+    for(k = 0; k < 4; k++) {
+        kat_header(k, header);
+        neoscrypt(header, digest);
+        check("neoscrypt()", 1, k, digest, kat_digest[k]);
+        neoscrypt_profile(header, digest, 0);
+        check("neoscrypt_profile()", 1, k, digest, kat_digest[k]);
+    }
+}
+
+static void test_xN(uint lanes) {
+    uint count, i;
+
+    for(count = 0; count <= CORPUS_SIZE; count++) {
+        /* Every size up to 2 groups, then a few around the corpus size */
+        if((count > 2 * lanes + 1) && (count + lanes + 1 < CORPUS_SIZE))
+          continue;
+        memset(output, 0, sizeof(output));
+        neoscrypt_xN(corpus, output, count);
+        for(i = 0; i < count; i++)
+          check("neoscrypt_xN()", count, i, &output[i * 32], &expected[i * 32]);
+    }
+}
+
+static void test_nonce_xN(uint lanes, uint nonce) {
+    const uint counts[6] = { 1, lanes - 1, lanes, lanes + 1, 2 * lanes, CORPUS_SIZE };
+    neoscrypt_kdf_ctx ctx;
+    uchar header[80];
+    uint count, i, j, n;
+
+    memcpy(header, corpus, 80);
+    neoscrypt_kdf_prehash(&ctx, header);
+
+    for(i = 0; i < CORPUS_SIZE; i++) {
+        n = nonce + i;
+        memcpy(&header[76], &n, 4);
+        neoscrypt(header, &expected[i * 32]);
+    }
+
+    for(j = 0; j < 6; j++) {
+        count = counts[j];
+        memset(output, 0, sizeof(output));
+        neoscrypt_nonce_xN(&ctx, nonce, output, count);
+        for(i = 0; i < count; i++)
+          check("neoscrypt_nonce_xN()", count, i, &output[i * 32], &expected[i * 32]);
+    }
+
+    for(i = 0; i < 4; i++) {
+        neoscrypt_nonce(&ctx, nonce + i, output);
+        check("neoscrypt_nonce()", 1, i, output, &expected[i * 32]);
+    }
+}
+
+#if defined(__linux__)
+
+/* NeoScrypt(262144, 2, 1) with FastKDF, a scratchpad of 64MB */
+#define ARENA_PROFILE (0x80000000 | (17 << 8) | (1 << 5))
+#define ARENA_SLACK   (16 << 20)
+
+static void check_rc(const char *what, int rc, int expected) {
+
+    if(rc == expected)
+      return;
+
+    printf("FAIL: %s returned %d, %d expected\n", what, rc, expected);
+    failures++;
+}
+
+/* Address space of the process in bytes */
+static ullong vm_size(void) {
+    unsigned long pages = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%lu", &pages) != 1)
+          pages = 0;
+        fclose(f);
+    }
+
+    return((ullong)pages * 4096);
+}
+
+static void vm_limit(ullong size) {
+    struct rlimit rl;
+
+    getrlimit(RLIMIT_AS, &rl);
+    rl.rlim_cur = size ? (rlim_t)size : rl.rlim_max;
+    setrlimit(RLIMIT_AS, &rl);
+}
+
+static void test_arena(uint lanes) {
+    uchar header[80], digest[32];
+    ullong before, after;
+
+    kat_header(0, header);
+
+    before = vm_size();
+    check_rc("neoscrypt_profile() of 64MB", neoscrypt_profile(header, digest, ARENA_PROFILE), 0);
+    after = vm_size();
+    if(after > before + ARENA_SLACK) {
+        printf("FAIL: arena of %lluKB kept after neoscrypt_profile()\n",
+          (after - before) >> 10);
+        failures++;
+    }
+
+    /* Not enough address space for the profile, the arena is given back */
+    vm_limit(vm_size() + ARENA_SLACK);
+    check_rc("neoscrypt_profile() out of memory",
+      neoscrypt_profile(header, digest, ARENA_PROFILE), -1);
+
+    /* Nor for the default arena then */
+    vm_limit(vm_size());
+    check_rc("neoscrypt() out of memory", neoscrypt(header, digest), -1);
+    check_rc("neoscrypt_xN() out of memory", neoscrypt_xN(corpus, output, lanes + 1), -1);
+    check_rc("neoscrypt_profile(0) out of memory", neoscrypt_profile(header, digest, 0), -1);
+
+    vm_limit(0);
+    memset(digest, 0, sizeof(digest));
+    check_rc("neoscrypt() after out of memory", neoscrypt(header, digest), 0);
+    check("neoscrypt() after out of memory", 1, 0, digest, kat_digest[0]);
+}
+
+#endif
+
+int main(void) {
+    uint lanes = neoscrypt_lanes();
+    uint i;
+
+    printf("NeoScrypt engine of %u lanes\n", lanes);
+
+    for(i = 0; i < CORPUS_SIZE * 80; i += 4) {
+        uint r = corpus_rand();
+        memcpy(&corpus[i], &r, 4);
+    }
+    for(i = 0; i < CORPUS_SIZE; i++)
+      neoscrypt(&corpus[i * 80], &expected[i * 32]);
+
+    test_kat();
+    test_xN(lanes);
+    test_nonce_xN(lanes, 0x12345678);
+    /* The nonce wraps around within a batch */
+    test_nonce_xN(lanes, 0xFFFFFFF0);
+#if defined(__linux__)
+    test_arena(lanes);
+#endif
+
+    if(failures) {
+        printf("%u checks failed\n", failures);
+        return(1);
+    }
+
+    printf("All hashes match\n");
+    return(0);
+}
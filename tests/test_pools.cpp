@@ -0,0 +1,326 @@
+/**
+ * Pool strategies test
+ *
+ * Fake pools on local sockets give a job to the stratum client of
+ * util.cpp, and are brought down and up again while the pool to mine is
+ * chosen with each strategy: failover, round-robin and quota.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "miner.h"
+#include "log.h"
+
+bool opt_debug = false;
+bool opt_quiet = true;
+bool opt_protocol = false;
+int opt_timeout = 300;
+bool have_longpoll = false;
+bool want_stratum = true;
+bool have_stratum = true;
+char *opt_cert = NULL;
+char *opt_proxy = NULL;
+long opt_proxy_type = -1;
+struct thr_info *thr_info = NULL;
+int longpoll_thr_id = -1;
+int stratum_thr_id = -1;
+uint64_t global_hashrate = 0;
+double global_diff = 0.;
+
+void applog(int prio, const char *fmt, ...)
+{
+}
+
+#define FAKE_POOLS 3
+
+#define test_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define test_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+struct fake_pool {
+	pthread_t pth;
+	int listen;
+	/* connection of the client, -1 if none */
+	int fd;
+	int port;
+};
+
+static struct fake_pool fake[FAKE_POOLS];
+static int failures = 0;
+
+static void fake_answer(int fd, const char *fmt, ...)
+{
+	char line[512];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (write(fd, line, len) != len)
+		printf("fake pool write failed\n");
+}
+
+/* Subscribes and authorizes every client, then gives it a job */
+static void *fake_pool_thread(void *userdata)
+{
+	struct fake_pool *fp = (struct fake_pool *) userdata;
+	char line[1024];
+	int fd, jobs = 0;
+	FILE *in;
+
+	while ((fd = accept(fp->listen, NULL, NULL)) >= 0) {
+		test_store(&fp->fd, fd);
+		in = fdopen(dup(fd), "r");
+		while (fgets(line, sizeof(line), in)) {
+			json_t *val = JSON_LOADS(line, NULL);
+			const char *method = json_string_value(json_object_get(val, "method"));
+			int id = (int) json_integer_value(json_object_get(val, "id"));
+
+			if (method && !strcmp(method, "mining.subscribe")) {
+				fake_answer(fd, "{\"id\":%d,\"result\":[[[\"mining.notify\",\"1\"]],"
+					"\"08000002\",4],\"error\":null}\n", id);
+			} else if (method && !strcmp(method, "mining.authorize")) {
+				fake_answer(fd, "{\"id\":%d,\"result\":true,\"error\":null}\n", id);
+				fake_answer(fd, "{\"id\":null,\"method\":\"mining.notify\",\"params\":"
+					"[\"%x\",\"%064x\",\"01000000\",\"ffffffff\",[],\"00000007\","
+					"\"1d00ffff\",\"5f5e1000\",true]}\n", ++jobs, fp->port);
+			}
+			if (val)
+				json_decref(val);
+		}
+		test_store(&fp->fd, -1);
+		fclose(in);
+		close(fd);
+	}
+	return NULL;
+}
+
+static bool fake_pool_start(struct fake_pool *fp)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fp->listen = socket(AF_INET, SOCK_STREAM, 0);
+	fp->fd = -1;
+	if (bind(fp->listen, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fp->listen, 1) ||
+	    getsockname(fp->listen, (struct sockaddr *) &addr, &len))
+		return false;
+	fp->port = ntohs(addr.sin_port);
+	return !pthread_create(&fp->pth, NULL, fake_pool_thread, fp);
+}
+
+/* Connect to a fake pool until it gives a job, as stratum_thread does */
+static void pool_up(int n)
+{
+	struct stratum_ctx *pool = &pools[n];
+	char *s;
+
+	if (!stratum_connect(pool, pool->url) || !stratum_subscribe(pool) ||
+	    !stratum_authorize(pool, pool->user, pool->pass, false) || !stratum_online(pool)) {
+		printf("FAIL: connection to pool %d\n", n);
+		failures++;
+		return;
+	}
+	while (!pool_ready(pool) && (s = stratum_next_line(pool, 5)))
+		stratum_handle_method(pool, s);
+	if (!pool_ready(pool)) {
+		printf("FAIL: no job from pool %d\n", n);
+		failures++;
+	}
+}
+
+/* The fake pool drops the connection, the client sees it */
+static void pool_down(int n)
+{
+	struct stratum_ctx *pool = &pools[n];
+	int fd = test_load(&fake[n].fd);
+
+	if (fd >= 0)
+		shutdown(fd, SHUT_RDWR);
+	while (stratum_next_line(pool, 5))
+		;
+	stratum_disconnect(pool);
+	if (pool_ready(pool)) {
+		printf("FAIL: pool %d still ready once down\n", n);
+		failures++;
+	}
+}
+
+static void expect(const char *what, struct stratum_ctx *got, struct stratum_ctx *want)
+{
+	if (got == want)
+		return;
+	printf("FAIL: %s, pool %d chosen instead of pool %d\n", what,
+		got ? got->pooln : -1, want ? want->pooln : -1);
+	failures++;
+}
+
+static void test_add(void)
+{
+	char url[64];
+	int i;
+
+	/* a getwork pool has no backup */
+	if (!pool_add("http://127.0.0.1:9", "u", "x", 1) ||
+	    pool_add("stratum+tcp://127.0.0.1:9", "u", "x", 1) || num_pools != 1) {
+		printf("FAIL: stratum backup of a getwork pool\n");
+		failures++;
+	}
+	num_pools = 0;
+
+	for (i = 0; i < MAX_POOLS; i++) {
+		snprintf(url, sizeof(url), "stratum+tcp://127.0.0.1:%d", i + 1);
+		if (!pool_add(url, "u", "x", i + 1) || pools[i].pooln != i || pools[i].quota != i + 1) {
+			printf("FAIL: pool %d not added\n", i);
+			failures++;
+		}
+	}
+	if (pool_add("stratum+tcp://127.0.0.1:9", "u", "x", 1) || num_pools != MAX_POOLS) {
+		printf("FAIL: more than %d pools\n", MAX_POOLS);
+		failures++;
+	}
+	num_pools = 0;
+
+	if (pool_add("stratum+tcp://127.0.0.1:9", "u", "x", 1) &&
+	    pool_add("http://127.0.0.1:9", "u", "x", 1)) {
+		printf("FAIL: getwork backup of a stratum pool\n");
+		failures++;
+	}
+	num_pools = 0;
+}
+
+static void test_failover(void)
+{
+	expect("failover, all pools up", pool_choose(&pools[2], POOL_FAILOVER, false), &pools[0]);
+	pool_down(0);
+	expect("failover, first pool down", pool_choose(&pools[0], POOL_FAILOVER, false), &pools[1]);
+	pool_down(1);
+	expect("failover, last pool left", pool_choose(&pools[1], POOL_FAILOVER, false), &pools[2]);
+	pool_up(0);
+	expect("failover, first pool back", pool_choose(&pools[2], POOL_FAILOVER, false), &pools[0]);
+	pool_down(0);
+	pool_down(2);
+	expect("failover, all pools down", pool_choose(&pools[2], POOL_FAILOVER, false), NULL);
+	pool_up(0);
+	pool_up(1);
+	pool_up(2);
+}
+
+static void test_roundrobin(void)
+{
+	expect("round-robin, kept", pool_choose(&pools[0], POOL_ROUNDROBIN, false), &pools[0]);
+	expect("round-robin, rotated", pool_choose(&pools[0], POOL_ROUNDROBIN, true), &pools[1]);
+	expect("round-robin, rotated again", pool_choose(&pools[1], POOL_ROUNDROBIN, true), &pools[2]);
+	expect("round-robin, wrapped", pool_choose(&pools[2], POOL_ROUNDROBIN, true), &pools[0]);
+	pool_down(1);
+	expect("round-robin, pool down skipped", pool_choose(&pools[0], POOL_ROUNDROBIN, true), &pools[2]);
+	expect("round-robin, current pool down", pool_choose(&pools[1], POOL_ROUNDROBIN, false), &pools[2]);
+	pool_down(2);
+	expect("round-robin, only pool left", pool_choose(&pools[0], POOL_ROUNDROBIN, true), &pools[0]);
+	pool_up(1);
+	pool_up(2);
+}
+
+/* Mine shares with the pool chosen at each one */
+static void quota_run(int shares)
+{
+	struct stratum_ctx *pool = &pools[0];
+	int i;
+
+	for (i = 0; i < shares; i++) {
+		pool = pool_choose(pool, POOL_QUOTA, true);
+		if (!pool) {
+			printf("FAIL: quota, no pool chosen\n");
+			failures++;
+			return;
+		}
+		pool->accepted++;
+	}
+}
+
+static void test_quota(void)
+{
+	uint32_t before[FAKE_POOLS];
+	int i;
+
+	/* quotas 1, 1, 2 */
+	quota_run(400);
+	if (pools[0].accepted != 100 || pools[1].accepted != 100 || pools[2].accepted != 200) {
+		printf("FAIL: quota, shares %u %u %u instead of 100 100 200\n",
+			pools[0].accepted, pools[1].accepted, pools[2].accepted);
+		failures++;
+	}
+
+	/* the other pools share the work of a pool down */
+	pool_down(2);
+	for (i = 0; i < FAKE_POOLS; i++)
+		before[i] = pools[i].accepted;
+	quota_run(100);
+	if (pools[0].accepted - before[0] != 50 || pools[1].accepted - before[1] != 50 ||
+	    pools[2].accepted != before[2]) {
+		printf("FAIL: quota, pool 2 down, shares %u %u %u instead of 50 50 0\n",
+			pools[0].accepted - before[0], pools[1].accepted - before[1],
+			pools[2].accepted - before[2]);
+		failures++;
+	}
+
+	/* a pool back up catches up with its quota */
+	pool_up(2);
+	for (i = 0; i < FAKE_POOLS; i++)
+		before[i] = pools[i].accepted;
+	quota_run(100);
+	if (pools[2].accepted - before[2] != 100) {
+		printf("FAIL: quota, pool 2 back, %u shares instead of 100\n",
+			pools[2].accepted - before[2]);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	char url[64];
+	int i;
+
+	test_add();
+
+	for (i = 0; i < FAKE_POOLS; i++) {
+		if (!fake_pool_start(&fake[i])) {
+			printf("fake pool socket failed\n");
+			return 1;
+		}
+		snprintf(url, sizeof(url), "stratum+tcp://127.0.0.1:%d", fake[i].port);
+		pool_add(url, "u", "x", i < 2 ? 1 : 2);
+		pthread_mutex_init(&pools[i].sock_lock, NULL);
+		pthread_mutex_init(&pools[i].share_lock, NULL);
+		pthread_mutex_init(&pools[i].work_lock, NULL);
+	}
+	curl_global_init(CURL_GLOBAL_ALL & ~CURL_GLOBAL_SSL);
+
+	for (i = 0; i < FAKE_POOLS; i++)
+		pool_up(i);
+	if (failures)
+		return 1;
+
+	test_failover();
+	test_roundrobin();
+	test_quota();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("Pools chosen as each strategy asks with %d local pools\n", FAKE_POOLS);
+	return 0;
+}
@@ -0,0 +1,300 @@
+/**
+ * Stratum share tracking test
+ *
+ * A fake pool on a local socket subscribes and authorizes the client of
+ * util.cpp, then answers the mining.submit lines it gets in batches, the
+ * last one first, accepting the even nonces. Some shares are never
+ * answered. Every answer must be matched to its own share with its own
+ * submit time, whatever the number of shares in flight. A share sent by
+ * another thread must wake the event loop up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "miner.h"
+#include "log.h"
+
+bool opt_debug = false;
+bool opt_quiet = true;
+bool opt_protocol = false;
+int opt_timeout = 300;
+bool have_longpoll = false;
+bool want_stratum = true;
+bool have_stratum = true;
+char *opt_cert = NULL;
+char *opt_proxy = NULL;
+long opt_proxy_type = -1;
+struct thr_info *thr_info = NULL;
+int longpoll_thr_id = -1;
+int stratum_thr_id = -1;
+uint64_t global_hashrate = 0;
+double global_diff = 0.;
+
+void applog(int prio, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (prio > LOG_WARNING)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	fputc('\n', stdout);
+	va_end(ap);
+}
+
+/* nonces the fake pool never answers */
+#define SILENT 0x80000000U
+
+struct submit {
+	uint32_t id;
+	uint32_t nonce;
+};
+
+static int pool_listen;
+/* submits the fake pool answers at once */
+static volatile int pool_batch = 1;
+static int failures = 0;
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (failures++ >= 10)
+		return;
+	printf("FAIL: ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+}
+
+static void pool_answer(int fd, const char *fmt, ...)
+{
+	char line[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (write(fd, line, len) != len)
+		fail("fake pool write");
+}
+
+static void *pool_thread(void *userdata)
+{
+	struct submit *pending = (struct submit *) malloc(8192 * sizeof(*pending));
+	int count = 0, fd;
+	char line[1024];
+	FILE *in;
+
+	while ((fd = accept(pool_listen, NULL, NULL)) >= 0) {
+		in = fdopen(dup(fd), "r");
+		count = 0;
+		while (fgets(line, sizeof(line), in)) {
+			json_t *val = JSON_LOADS(line, NULL);
+			const char *method = json_string_value(json_object_get(val, "method"));
+			json_int_t id = json_integer_value(json_object_get(val, "id"));
+
+			if (method && !strcmp(method, "mining.subscribe")) {
+				pool_answer(fd, "{\"id\":%d,\"result\":[[[\"mining.notify\",\"1\"]],"
+					"\"08000002\",4],\"error\":null}\n", (int) id);
+			} else if (method && !strcmp(method, "mining.authorize")) {
+				pool_answer(fd, "{\"id\":%d,\"result\":true,\"error\":null}\n", (int) id);
+			} else if (method && !strcmp(method, "mining.submit")) {
+				const char *hex = json_string_value(json_array_get(json_object_get(val, "params"), 4));
+				uint32_t nonce = hex ? (uint32_t) strtoul(hex, NULL, 16) : 0;
+				if (!(nonce & SILENT)) {
+					pending[count].id = (uint32_t) id;
+					pending[count++].nonce = nonce;
+				}
+				if (count >= pool_batch) {
+					while (count--) {
+						struct submit *s = &pending[count];
+						if (s->nonce & 1)
+							pool_answer(fd, "{\"id\":%u,\"result\":false,"
+								"\"error\":[23,\"Low difficulty share\",null]}\n", s->id);
+						else
+							pool_answer(fd, "{\"id\":%u,\"result\":true,\"error\":null}\n", s->id);
+					}
+					count = 0;
+				}
+			}
+			if (val)
+				json_decref(val);
+		}
+		fclose(in);
+		close(fd);
+	}
+	free(pending);
+	return NULL;
+}
+
+static void send_share(struct stratum_ctx *sctx, uint32_t nonce)
+{
+	struct work work;
+	char s[256];
+	uint32_t id;
+
+	memset(&work, 0, sizeof(work));
+	work.data[19] = nonce;
+	work.target[7] = 0x0000ffff;
+	id = stratum_share_sent(sctx, &work);
+	sprintf(s, "{\"method\": \"mining.submit\", \"params\": [\"u\", \"1\", \"00000000\", "
+		"\"00000000\", \"%08x\"], \"id\":%u}", nonce, id);
+	if (!stratum_send_line(sctx, s))
+		fail("send of share %u", id);
+}
+
+static void *late_share_thread(void *userdata)
+{
+	struct stratum_ctx *sctx = (struct stratum_ctx *) userdata;
+
+	usleep(200000);
+	send_share(sctx, 2);
+	return NULL;
+}
+
+/**
+ * Receive the answers to count shares, the last one sent first
+ * @return int shares accepted
+ */
+static int recv_answers(struct stratum_ctx *sctx, int count)
+{
+	double last = 0.;
+	int i, accepted = 0;
+
+	for (i = 0; i < count; i++) {
+		struct stratum_share share;
+		struct timeval now, diff;
+		json_t *val, *res;
+		double latency;
+		uint32_t id;
+		char *line;
+
+		line = stratum_next_line(sctx, 10);
+		if (!line) {
+			fail("answer %d of %d not received", i, count);
+			return accepted;
+		}
+		val = JSON_LOADS(line, NULL);
+		id = (uint32_t) json_integer_value(json_object_get(val, "id"));
+		res = json_object_get(val, "result");
+		if (!stratum_share_answered(sctx, id, &share)) {
+			fail("answer to unknown share %u", id);
+		} else {
+			if (share.id != id)
+				fail("share %u taken for share %u", share.id, id);
+			if (json_is_true(res) != !(share.nonce & 1))
+				fail("share %u of nonce %08x got the answer of another share", id, share.nonce);
+			/* the shares sent first waited the longest */
+			gettimeofday(&now, NULL);
+			timeval_subtract(&diff, &now, &share.tv_submit);
+			latency = diff.tv_sec + 1e-6 * diff.tv_usec;
+			if (latency < last)
+				fail("share %u answered in %.6f s after a later share in %.6f s", id, latency, last);
+			last = latency;
+			accepted += json_is_true(res);
+		}
+		if (stratum_share_answered(sctx, id, NULL))
+			fail("share %u answered twice", id);
+		json_decref(val);
+	}
+	return accepted;
+}
+
+int main(void)
+{
+	struct stratum_ctx sctx;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t pool, late;
+	struct timeval start, end, diff;
+	char url[64];
+	uint32_t i, unanswered;
+	int accepted;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	pool_listen = socket(AF_INET, SOCK_STREAM, 0);
+	if (bind(pool_listen, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(pool_listen, 1) ||
+	    getsockname(pool_listen, (struct sockaddr *) &addr, &len)) {
+		printf("fake pool socket failed\n");
+		return 1;
+	}
+	pthread_create(&pool, NULL, pool_thread, NULL);
+	snprintf(url, sizeof(url), "stratum+tcp://127.0.0.1:%d", ntohs(addr.sin_port));
+
+	memset(&sctx, 0, sizeof(sctx));
+	pthread_mutex_init(&sctx.sock_lock, NULL);
+	pthread_mutex_init(&sctx.share_lock, NULL);
+	pthread_mutex_init(&sctx.work_lock, NULL);
+	curl_global_init(CURL_GLOBAL_ALL & ~CURL_GLOBAL_SSL);
+
+	if (!stratum_connect(&sctx, url) || !stratum_subscribe(&sctx) ||
+	    !stratum_authorize(&sctx, "u", "x", false) || !stratum_online(&sctx)) {
+		printf("FAIL: connection to the fake pool\n");
+		return 1;
+	}
+
+	/* more shares in flight than the table starts with */
+	pool_batch = 1000;
+	for (i = 0; i < 1000; i++)
+		send_share(&sctx, i * 3);
+	accepted = recv_answers(&sctx, 1000);
+	if (accepted != 500)
+		fail("%d shares accepted instead of 500", accepted);
+	if (sctx.unanswered)
+		fail("%u shares forgotten", sctx.unanswered);
+
+	/* sent while the stratum thread waits for a line, not at its timeout */
+	pool_batch = 1;
+	gettimeofday(&start, NULL);
+	pthread_create(&late, NULL, late_share_thread, &sctx);
+	accepted = recv_answers(&sctx, 1);
+	gettimeofday(&end, NULL);
+	pthread_join(late, NULL);
+	timeval_subtract(&diff, &end, &start);
+	if (accepted != 1 || diff.tv_sec >= 2)
+		fail("share of another thread answered after %d s", (int) diff.tv_sec);
+
+	/* more unanswered shares than the table holds: the oldest go */
+	pool_batch = 100;
+	for (i = 0; i < STRATUM_MAX_INFLIGHT + 100; i++)
+		send_share(&sctx, SILENT | i);
+	for (i = 0; i < 100; i++)
+		send_share(&sctx, i);
+	accepted = recv_answers(&sctx, 100);
+	if (accepted != 50)
+		fail("%d shares accepted instead of 50", accepted);
+	unanswered = STRATUM_MAX_INFLIGHT + 200 - (STRATUM_MAX_INFLIGHT - 1);
+	if (sctx.unanswered != unanswered)
+		fail("%u shares forgotten instead of %u", sctx.unanswered, unanswered);
+	if (sctx.inflight_count != STRATUM_MAX_INFLIGHT - 1 - 100)
+		fail("%u shares in flight instead of %u", sctx.inflight_count, STRATUM_MAX_INFLIGHT - 101);
+
+	/* no answer comes after a disconnection */
+	unanswered = sctx.unanswered + sctx.inflight_count;
+	stratum_disconnect(&sctx);
+	if (sctx.inflight_count || sctx.unanswered != unanswered)
+		fail("%u shares left in flight after the disconnection", sctx.inflight_count);
+	if (stratum_share_answered(&sctx, sctx.submit_id, NULL))
+		fail("share %u answered after the disconnection", sctx.submit_id);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("All shares matched their answers, %u forgotten\n", sctx.unanswered);
+	return 0;
+}
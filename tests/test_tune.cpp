@@ -0,0 +1,181 @@
+/**
+ * Autotuning test
+ *
+ * A synthetic latency model stands for the GPU: it gives the time of a
+ * batch for each throughput and mode. Scans are reported to tune_step()
+ * and hashed with the setting it gives back, as scanhash_neoscrypt() does,
+ * until the device is tuned; the device must then hash with the fastest
+ * setting of the model within the batch time limit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include "miner.h"
+
+bool opt_debug = false;
+char *opt_tune_file = NULL;
+
+void applog(int prio, const char *fmt, ...)
+{
+}
+
+/* 20 multiprocessors of 128 CUDA threads */
+#define UNIT (20 * 128)
+/* as tune.cpp */
+#define MAX_BATCH_TIME 0.5
+
+struct model {
+	const char *name;
+	/* seconds per batch */
+	double (*batch_time)(const struct model *m, uint32_t throughput, uint mode);
+	/* per mode: hashrate at the best throughput, and that throughput */
+	double peak[4];
+	uint32_t fill[4];
+	/* per mode: time of a batch besides the hashing, at the peak hashrate */
+	double overhead[4];
+};
+
+static int failures = 0;
+static uint32_t noise_seed = 0x54554E45;
+
+/* within 0.5% */
+static double noise(void)
+{
+	noise_seed ^= noise_seed << 13;
+	noise_seed ^= noise_seed >> 17;
+	noise_seed ^= noise_seed << 5;
+	return 1.0 + ((double) (noise_seed % 1001) - 500.) * 1e-5;
+}
+
+/* The device fills up to its best throughput, larger batches thrash */
+static double occupancy_time(const struct model *m, uint32_t throughput, uint mode)
+{
+	double t = (double) throughput, fill = (double) m->fill[mode];
+	double hashrate = m->peak[mode] * (t < fill ? t / fill : pow(fill / t, 0.3));
+
+	return t / hashrate;
+}
+
+/* A constant cost per batch, larger batches pay it less often */
+static double overhead_time(const struct model *m, uint32_t throughput, uint mode)
+{
+	return m->overhead[mode] + (double) throughput / m->peak[mode];
+}
+
+static const struct model models[] = {
+	/* mode 2 at 32 units, mode 3 is tried last up to 64 units */
+	{ "middle setting best", occupancy_time,
+	  { 0, 300e3, 420e3, 380e3 }, { 0, 16 * UNIT, 32 * UNIT, 64 * UNIT } },
+	/* the largest batch of mode 3 is the last one tried and the best */
+	{ "last setting best", occupancy_time,
+	  { 0, 300e3, 320e3, 380e3 }, { 0, 16 * UNIT, 32 * UNIT, 64 * UNIT } },
+	/* mode 2 at 48 units, larger batches are over the time limit */
+	{ "large batches too slow", overhead_time,
+	  { 0, 300e3, 350e3, 250e3 }, { 0 }, { 0, 0.05, 0.1, 0.02 } },
+	/* the quickest batch: 8 units of mode 2 */
+	{ "every batch too slow", overhead_time,
+	  { 0, 1e6, 1e6, 1e6 }, { 0 }, { 0, 0.7, 0.6, 0.65 } },
+};
+
+/**
+ * Best setting of a model among the candidates of a tuning state
+ * @return int index of the candidate
+ */
+static int model_best(const struct model *m, const struct tune_state *ts)
+{
+	double best_rate = 0., best_time = 0.;
+	int i, best = -1, quickest = -1;
+
+	for (i = 0; i < ts->count; i++) {
+		const struct tune_candidate *c = &ts->cand[i];
+		double bt = m->batch_time(m, c->throughput, c->mode);
+		if (bt <= MAX_BATCH_TIME && c->throughput / bt > best_rate) {
+			best_rate = c->throughput / bt;
+			best = i;
+		}
+		if (quickest < 0 || bt < best_time) {
+			best_time = bt;
+			quickest = i;
+		}
+	}
+	return best >= 0 ? best : quickest;
+}
+
+/**
+ * Tune a device of the model, scans of about a second each,
+ * the first one with a setting paying for its change
+ */
+static void tune_model(const struct model *m, uint32_t max_throughput,
+	uint32_t throughput, uint mode)
+{
+	struct tune_state *ts = (struct tune_state *) malloc(sizeof(*ts));
+	struct tune_candidate dev, want, last;
+	uint32_t prev_throughput = 0;
+	uint prev_mode = 0;
+	int scans = 0;
+
+	tune_init(ts, UNIT, max_throughput, throughput, mode);
+	want = ts->cand[model_best(m, ts)];
+	dev = *tune_current(ts);
+
+	for (;;) {
+		double bt = m->batch_time(m, dev.throughput, dev.mode) * noise();
+		uint32_t batches = max(1, (uint32_t) (1.0 / bt));
+		double seconds = batches * bt;
+
+		if (dev.throughput != prev_throughput || dev.mode != prev_mode)
+			seconds += 0.3;
+		prev_throughput = dev.throughput;
+		prev_mode = dev.mode;
+		last = dev;
+
+		if (tune_step(&ts, (uint64_t) batches * dev.throughput, batches, seconds, &dev))
+			break;
+		if (++scans > 1000) {
+			printf("FAIL: %s, not tuned after %d scans\n", m->name, scans);
+			failures++;
+			free(ts);
+			return;
+		}
+	}
+
+	if (ts) {
+		printf("FAIL: %s, tuning state not freed\n", m->name);
+		failures++;
+	}
+	if (dev.throughput != want.throughput || dev.mode != want.mode) {
+		printf("FAIL: %s, tuned to %u threads mode %u instead of %u threads mode %u"
+			" (last tried %u threads mode %u)\n", m->name, dev.throughput, dev.mode,
+			want.throughput, want.mode, last.throughput, last.mode);
+		failures++;
+	}
+	if (dev.hashrate <= 0.) {
+		printf("FAIL: %s, no hashrate measured for the setting tuned\n", m->name);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	uint i, mode;
+
+	for (i = 0; i < ARRAY_SIZE(models); i++) {
+		tune_model(&models[i], 64 * UNIT, 0, 0);
+		/* batches capped by the device memory */
+		tune_model(&models[i], 40 * UNIT, 0, 0);
+		for (mode = 1; mode <= 3; mode++)
+			tune_model(&models[i], 64 * UNIT, 0, mode);
+		/* only the mode is tuned */
+		tune_model(&models[i], 64 * UNIT, 24 * UNIT, 0);
+	}
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("Tuned to the best setting of %u latency models\n", (uint) ARRAY_SIZE(models));
+	return 0;
+}
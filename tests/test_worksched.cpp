@@ -0,0 +1,234 @@
+/**
+ * Work space scheduler test
+ *
+ * worksched.cpp is built with fewer nonces per extranonce2 roll so that
+ * threads use whole work spaces up in a moment. Every nonce claimed is
+ * marked in a bitmap per epoch, a nonce marked twice is an overlap and
+ * a nonce left unmarked below the last one claimed is a gap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "miner.h"
+
+#ifndef WORK_SCHED_NONCE_BITS
+#error "WORK_SCHED_NONCE_BITS must be reduced for this test"
+#endif
+
+#define NONCES  (1U << WORK_SCHED_NONCE_BITS)
+#define ROLLS   5
+#define EPOCHS  16
+#define THREADS 4
+
+#define test_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define test_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+struct claimer {
+	pthread_t pth;
+	uint32_t seed;
+	struct work_slice *slices;
+	int count, size;
+};
+
+static struct work_sched sched;
+/* bumped at every reset of the work space */
+static int generation = 0;
+static int stop = 0;
+
+static uint8_t *bitmap[EPOCHS];
+static int failures = 0;
+
+static uint32_t test_rand(uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/* sizes from a few nonces to more than a roll, some as the miner picks them */
+static uint64_t test_size(uint32_t *seed)
+{
+	switch (test_rand(seed) % 4) {
+	case 0:
+		return 1 + test_rand(seed) % 300;
+	case 1:
+		return 1 + test_rand(seed) % (NONCES / 3);
+	case 2:
+		return work_sched_size((double) (test_rand(seed) % NONCES), 1.0, 1);
+	default:
+		return NONCES + test_rand(seed) % NONCES;
+	}
+}
+
+static void fail(const char *what, uint32_t epoch, uint32_t roll, uint32_t nonce)
+{
+	if (failures++ < 10)
+		printf("FAIL: %s, epoch %u roll %u nonce %u\n", what, epoch, roll, nonce);
+}
+
+static void mark(const struct work_slice *s, uint32_t epoch_base)
+{
+	uint32_t e = (s->epoch - epoch_base) & 0xffff;
+	uint32_t n;
+
+	if (e >= EPOCHS || s->roll >= ROLLS || s->first > s->last || s->last >= NONCES) {
+		fail("slice out of the work space", s->epoch, s->roll, s->first);
+		return;
+	}
+	for (n = s->first; n <= s->last; n++) {
+		uint64_t bit = (uint64_t) s->roll * NONCES + n;
+		if (bitmap[e][bit >> 3] & (1 << (bit & 7)))
+			fail("overlap", s->epoch, s->roll, n);
+		bitmap[e][bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+/* nonces claimed must form a prefix of the work space, all of it if full */
+static void check_prefix(uint32_t e, uint32_t epoch, bool full)
+{
+	uint64_t bit, end = (uint64_t) ROLLS * NONCES;
+	bool gap = false;
+
+	for (bit = 0; bit < end; bit++) {
+		bool set = (bitmap[e][bit >> 3] & (1 << (bit & 7))) != 0;
+		if (set && gap) {
+			fail("gap", epoch, (uint32_t) (bit / NONCES), (uint32_t) (bit % NONCES));
+			return;
+		}
+		if (!set)
+			gap = true;
+	}
+	if (full && gap)
+		fail("work space not used up", epoch, ROLLS, 0);
+}
+
+static void *claimer_thread(void *userdata)
+{
+	struct claimer *c = (struct claimer *) userdata;
+	struct work_slice s[2];
+	int gen, n;
+
+	while (!test_load(&stop)) {
+		gen = test_load(&generation);
+		n = work_sched_claim(&sched, test_size(&c->seed), s);
+		if (!n) {
+			/* used up, as the miner does wait for the next work */
+			while (!test_load(&stop) && test_load(&generation) == gen)
+				sched_yield();
+			continue;
+		}
+		if (c->count + 2 > c->size) {
+			c->size = 2 * c->size + 64;
+			c->slices = (struct work_slice *) realloc(c->slices, c->size * sizeof(s[0]));
+		}
+		memcpy(&c->slices[c->count], s, n * sizeof(s[0]));
+		c->count += n;
+	}
+	return NULL;
+}
+
+/* nonces claimed so far from the work space, the epoch left out */
+static uint64_t cursor_claimed(void)
+{
+	uint64_t c = test_load(&sched.cursor);
+	return c & ((1ULL << (WORK_SCHED_NONCE_BITS + 16)) - 1);
+}
+
+/**
+ * Claim from THREADS threads while the work space is reset with the next
+ * epoch, either once it is used up or while the threads are still claiming
+ */
+static void test_threads(uint32_t epoch_base)
+{
+	struct claimer c[THREADS];
+	uint32_t e;
+	int i, k;
+
+	work_sched_reset(&sched, epoch_base, ROLLS);
+
+	for (i = 0; i < THREADS; i++) {
+		c[i].seed = 0x9E3779B9 * (i + 1);
+		c[i].slices = NULL;
+		c[i].count = c[i].size = 0;
+		pthread_create(&c[i].pth, NULL, claimer_thread, &c[i]);
+	}
+
+	for (e = 0; e < EPOCHS; e++) {
+		/* odd epochs are cut short by the next work in their middle */
+		uint64_t until = (e & 1) ? (uint64_t) ROLLS * NONCES / 2 : (uint64_t) ROLLS * NONCES;
+
+		while (cursor_claimed() < until)
+			sched_yield();
+		if (e + 1 < EPOCHS) {
+			work_sched_reset(&sched, epoch_base + e + 1, ROLLS);
+			test_store(&generation, generation + 1);
+		}
+	}
+	test_store(&stop, 1);
+
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(c[i].pth, NULL);
+		for (k = 0; k < c[i].count; k++)
+			mark(&c[i].slices[k], epoch_base);
+		free(c[i].slices);
+	}
+
+	for (e = 0; e < EPOCHS; e++)
+		check_prefix(e, (epoch_base + e) & 0xffff, !(e & 1));
+}
+
+/* Slices and the epoch comparison across the 16-bit epoch wrap */
+static void test_epochs(void)
+{
+	struct work_slice s[2];
+	int n;
+
+	work_sched_reset(&sched, 0x1ffff, 2);
+	n = work_sched_claim(&sched, NONCES - 16, s);
+	if (n != 1 || s[0].epoch != 0xffff || s[0].roll || s[0].first || s[0].last != NONCES - 17)
+		fail("first slice", s[0].epoch, s[0].roll, s[0].first);
+
+	n = work_sched_claim(&sched, 32, s);
+	if (n != 2 || s[0].first != NONCES - 16 || s[0].last != NONCES - 1 ||
+		s[1].roll != 1 || s[1].first || s[1].last != 15)
+		fail("slice split over two rolls", s[0].epoch, s[0].roll, s[0].first);
+
+	n = work_sched_claim(&sched, NONCES, s);
+	if (n != 1 || s[0].roll != 1 || s[0].first != 16 || s[0].last != NONCES - 1)
+		fail("last slice cut at the end of the work space", s[0].epoch, s[0].roll, s[0].first);
+
+	if (work_sched_claim(&sched, 1, s) || work_sched_claim(&sched, NONCES, s))
+		fail("claim from a used up work space", 0xffff, 2, 0);
+
+	if (work_sched_cmp_epoch(0, 0xffff) <= 0 || work_sched_cmp_epoch(0xffff, 0) >= 0 ||
+		work_sched_cmp_epoch(0x1234, 0x1234))
+		fail("epoch comparison", 0, 0, 0);
+}
+
+int main(void)
+{
+	int e;
+
+	for (e = 0; e < EPOCHS; e++)
+		bitmap[e] = (uint8_t *) calloc((ROLLS * (uint64_t) NONCES + 7) / 8, 1);
+
+	test_epochs();
+	/* epochs wrap around within the run */
+	test_threads(0xfffc);
+
+	for (e = 0; e < EPOCHS; e++)
+		free(bitmap[e]);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("No overlap and no gap in %d epochs of %d rolls of %u nonces\n",
+		EPOCHS, ROLLS, NONCES);
+	return 0;
+}
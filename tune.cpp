@@ -0,0 +1,279 @@
+/**
+ * GPU autotuning
+ *
+ * The throughput and the hashing mode of a device are tuned on live work:
+ * each candidate setting hashes for a while, larger batches of a mode are
+ * tried only while they pay off, and the fastest setting within the batch
+ * time limit is kept. The result is cached in a JSON file for the next
+ * start, keyed by device model and driver (see cuda_tune_key), and kept
+ * up to date with the speed measured while mining.
+ *
+ * The tuning loop only sees hash counts and times, a synthetic latency
+ * model can drive it as well as a GPU
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "log.h"
+
+/* measuring time of a candidate, after its first scan */
+#define TUNE_SAMPLE_SECONDS 2.0
+/* slowest batch allowed, keeps work restarts responsive */
+#define TUNE_MAX_BATCH_TIME 0.5
+/* larger batches are worth it above this hashrate gain */
+#define TUNE_MIN_GAIN       0.02
+
+/* batch sizes tried, in units of the device size */
+static const uint32_t tune_sizes[] = { 8, 16, 32, 48, 64 };
+
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Prepare the candidates: larger batches last for each mode
+ * @param unit uint32_t throughput per batch size unit
+ * @param max_throughput uint32_t the device memory allows
+ * @param throughput uint32_t fixed, 0 to tune it
+ * @param mode uint fixed, 0 to tune it
+ */
+void tune_init(struct tune_state *ts, uint32_t unit, uint32_t max_throughput,
+	uint32_t throughput, uint mode)
+{
+	uint m, i;
+
+	memset(ts, 0, sizeof(*ts));
+	ts->best = -1;
+
+	for (m = 1; m <= 3; m++) {
+		if (mode && m != mode)
+			continue;
+		if (throughput) {
+			ts->cand[ts->count].throughput = throughput;
+			ts->cand[ts->count++].mode = m;
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(tune_sizes); i++) {
+			uint32_t t = unit * tune_sizes[i];
+			if (t > max_throughput && i)
+				break;
+			ts->cand[ts->count].throughput = min(t, max_throughput);
+			ts->cand[ts->count++].mode = m;
+		}
+	}
+}
+
+/**
+ * Setting to hash with, the best one once tuned
+ */
+const struct tune_candidate *tune_current(const struct tune_state *ts)
+{
+	return &ts->cand[ts->cur < ts->count ? ts->cur : ts->best];
+}
+
+/**
+ * Report a scan with the current setting
+ * @param hashes uint64_t done
+ * @param batches uint32_t the hashes were done in
+ * @param seconds double taken
+ * @return bool true once tuned
+ */
+bool tune_report(struct tune_state *ts, uint64_t hashes, uint32_t batches, double seconds)
+{
+	struct tune_candidate *c;
+	bool stop;
+	int i;
+
+	if (ts->cur >= ts->count)
+		return true;
+
+	/* the first scan pays for the change of setting */
+	if (!ts->warm) {
+		ts->warm = true;
+		return false;
+	}
+	ts->hashes += hashes;
+	ts->batches += batches;
+	ts->seconds += seconds;
+	if (ts->seconds < TUNE_SAMPLE_SECONDS || !ts->batches)
+		return false;
+
+	c = &ts->cand[ts->cur];
+	c->hashrate = (double) ts->hashes / ts->seconds;
+	c->batch_time = ts->seconds / ts->batches;
+	if (opt_debug)
+		applog(LOG_DEBUG, "tune: throughput %u mode %u, %.0f H/s, %.3f s per batch",
+			c->throughput, c->mode, c->hashrate, c->batch_time);
+
+	if (c->batch_time <= TUNE_MAX_BATCH_TIME &&
+	    (ts->best < 0 || c->hashrate > ts->cand[ts->best].hashrate))
+		ts->best = ts->cur;
+
+	/* no larger batches of this mode once they are too slow or gain nothing */
+	stop = c->batch_time > TUNE_MAX_BATCH_TIME ||
+		(ts->cur && ts->cand[ts->cur - 1].mode == c->mode &&
+		 c->hashrate < ts->cand[ts->cur - 1].hashrate * (1.0 + TUNE_MIN_GAIN));
+
+	ts->cur++;
+	while (stop && ts->cur < ts->count && ts->cand[ts->cur].mode == c->mode)
+		ts->cur++;
+
+	ts->warm = false;
+	ts->hashes = 0;
+	ts->batches = 0;
+	ts->seconds = 0.;
+
+	if (ts->cur < ts->count)
+		return false;
+
+	/* every batch too slow: the quickest one */
+	if (ts->best < 0) {
+		ts->best = 0;
+		for (i = 1; i < ts->count; i++) {
+			if (ts->cand[i].hashrate > 0. &&
+			    ts->cand[i].batch_time < ts->cand[ts->best].batch_time)
+				ts->best = i;
+		}
+	}
+	return true;
+}
+
+/**
+ * Report a scan and give the setting to hash with next
+ * @param tsp struct tune_state ** freed and set to NULL once tuned
+ * @param next struct tune_candidate * receiving the setting, the best one once tuned
+ * @return bool true once tuned
+ */
+bool tune_step(struct tune_state **tsp, uint64_t hashes, uint32_t batches, double seconds,
+	struct tune_candidate *next)
+{
+	struct tune_state *ts = *tsp;
+	bool tuned = tune_report(ts, hashes, batches, seconds);
+
+	/* copied before the state goes */
+	*next = *tune_current(ts);
+	if (tuned) {
+		free(ts);
+		*tsp = NULL;
+	}
+	return tuned;
+}
+
+static json_t *tune_cache_load(void)
+{
+	json_error_t err;
+	json_t *db;
+
+#if JANSSON_VERSION_HEX >= 0x020000
+	db = json_load_file(opt_tune_file, 0, &err);
+#else
+	db = json_load_file(opt_tune_file, &err);
+#endif
+	if (db && !json_is_object(db)) {
+		json_decref(db);
+		db = NULL;
+	}
+	return db;
+}
+
+/**
+ * Look a device up in the tuning cache
+ * @param key const char * of the device
+ * @return bool false if not tuned yet
+ */
+bool tune_cache_get(const char *key, uint32_t *throughput, uint *mode)
+{
+	json_t *db, *ent;
+	bool found = false;
+
+	if (!opt_tune_file)
+		return false;
+
+	pthread_mutex_lock(&tune_lock);
+	db = tune_cache_load();
+	ent = json_object_get(db, key);
+	if (json_is_object(ent)) {
+		json_int_t t = json_integer_value(json_object_get(ent, "throughput"));
+		json_int_t m = json_integer_value(json_object_get(ent, "mode"));
+		if (t > 0 && t <= 0xffffffffLL && m >= 1 && m <= 3) {
+			*throughput = (uint32_t) t;
+			*mode = (uint) m;
+			found = true;
+		}
+	}
+	if (db)
+		json_decref(db);
+	pthread_mutex_unlock(&tune_lock);
+
+	return found;
+}
+
+static void tune_cache_store(const char *key, uint32_t throughput, uint mode,
+	double hashrate, bool replace)
+{
+	char tmp[1024];
+	json_t *db, *ent;
+
+	if (!opt_tune_file)
+		return;
+
+	pthread_mutex_lock(&tune_lock);
+
+	db = tune_cache_load();
+	if (!db)
+		db = json_object();
+
+	/* another setting is kept unless this one is faster */
+	ent = json_object_get(db, key);
+	if (!replace && json_is_object(ent) &&
+	    (json_integer_value(json_object_get(ent, "throughput")) != (json_int_t) throughput ||
+	     json_integer_value(json_object_get(ent, "mode")) != (json_int_t) mode) &&
+	    json_real_value(json_object_get(ent, "hashrate")) >= hashrate) {
+		json_decref(db);
+		pthread_mutex_unlock(&tune_lock);
+		return;
+	}
+
+	ent = json_object();
+	json_object_set_new(ent, "throughput", json_integer(throughput));
+	json_object_set_new(ent, "mode", json_integer(mode));
+	json_object_set_new(ent, "hashrate", json_real(hashrate));
+	json_object_set_new(db, key, ent);
+
+	/* written aside first, a crash leaves the old cache intact */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", opt_tune_file);
+	if (json_dump_file(db, tmp, JSON_INDENT(2) | JSON_SORT_KEYS)) {
+		applog(LOG_WARNING, "Unable to write the tuning cache %s", tmp);
+	} else {
+#ifdef _WIN32
+		remove(opt_tune_file);
+#endif
+		if (rename(tmp, opt_tune_file))
+			applog(LOG_WARNING, "Unable to write the tuning cache %s", opt_tune_file);
+	}
+
+	json_decref(db);
+	pthread_mutex_unlock(&tune_lock);
+}
+
+/**
+ * Store the setting tuned for a device
+ * @param key const char * of the device
+ * @param hashrate double measured with it
+ */
+void tune_cache_put(const char *key, uint32_t throughput, uint mode, double hashrate)
+{
+	tune_cache_store(key, throughput, mode, hashrate, true);
+}
+
+/**
+ * Store the speed measured with a setting of a device over time,
+ * the setting itself if it beats the one in the cache (set by hand)
+ * @param key const char * of the device
+ * @param hashrate double averaged over the recent scans
+ */
+void tune_cache_update(const char *key, uint32_t throughput, uint mode, double hashrate)
+{
+	tune_cache_store(key, throughput, mode, hashrate, false);
+}
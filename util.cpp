@@ -14,6 +14,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <jansson.h>
 #include <curl/curl.h>
@@ -28,9 +29,16 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #endif
+/* STRATUM_NO_EPOLL builds the select() event loop of the other systems */
+#if defined(__linux) && !defined(STRATUM_NO_EPOLL)
+#define STRATUM_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif !defined(WIN32)
+#include <fcntl.h>
+#endif
 #include "miner.h"
 #include "log.h"
-#include "elist.h"
 
 bool opt_tracegpu = false;
 
@@ -51,13 +59,11 @@ struct header_info {
 	char		*stratum_url;
 };
 
-struct tq_ent {
-	void			*data;
-	struct list_head	q_node;
-};
-
 struct thread_q {
-	struct list_head	q;
+	/* messages queued, stored inline */
+	void			*ring[TQ_DEPTH];
+	uint32_t		head;
+	uint32_t		count;
 
 	bool frozen;
 
@@ -628,6 +634,19 @@ void diff_to_target(uint32_t *target, double diff)
 	}
 }
 
+/**
+ * Hashes expected per solution to a target
+ */
+double target_to_hashes(const uint32_t *target)
+{
+	double t = 0.;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		t = t * 4294967296.0 + target[i];
+	return ldexp(1.0, 256) / (t + 1.0);
+}
+
 #ifdef WIN32
 #define socket_blocks() (WSAGetLastError() == WSAEWOULDBLOCK)
 #else
@@ -663,6 +682,87 @@ static bool send_line(curl_socket_t sock, char *s)
 	return true;
 }
 
+#ifdef _MSC_VER
+#define stratum_xchg(p, v) ((struct stratum_msg *) InterlockedExchangePointer((PVOID volatile *)(p), (v)))
+#define stratum_load(p) (*(struct stratum_msg * volatile *)(p))
+#define stratum_store(p, v) (*(struct stratum_msg * volatile *)(p) = (v))
+#define stratum_set_online(sctx, v) (*(volatile bool *) &(sctx)->online = (v))
+#else
+#define stratum_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define stratum_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define stratum_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define stratum_set_online(sctx, v) __atomic_store_n(&(sctx)->online, (v), __ATOMIC_RELEASE)
+#endif
+
+/**
+ * Send queue of the event loop, an intrusive list with a stub node:
+ * any thread pushes with a single atomic exchange, only the loop
+ * thread pops; a push in progress may be missed by a pop, its wakeup
+ * comes after it completes
+ */
+static void stratum_queue_push(struct stratum_ctx *sctx, struct stratum_msg *msg)
+{
+	struct stratum_msg *prev;
+
+	stratum_store(&msg->next, (struct stratum_msg *) NULL);
+	prev = stratum_xchg(&sctx->sendq_head, msg);
+	stratum_store(&prev->next, msg);
+}
+
+static struct stratum_msg *stratum_queue_pop(struct stratum_ctx *sctx)
+{
+	struct stratum_msg *tail = sctx->sendq_tail;
+	struct stratum_msg *next = stratum_load(&tail->next);
+
+	if (tail == &sctx->sendq_stub) {
+		if (!next)
+			return NULL;
+		sctx->sendq_tail = tail = next;
+		next = stratum_load(&tail->next);
+	}
+	if (!next) {
+		if (tail != stratum_load(&sctx->sendq_head))
+			return NULL;
+		stratum_queue_push(sctx, &sctx->sendq_stub);
+		next = stratum_load(&tail->next);
+		if (!next)
+			return NULL;
+	}
+	sctx->sendq_tail = next;
+
+	return tail;
+}
+
+static bool stratum_queue_line(struct stratum_ctx *sctx, const char *s)
+{
+	struct stratum_msg *msg;
+	size_t len = strlen(s);
+
+	msg = (struct stratum_msg *) malloc(sizeof(*msg) + len);
+	if (!msg)
+		return false;
+	memcpy(msg->line, s, len + 1);
+	stratum_queue_push(sctx, msg);
+
+#ifdef STRATUM_EPOLL
+	{
+		uint64_t one = 1;
+		if (write(sctx->wakefd, &one, sizeof(one)) < 0)
+			applog(LOG_DEBUG, "stratum wakeup failed");
+	}
+#else
+	/* a full pair has wakeups pending already */
+	if (send(sctx->wakesock[1], "", 1, 0) < 0 && !socket_blocks())
+		applog(LOG_DEBUG, "stratum wakeup failed");
+#endif
+
+	return true;
+}
+
+/**
+ * Send a line to the pool; once online it is queued for the event loop
+ * and this never blocks
+ */
 bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 {
 	bool ret = false;
@@ -670,6 +770,9 @@ bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 	if (opt_protocol)
 		applog(LOG_DEBUG, "> %s", s);
 
+	if (stratum_is_online(sctx))
+		return stratum_queue_line(sctx, s);
+
 	pthread_mutex_lock(&sctx->sock_lock);
 	ret = send_line(sctx->sock, s);
 	pthread_mutex_unlock(&sctx->sock_lock);
@@ -693,31 +796,83 @@ static bool socket_full(curl_socket_t sock, int timeout)
 
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
 {
-	return strlen(sctx->sockbuf) || socket_full(sctx->sock, timeout);
+	return (sctx->sockbuf_rpos != sctx->sockbuf_wpos) || socket_full(sctx->sock, timeout);
 }
 
 #define RBUFSIZE 2048
 #define RECVSIZE (RBUFSIZE - 4)
 
-static void stratum_buffer_append(struct stratum_ctx *sctx, const char *s)
+/**
+ * The receive buffer holds unread data in [rpos, wpos), bytes in
+ * [rpos, scan) are known to contain no newline so they are never
+ * searched twice; lines are returned in place, and the unread tail
+ * is moved back to the start only when there is no room left behind it
+ */
+static void stratum_buffer_reset(struct stratum_ctx *sctx)
 {
-	size_t old, snew;
+	sctx->sockbuf_rpos = 0;
+	sctx->sockbuf_wpos = 0;
+	sctx->sockbuf_scan = 0;
+}
 
-	old = strlen(sctx->sockbuf);
-	snew = old + strlen(s) + 1;
-	if (snew >= sctx->sockbuf_size) {
-		sctx->sockbuf_size = snew + (RBUFSIZE - (snew % RBUFSIZE));
+/* Makes room for RECVSIZE more bytes past wpos */
+static void stratum_buffer_reserve(struct stratum_ctx *sctx)
+{
+	size_t unread = sctx->sockbuf_wpos - sctx->sockbuf_rpos;
+
+	if (sctx->sockbuf_size - sctx->sockbuf_wpos > RECVSIZE)
+		return;
+
+	if (sctx->sockbuf_rpos) {
+		memmove(sctx->sockbuf, sctx->sockbuf + sctx->sockbuf_rpos, unread);
+		sctx->sockbuf_scan -= sctx->sockbuf_rpos;
+		sctx->sockbuf_wpos = unread;
+		sctx->sockbuf_rpos = 0;
+	}
+
+	if (sctx->sockbuf_size - sctx->sockbuf_wpos <= RECVSIZE) {
+		sctx->sockbuf_size *= 2;
 		sctx->sockbuf = (char*)realloc(sctx->sockbuf, sctx->sockbuf_size);
 	}
-	strcpy(sctx->sockbuf + old, s);
 }
 
+/* Returns the next non empty line buffered, NULL if incomplete */
+static char *stratum_buffer_line(struct stratum_ctx *sctx)
+{
+	char *line, *eol;
+
+	while (sctx->sockbuf_scan < sctx->sockbuf_wpos) {
+		eol = (char*)memchr(sctx->sockbuf + sctx->sockbuf_scan, '\n',
+			sctx->sockbuf_wpos - sctx->sockbuf_scan);
+		if (!eol) {
+			sctx->sockbuf_scan = sctx->sockbuf_wpos;
+			break;
+		}
+
+		*eol = '\0';
+		line = sctx->sockbuf + sctx->sockbuf_rpos;
+		sctx->sockbuf_rpos = sctx->sockbuf_scan = (size_t)(eol - sctx->sockbuf) + 1;
+		if (sctx->sockbuf_rpos == sctx->sockbuf_wpos)
+			stratum_buffer_reset(sctx);
+
+		if (*line)
+			return line;
+	}
+
+	return NULL;
+}
+
+/**
+ * Receive a line from the pool
+ * @return the line in the receive buffer, valid until the next call,
+ * or NULL on failure
+ */
 char *stratum_recv_line(struct stratum_ctx *sctx)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
+	char *sret;
 
-	if (!strstr(sctx->sockbuf, "\n")) {
+	sret = stratum_buffer_line(sctx);
+	if (!sret) {
 		bool ret = true;
 		time_t rstart = time(NULL);
 		if (!socket_full(sctx->sock, 60)) {
@@ -725,11 +880,10 @@ char *stratum_recv_line(struct stratum_ctx *sctx)
 			goto out;
 		}
 		do {
-			char s[RBUFSIZE];
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(sctx->sock, s, RECVSIZE, 0);
+			stratum_buffer_reserve(sctx);
+			n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_wpos, RECVSIZE, 0);
 			if (!n) {
 				ret = false;
 				break;
@@ -739,32 +893,267 @@ char *stratum_recv_line(struct stratum_ctx *sctx)
 					ret = false;
 					break;
 				}
-			} else
-				stratum_buffer_append(sctx, s);
-		} while (time(NULL) - rstart < 60 && !strstr(sctx->sockbuf, "\n"));
+			} else {
+				sctx->sockbuf_wpos += n;
+				sret = stratum_buffer_line(sctx);
+			}
+		} while (time(NULL) - rstart < 60 && !sret);
 
 		if (!ret) {
 			applog(LOG_ERR, "stratum_recv_line failed");
 			goto out;
 		}
+		if (!sret) {
+			applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
+			goto out;
+		}
 	}
 
-	buflen = (ssize_t)strlen(sctx->sockbuf);
-	tok = strtok(sctx->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
-		goto out;
+out:
+	if (sret && opt_protocol)
+		applog(LOG_DEBUG, "< %s", sret);
+	return sret;
+}
+
+#ifndef STRATUM_EPOLL
+/**
+ * Connected pair of non-blocking sockets waking the event loop up,
+ * a loopback connection on Windows which has no socketpair()
+ * @return int 0, -1 on failure
+ */
+static int stratum_wake_pair(curl_socket_t sv[2])
+{
+#ifdef WIN32
+	struct sockaddr_in addr;
+	int len = sizeof(addr);
+	u_long nonblock = 1;
+	SOCKET lsock;
+
+	lsock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (lsock == INVALID_SOCKET)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sv[0] = sv[1] = INVALID_SOCKET;
+	if (!bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) && !listen(lsock, 1) &&
+	    !getsockname(lsock, (struct sockaddr *) &addr, &len)) {
+		sv[1] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sv[1] != INVALID_SOCKET && !connect(sv[1], (struct sockaddr *) &addr, sizeof(addr)))
+			sv[0] = accept(lsock, NULL, NULL);
+	}
+	closesocket(lsock);
+	if (sv[0] == INVALID_SOCKET) {
+		if (sv[1] != INVALID_SOCKET)
+			closesocket(sv[1]);
+		return -1;
+	}
+	ioctlsocket(sv[0], FIONBIO, &nonblock);
+	ioctlsocket(sv[1], FIONBIO, &nonblock);
+#else
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+#endif
+	return 0;
+}
+#endif
+
+/**
+ * Hand the connected socket over to the event loop of the stratum thread,
+ * from now on lines are sent through the queue by stratum_next_line()
+ */
+bool stratum_online(struct stratum_ctx *sctx)
+{
+	struct stratum_msg *msg;
+#ifdef STRATUM_EPOLL
+	struct epoll_event ev;
+
+	if (sctx->epfd <= 0) {
+		sctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+		sctx->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (sctx->epfd < 0 || sctx->wakefd < 0) {
+			applog(LOG_ERR, "Stratum event loop initialization failed");
+			return false;
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = sctx->wakefd;
+		epoll_ctl(sctx->epfd, EPOLL_CTL_ADD, sctx->wakefd, &ev);
 	}
-	sret = strdup(tok);
-	len = (ssize_t)strlen(sret);
 
-	if (buflen > len + 1)
-		memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
-	else
-		sctx->sockbuf[0] = '\0';
+	ev.events = EPOLLIN;
+	ev.data.fd = (int)sctx->sock;
+	if (epoll_ctl(sctx->epfd, EPOLL_CTL_ADD, (int)sctx->sock, &ev) &&
+	    epoll_ctl(sctx->epfd, EPOLL_CTL_MOD, (int)sctx->sock, &ev)) {
+		applog(LOG_ERR, "Stratum event loop initialization failed");
+		return false;
+	}
+#else
+	if (!sctx->wakesock[0] && stratum_wake_pair(sctx->wakesock)) {
+		sctx->wakesock[0] = 0;
+		applog(LOG_ERR, "Stratum event loop initialization failed");
+		return false;
+	}
+#endif
 
-out:
-	if (sret && opt_protocol)
+	if (!sctx->sendq_head)
+		sctx->sendq_head = sctx->sendq_tail = &sctx->sendq_stub;
+
+	/* drop what was queued for the previous session */
+	while ((msg = stratum_queue_pop(sctx)))
+		free(msg);
+	sctx->sendbuf_pos = sctx->sendbuf_len = 0;
+
+	stratum_set_online(sctx, true);
+
+	return true;
+}
+
+/* Moves the queued lines to the send buffer and writes what the socket takes */
+static bool stratum_flush(struct stratum_ctx *sctx)
+{
+	struct stratum_msg *msg;
+	size_t len;
+	ssize_t n;
+
+	while ((msg = stratum_queue_pop(sctx))) {
+		len = strlen(msg->line) + 1;
+		if (sctx->sendbuf_len + len > sctx->sendbuf_size) {
+			sctx->sendbuf_len -= sctx->sendbuf_pos;
+			memmove(sctx->sendbuf, sctx->sendbuf + sctx->sendbuf_pos, sctx->sendbuf_len);
+			sctx->sendbuf_pos = 0;
+		}
+		if (sctx->sendbuf_len + len > sctx->sendbuf_size) {
+			sctx->sendbuf_size = sctx->sendbuf_len + len + RBUFSIZE;
+			sctx->sendbuf = (char*)realloc(sctx->sendbuf, sctx->sendbuf_size);
+		}
+		memcpy(sctx->sendbuf + sctx->sendbuf_len, msg->line, len - 1);
+		sctx->sendbuf[sctx->sendbuf_len + len - 1] = '\n';
+		sctx->sendbuf_len += len;
+		free(msg);
+	}
+
+	while (sctx->sendbuf_pos < sctx->sendbuf_len) {
+		n = send(sctx->sock, sctx->sendbuf + sctx->sendbuf_pos,
+			(uint)(sctx->sendbuf_len - sctx->sendbuf_pos), 0);
+		if (n < 0) {
+			if (!socket_blocks())
+				return false;
+			/* the rest once writable */
+			break;
+		}
+		sctx->sendbuf_pos += n;
+	}
+	if (sctx->sendbuf_pos == sctx->sendbuf_len)
+		sctx->sendbuf_pos = sctx->sendbuf_len = 0;
+
+	return true;
+}
+
+/* Waits up to timeout ms for data to read, pending output or a wakeup;
+ * returns 1 if the socket is readable, 0 if not, -1 on failure */
+static int stratum_wait(struct stratum_ctx *sctx, int timeout)
+{
+	bool pending = sctx->sendbuf_len > sctx->sendbuf_pos;
+#ifdef STRATUM_EPOLL
+	struct epoll_event ev, evs[2];
+	uint64_t wakeups;
+	int i, n, ret = 0;
+
+	ev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+	ev.data.fd = (int)sctx->sock;
+	if (epoll_ctl(sctx->epfd, EPOLL_CTL_MOD, (int)sctx->sock, &ev))
+		return -1;
+
+	n = epoll_wait(sctx->epfd, evs, 2, timeout);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		if (evs[i].data.fd == sctx->wakefd) {
+			if (read(sctx->wakefd, &wakeups, sizeof(wakeups)) < 0)
+				applog(LOG_DEBUG, "stratum wakeup failed");
+		} else if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			ret = 1;
+	}
+
+	return ret;
+#else
+	curl_socket_t wake = sctx->wakesock[0];
+	struct timeval tv;
+	fd_set rd, wd;
+	char drain[64];
+	int n;
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	FD_ZERO(&rd);
+	FD_ZERO(&wd);
+	FD_SET(sctx->sock, &rd);
+	FD_SET(wake, &rd);
+	FD_SET(sctx->sock, &wd);
+	n = select((int)max(sctx->sock, wake) + 1, &rd, pending ? &wd : NULL, NULL, &tv);
+	if (n < 0)
+		return -1;
+
+	if (n > 0 && FD_ISSET(wake, &rd)) {
+		while (recv(wake, drain, sizeof(drain), 0) > 0)
+			;
+	}
+
+	return (n > 0 && FD_ISSET(sctx->sock, &rd)) ? 1 : 0;
+#endif
+}
+
+/**
+ * Event loop of an online connection: writes the lines queued by any
+ * thread and receives, without blocking on either, until a line arrives
+ * @param timeout int seconds without any line before giving up
+ * @return the line in the receive buffer, valid until the next call,
+ * or NULL on failure
+ */
+char *stratum_next_line(struct stratum_ctx *sctx, int timeout)
+{
+	time_t rstart = time(NULL);
+	char *sret;
+	int left, ready;
+	ssize_t n;
+
+	while (1) {
+		if (!stratum_flush(sctx)) {
+			applog(LOG_ERR, "stratum_next_line send failed");
+			return NULL;
+		}
+
+		sret = stratum_buffer_line(sctx);
+		if (sret)
+			break;
+
+		left = timeout - (int)(time(NULL) - rstart);
+		if (left <= 0) {
+			applog(LOG_ERR, "Stratum connection timed out");
+			return NULL;
+		}
+
+		ready = stratum_wait(sctx, left * 1000);
+		if (ready < 0) {
+			applog(LOG_ERR, "stratum_next_line wait failed");
+			return NULL;
+		}
+		if (!ready)
+			continue;
+
+		stratum_buffer_reserve(sctx);
+		n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_wpos, RECVSIZE, 0);
+		if (!n || (n < 0 && !socket_blocks()))
+			return NULL;
+		if (n > 0)
+			sctx->sockbuf_wpos += n;
+	}
+
+	if (opt_protocol)
 		applog(LOG_DEBUG, "< %s", sret);
 	return sret;
 }
@@ -798,7 +1187,7 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 		sctx->sockbuf = (char*)calloc(RBUFSIZE, 1);
 		sctx->sockbuf_size = RBUFSIZE;
 	}
-	sctx->sockbuf[0] = '\0';
+	stratum_buffer_reset(sctx);
 	pthread_mutex_unlock(&sctx->sock_lock);
 
 	if (url != sctx->url) {
@@ -856,13 +1245,172 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 void stratum_disconnect(struct stratum_ctx *sctx)
 {
 	pthread_mutex_lock(&sctx->sock_lock);
+	stratum_set_online(sctx, false);
 	if (sctx->curl) {
 		sctx->disconnects++;
 		curl_easy_cleanup(sctx->curl);
 		sctx->curl = NULL;
-		sctx->sockbuf[0] = '\0';
+		stratum_buffer_reset(sctx);
 	}
 	pthread_mutex_unlock(&sctx->sock_lock);
+
+	/* answers do not survive the connection */
+	stratum_shares_forget(sctx);
+}
+
+/* Must be called with share_lock held */
+static struct stratum_share *stratum_share_find(struct stratum_ctx *sctx, uint32_t id)
+{
+	uint32_t mask = sctx->inflight_size - 1;
+	uint32_t i;
+
+	for (i = id & mask; sctx->inflight[i].id; i = (i + 1) & mask) {
+		if (sctx->inflight[i].id == id)
+			return &sctx->inflight[i];
+	}
+	return NULL;
+}
+
+/* Must be called with share_lock held, ent must be in the table */
+static void stratum_share_remove(struct stratum_ctx *sctx, struct stratum_share *ent)
+{
+	uint32_t mask = sctx->inflight_size - 1;
+	uint32_t hole = (uint32_t) (ent - sctx->inflight);
+	uint32_t i, home;
+
+	/* no tombstones: later entries of the probe run move up into the hole */
+	for (i = (hole + 1) & mask; sctx->inflight[i].id; i = (i + 1) & mask) {
+		home = sctx->inflight[i].id & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			sctx->inflight[hole] = sctx->inflight[i];
+			hole = i;
+		}
+	}
+	sctx->inflight[hole].id = 0;
+	sctx->inflight_count--;
+}
+
+/* Must be called with share_lock held */
+static void stratum_share_insert(struct stratum_ctx *sctx, const struct stratum_share *share)
+{
+	uint32_t mask = sctx->inflight_size - 1;
+	uint32_t i;
+
+	for (i = share->id & mask; sctx->inflight[i].id; i = (i + 1) & mask)
+		;
+	sctx->inflight[i] = *share;
+	sctx->inflight_count++;
+}
+
+/**
+ * Make room for one more share: grow the table while it is at most half
+ * full, forget the oldest share once it has the largest size
+ * Must be called with share_lock held
+ * @return bool false if there is no table
+ */
+static bool stratum_share_room(struct stratum_ctx *sctx)
+{
+	struct stratum_share *old = sctx->inflight;
+	uint32_t old_size = sctx->inflight_size;
+	uint32_t size, i;
+
+	if (old && (sctx->inflight_count + 1) * 2 <= old_size)
+		return true;
+
+	size = old ? old_size * 2 : STRATUM_MIN_INFLIGHT;
+	if (size <= STRATUM_MAX_INFLIGHT) {
+		struct stratum_share *table = (struct stratum_share *) calloc(size, sizeof(*table));
+		if (table) {
+			sctx->inflight = table;
+			sctx->inflight_size = size;
+			sctx->inflight_count = 0;
+			for (i = 0; i < old_size; i++) {
+				if (old[i].id)
+					stratum_share_insert(sctx, &old[i]);
+			}
+			free(old);
+			return true;
+		}
+	}
+	if (!old)
+		return false;
+
+	if (sctx->inflight_count == old_size - 1) {
+		struct stratum_share *oldest = NULL;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].id && (!oldest || old[i].id - sctx->submit_id < oldest->id - sctx->submit_id))
+				oldest = &old[i];
+		}
+		if (opt_debug)
+			applog(LOG_DEBUG, "share %u got no answer", oldest->id);
+		stratum_share_remove(sctx, oldest);
+		sctx->unanswered++;
+	}
+	return true;
+}
+
+/**
+ * Allocate the id of a mining.submit and remember when it was sent;
+ * the oldest share is forgotten if STRATUM_MAX_INFLIGHT are unanswered
+ */
+uint32_t stratum_share_sent(struct stratum_ctx *sctx, const struct work *work)
+{
+	struct stratum_share share;
+
+	pthread_mutex_lock(&sctx->share_lock);
+	share.id = ++sctx->submit_id;
+	if (share.id < STRATUM_SUBMIT_ID)
+		share.id = sctx->submit_id = STRATUM_SUBMIT_ID;
+	share.nonce = work->data[19];
+	share.thr_id = work->thr_id;
+	share.hashes = target_to_hashes(work->target);
+	gettimeofday(&share.tv_submit, NULL);
+
+	if (stratum_share_room(sctx))
+		stratum_share_insert(sctx, &share);
+	else
+		sctx->unanswered++;
+	pthread_mutex_unlock(&sctx->share_lock);
+
+	return share.id;
+}
+
+/**
+ * Take the share answered by the response with this id
+ * @param share struct stratum_share* filled if not NULL
+ * @return false if no such share is waiting
+ */
+bool stratum_share_answered(struct stratum_ctx *sctx, uint32_t id, struct stratum_share *share)
+{
+	struct stratum_share *ent = NULL;
+
+	pthread_mutex_lock(&sctx->share_lock);
+	if (id && sctx->inflight)
+		ent = stratum_share_find(sctx, id);
+	if (ent) {
+		if (share)
+			memcpy(share, ent, sizeof(*share));
+		stratum_share_remove(sctx, ent);
+	}
+	pthread_mutex_unlock(&sctx->share_lock);
+
+	return ent != NULL;
+}
+
+/**
+ * Forget the shares waiting for an answer, the connection is gone
+ */
+void stratum_shares_forget(struct stratum_ctx *sctx)
+{
+	pthread_mutex_lock(&sctx->share_lock);
+	if (sctx->inflight_count) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "%u shares got no answer", sctx->inflight_count);
+		sctx->unanswered += sctx->inflight_count;
+		memset(sctx->inflight, 0, sctx->inflight_size * sizeof(*sctx->inflight));
+		sctx->inflight_count = 0;
+	}
+	pthread_mutex_unlock(&sctx->share_lock);
 }
 
 static const char *get_stratum_session_id(json_t *val)
@@ -961,7 +1509,6 @@ start:
 		goto out;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1041,11 +1588,9 @@ bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *p
 			goto out;
 		if (!stratum_handle_method(sctx, sret))
 			break;
-		free(sret);
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1095,7 +1640,6 @@ bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *p
 			}
 			json_decref(extra);
 		}
-		free(sret);
 	}
 	}
 
@@ -1144,7 +1688,7 @@ static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
 	bool clean, ret = false;
     uint merkle_count, i;
 	json_t *merkle_arr;
-	uchar **merkle;
+	uchar *merkle;
 	int ntime;
 
 	job_id = json_string_value(json_array_get(params, 0));
@@ -1177,18 +1721,15 @@ static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
 			applog(LOG_DEBUG, "stratum time is at least %ds in the future", ntime);
 	}
 
-	merkle = (uchar**) malloc(merkle_count * sizeof(char *));
+	merkle = (uchar*) malloc(merkle_count * 32 + 1);
 	for (i = 0; i < merkle_count; i++) {
 		const char *s = json_string_value(json_array_get(merkle_arr, i));
 		if (!s || strlen(s) != 64) {
-			while (i--)
-				free(merkle[i]);
 			free(merkle);
 			applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
 			goto out;
 		}
-		merkle[i] = (uchar*) malloc(32);
-		hex2bin(merkle[i], s, 32);
+		hex2bin(merkle + i * 32, s, 32);
 	}
 
 	pthread_mutex_lock(&sctx->work_lock);
@@ -1207,14 +1748,16 @@ static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
 		memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
 	hex2bin(sctx->job.xnonce2 + sctx->xnonce2_size, coinb2, coinb2_size);
 
+	/* the coinbase prefix is the same for every extranonce2 */
+	sctx->job.coinbase_midlen = sha256_midstate(sctx->job.coinbase_midstate,
+		sctx->job.coinbase, (int)(coinb1_size + sctx->xnonce1_size));
+
 	free(sctx->job.job_id);
 	sctx->job.job_id = strdup(job_id);
 	hex2bin(sctx->job.prevhash, prevhash, 32);
 
 	sctx->job.height = getblocheight(sctx);
 
-    for(i = 0; i < (uint)sctx->job.merkle_count; i++)
-      free(sctx->job.merkle[i]);
 	free(sctx->job.merkle);
 	sctx->job.merkle = merkle;
 	sctx->job.merkle_count = merkle_count;
@@ -1392,7 +1935,6 @@ struct thread_q *tq_new(void)
 	if (!tq)
 		return NULL;
 
-	INIT_LIST_HEAD(&tq->q);
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
 
@@ -1401,16 +1943,9 @@ struct thread_q *tq_new(void)
 
 void tq_free(struct thread_q *tq)
 {
-	struct tq_ent *ent, *iter;
-
 	if (!tq)
 		return;
 
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node, struct tq_ent, struct tq_ent) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
 	pthread_cond_destroy(&tq->cond);
 	pthread_mutex_destroy(&tq->mutex);
 
@@ -1438,24 +1973,20 @@ void tq_thaw(struct thread_q *tq)
 	tq_freezethaw(tq, false);
 }
 
+/**
+ * Queue a message
+ * @return bool false if the queue is frozen or full (TQ_DEPTH messages)
+ */
 bool tq_push(struct thread_q *tq, void *data)
 {
-	struct tq_ent *ent;
 	bool rc = true;
 
-	ent = (struct tq_ent *)calloc(1, sizeof(*ent));
-	if (!ent)
-		return false;
-
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
-
 	pthread_mutex_lock(&tq->mutex);
 
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
+	if (!tq->frozen && tq->count < TQ_DEPTH) {
+		tq->ring[(tq->head + tq->count) % TQ_DEPTH] = data;
+		tq->count++;
 	} else {
-		free(ent);
 		rc = false;
 	}
 
@@ -1467,13 +1998,12 @@ bool tq_push(struct thread_q *tq, void *data)
 
 void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 {
-	struct tq_ent *ent;
 	void *rval = NULL;
 	int rc;
 
 	pthread_mutex_lock(&tq->mutex);
 
-	if (!list_empty(&tq->q))
+	if (tq->count)
 		goto pop;
 
 	if (abstime)
@@ -1482,15 +2012,13 @@ void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
 	if (rc)
 		goto out;
-	if (list_empty(&tq->q))
+	if (!tq->count)
 		goto out;
 
 pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
-
-	list_del(&ent->q_node);
-	free(ent);
+	rval = tq->ring[tq->head];
+	tq->head = (tq->head + 1) % TQ_DEPTH;
+	tq->count--;
 
 out:
 	pthread_mutex_unlock(&tq->mutex);
@@ -0,0 +1,134 @@
+/**
+ * CPU verification of GPU found nonces
+ *
+ * GPU threads queue their candidates and carry on hashing while
+ * a pool of verification threads takes them in batches through the
+ * multi-lane NeoScrypt engine; good shares are passed on for submission
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "log.h"
+
+/* Candidates waiting, GPU threads block if the queue is full */
+#define VERIFY_QUEUE_DEPTH 64
+/* Candidates taken by a verification thread at once */
+#define VERIFY_MAX_BATCH   16
+
+struct verify_ent {
+	struct thr_info *thr;
+	struct work work;
+};
+
+static struct verify_ent vqueue[VERIFY_QUEUE_DEPTH];
+static uint vhead = 0;
+static uint vcount = 0;
+
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t verify_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t verify_room = PTHREAD_COND_INITIALIZER;
+
+static verify_submit_fn verify_submit = NULL;
+
+static void *verify_thread(void *userdata)
+{
+	struct verify_ent *batch;
+	uchar data[VERIFY_MAX_BATCH * 80];
+	uint hash[VERIFY_MAX_BATCH * 8];
+	uint count, i;
+
+	batch = (struct verify_ent *) calloc(VERIFY_MAX_BATCH, sizeof(*batch));
+	if (!batch) {
+		applog(LOG_ERR, "verify thread OOM");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&verify_lock);
+		while (!vcount)
+			pthread_cond_wait(&verify_ready, &verify_lock);
+
+		count = min(vcount, VERIFY_MAX_BATCH);
+		for (i = 0; i < count; i++) {
+			memcpy(&batch[i], &vqueue[vhead], sizeof(*batch));
+			vhead = (vhead + 1) % VERIFY_QUEUE_DEPTH;
+		}
+		vcount -= count;
+
+		pthread_cond_broadcast(&verify_room);
+		pthread_mutex_unlock(&verify_lock);
+
+		/* Input data must be little endian already */
+		for (i = 0; i < count; i++)
+			memcpy(&data[i * 80], batch[i].work.data, 80);
+
+		if (neoscrypt_xN(data, (uchar *) hash, count)) {
+			applog(LOG_ERR, "verify thread OOM, %u nonces dropped", count);
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			struct verify_ent *ent = &batch[i];
+
+			if (hash[i * 8 + 7] > ent->work.target[7]) {
+				gpulog(LOG_INFO, ent->thr->id, "nonce 0x%08X fails CPU verification!",
+					ent->work.data[19]);
+				continue;
+			}
+
+			if (opt_benchmark)
+				continue;
+
+			if (!verify_submit(ent->thr, &ent->work))
+				gpulog(LOG_ERR, ent->thr->id, "nonce 0x%08X submission failed",
+					ent->work.data[19]);
+		}
+	}
+
+	free(batch);
+	return NULL;
+}
+
+/**
+ * Start the verification threads
+ * @param workers int number of threads
+ * @param submit verify_submit_fn called for every good share
+ */
+bool verify_init(int workers, verify_submit_fn submit)
+{
+	pthread_t pth;
+	int i;
+
+	verify_submit = submit;
+
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&pth, NULL, verify_thread, NULL))
+			return false;
+		pthread_detach(pth);
+	}
+
+	return true;
+}
+
+/**
+ * Queue a candidate, the nonce is in work->data[19];
+ * the calling GPU thread blocks while the queue is full
+ */
+void verify_push(struct thr_info *thr, const struct work *work)
+{
+	struct verify_ent *ent;
+
+	pthread_mutex_lock(&verify_lock);
+	while (vcount == VERIFY_QUEUE_DEPTH)
+		pthread_cond_wait(&verify_room, &verify_lock);
+
+	ent = &vqueue[(vhead + vcount) % VERIFY_QUEUE_DEPTH];
+	ent->thr = thr;
+	memcpy(&ent->work, work, sizeof(*work));
+	vcount++;
+
+	pthread_cond_signal(&verify_ready);
+	pthread_mutex_unlock(&verify_lock);
+}
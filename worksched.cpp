@@ -0,0 +1,120 @@
+/**
+ * Work space scheduler
+ *
+ * The work published to the miner threads covers WORK_SCHED_ROLLS
+ * extranonce2 values of 2^32 nonces each. Threads claim slices of it
+ * sized from their own hashrate with a single atomic add on a cursor,
+ * so the slices neither overlap nor leave gaps whatever the number and
+ * the speed of the devices. The cursor packs the epoch of the work,
+ * the extranonce2 roll and the nonce, a new work starts a new epoch.
+ *
+ * Nothing here depends on the miner state, devices can be simulated
+ * by claiming from a struct work_sched of their own
+ */
+#include <string.h>
+
+#include "miner.h"
+
+/* nonces of a roll, fewer to simulate the use of a whole work space */
+#ifndef WORK_SCHED_NONCE_BITS
+#define WORK_SCHED_NONCE_BITS 32
+#endif
+#define WORK_SCHED_ROLL_BITS  16
+#define WORK_SCHED_NONCES     (1ULL << WORK_SCHED_NONCE_BITS)
+
+#define cursor_epoch(c) ((uint32_t) ((c) >> (WORK_SCHED_NONCE_BITS + WORK_SCHED_ROLL_BITS)) & 0xffff)
+#define cursor_roll(c)  ((uint32_t) ((c) >> WORK_SCHED_NONCE_BITS) & 0xffff)
+#define cursor_nonce(c) ((c) & (WORK_SCHED_NONCES - 1))
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define cursor_add(p, v) ((uint64_t) _InterlockedExchangeAdd64((volatile __int64 *) (p), (__int64) (v)))
+#define cursor_store(p, v) _InterlockedExchange64((volatile __int64 *) (p), (__int64) (v))
+#else
+#define cursor_add(p, v) __atomic_fetch_add((p), (uint64_t) (v), __ATOMIC_SEQ_CST)
+#define cursor_store(p, v) __atomic_store_n((p), (uint64_t) (v), __ATOMIC_SEQ_CST)
+#endif
+
+/**
+ * Start the work space of a new work
+ * @param ws struct work_sched *
+ * @param epoch uint32_t of the work, only the low 16 bits are kept
+ * @param rolls uint32_t extranonce2 values reserved for the work
+ */
+void work_sched_reset(struct work_sched *ws, uint32_t epoch, uint32_t rolls)
+{
+	ws->rolls = min(rolls, WORK_SCHED_ROLLS);
+	cursor_store(&ws->cursor, (uint64_t) (epoch & 0xffff) <<
+		(WORK_SCHED_NONCE_BITS + WORK_SCHED_ROLL_BITS));
+}
+
+/**
+ * Claim the next nonces of the work space
+ * @param ws struct work_sched *
+ * @param size uint64_t nonces wanted, 1 to 2^32 (the nonces of a roll)
+ * @param slices struct work_slice[2] receiving the claim, split in two
+ *        when it runs from an extranonce2 roll into the next one
+ * @return int number of slices, 0 if the work space is used up
+ */
+int work_sched_claim(struct work_sched *ws, uint64_t size, struct work_slice *slices)
+{
+	uint64_t c, first;
+	uint32_t epoch, roll;
+	int n = 0;
+
+	size = min(size, WORK_SCHED_NONCES);
+	c = cursor_add(&ws->cursor, size);
+	first = cursor_nonce(c);
+	epoch = cursor_epoch(c);
+	roll = cursor_roll(c);
+
+	if (roll >= ws->rolls)
+		return 0;
+
+	slices[n].epoch = epoch;
+	slices[n].roll = roll;
+	slices[n].first = (uint32_t) first;
+	if (first + size <= WORK_SCHED_NONCES) {
+		slices[n++].last = (uint32_t) (first + size - 1);
+		return n;
+	}
+	slices[n++].last = (uint32_t) (WORK_SCHED_NONCES - 1);
+
+	if (roll + 1 < ws->rolls) {
+		slices[n].epoch = epoch;
+		slices[n].roll = roll + 1;
+		slices[n].first = 0;
+		slices[n++].last = (uint32_t) (first + size - WORK_SCHED_NONCES - 1);
+	}
+	return n;
+}
+
+/**
+ * Slice size for a device
+ * @param hashrate double measured, 0 if not known yet
+ * @param seconds double of hashing wanted
+ * @param minimum uint64_t nonces, used while the hashrate is unknown
+ * @return uint64_t nonces, a multiple of WORK_SCHED_GRAIN up to a roll
+ */
+uint64_t work_sched_size(double hashrate, double seconds, uint64_t minimum)
+{
+	double want = hashrate * seconds;
+	uint64_t size;
+
+	if (want < (double) minimum)
+		want = (double) minimum;
+	if (want >= (double) WORK_SCHED_NONCES)
+		return WORK_SCHED_NONCES;
+
+	size = ((uint64_t) want + WORK_SCHED_GRAIN - 1) & ~(uint64_t) (WORK_SCHED_GRAIN - 1);
+	return max(size, (uint64_t) WORK_SCHED_GRAIN);
+}
+
+/**
+ * Tell if a slice belongs to an older, newer or the same epoch
+ * @return int < 0, > 0 or 0
+ */
+int work_sched_cmp_epoch(uint32_t a, uint32_t b)
+{
+	return (int16_t) (uint16_t) (a - b);
+}